@@ -0,0 +1,161 @@
+#include <stdio.h>
+#include <time.h>
+#include "../circular_buffer/recent_messages.h"
+
+
+// Short messages run out of entries before bytes and long ones the other way round, so the first round checks
+// readers against reused entries and the second one against overwritten bytes
+#define STRESS_SHORT_HISTORY 64
+#define STRESS_SHORT_MESSAGE (RECENT_MESSAGES_ENTRY_SIZE / 2)
+#define STRESS_LONG_HISTORY 1024
+#define STRESS_LONG_MESSAGE (MESSAGE_SIZE - 1)
+#define STRESS_MESSAGES 200000
+#define STRESS_READERS 4
+#define STRESS_HEADER_SIZE 24
+
+
+typedef struct {
+    RecentMessages *recent_messages;
+    size_t longest;
+    bool *done;
+    u_int64_t reads;
+    u_int64_t rejected;
+    u_int64_t snapshots;
+    u_int64_t errors;
+} StressReader;
+
+
+// Messages vary in length so they are written across each other's bytes, the filler depends on the index
+size_t length_stress(u_int64_t index, size_t longest) {
+    return STRESS_HEADER_SIZE + 1 + index * 7919 % (longest - STRESS_HEADER_SIZE);
+}
+
+char filler_stress(u_int64_t index, size_t position) {
+    return (char) ('a' + (index + position) % 26);
+}
+
+size_t format_stress(char *buffer, u_int64_t index, size_t longest) {
+    size_t length = length_stress(index, longest);
+
+    snprintf(buffer, STRESS_HEADER_SIZE + 1, "#%0*lu", STRESS_HEADER_SIZE - 1, index);
+    for (size_t i = STRESS_HEADER_SIZE; i < length - 1; ++i) buffer[i] = filler_stress(index, i);
+    buffer[length - 1] = '\n';
+    return length;
+}
+
+// Returns whether the message is the whole message formatted for the expected index
+bool check_stress(const char *message, size_t size, u_int64_t index, size_t longest) {
+    char *end;
+
+    if (size != length_stress(index, longest) || message[0] != '#' || message[size - 1] != '\n') return false;
+    if (strtoull(message + 1, &end, 10) != index || end != message + STRESS_HEADER_SIZE) return false;
+    for (size_t i = STRESS_HEADER_SIZE; i < size - 1; ++i) {
+        if (message[i] != filler_stress(index, i)) return false;
+    }
+    return true;
+}
+
+// Reads every stored message one by one, the way a resuming client is sent the messages it missed
+void read_range_stress(StressReader *reader) {
+    char message[MESSAGE_SIZE];
+    size_t size;
+    u_int64_t next = next_recent_messages(reader->recent_messages);
+
+    for (u_int64_t index = first_recent_messages(reader->recent_messages); index < next; ++index) {
+        if (!read_recent_messages(reader->recent_messages, index, message, &size)) {
+            ++reader->rejected;
+            continue;
+        }
+        ++reader->reads;
+        if (!check_stress(message, size, index, reader->longest)) {
+            if (reader->errors++ == 0) printf("Torn message %lu: %.*s\n", index, STRESS_HEADER_SIZE, message);
+        }
+    }
+}
+
+// Takes the shared snapshot a joining client is sent, its messages must be whole and strictly increasing
+void read_snapshot_stress(StressReader *reader) {
+    RecentSnapshot snapshot;
+    u_int64_t previous = 0;
+    bool first = true;
+
+    if (!snapshot_recent_messages(reader->recent_messages, &snapshot)) return;
+    ++reader->snapshots;
+    for (size_t offset = 0; offset < snapshot.size;) {
+        char *message = snapshot.buffer->data + offset;
+        char *newline = memchr(message, '\n', snapshot.size - offset);
+        size_t size = newline != NULL ? (size_t) (newline - message) + 1 : snapshot.size - offset;
+        u_int64_t index = strtoull(message + 1, NULL, 10);
+
+        if (!check_stress(message, size, index, reader->longest) || index >= snapshot.next || (!first && index <= previous)) {
+            if (reader->errors++ == 0) printf("Bad snapshot entry at %zu: %.*s\n", offset, STRESS_HEADER_SIZE, message);
+            break;
+        }
+        previous = index;
+        first = false;
+        offset += size;
+    }
+    release_shared_buffer(snapshot.buffer);
+}
+
+void *run_reader_stress(void *arg) {
+    StressReader *reader = arg;
+
+    while (!__atomic_load_n(reader->done, __ATOMIC_ACQUIRE)) {
+        read_range_stress(reader);
+        read_snapshot_stress(reader);
+    }
+    return NULL;
+}
+
+// Adds messages while the readers check every message and snapshot they take, returns the number of errors
+u_int64_t run_stress(size_t history_size, size_t longest) {
+    RecentMessages *recent_messages = init_recent_messages(history_size);
+    StressReader readers[STRESS_READERS];
+    pthread_t threads[STRESS_READERS];
+    char message[MESSAGE_SIZE];
+    bool done = false;
+    struct timespec start, end;
+
+    if (recent_messages == NULL) {
+        printf("Cannot allocate recent messages\n");
+        return 1;
+    }
+    for (u_int32_t i = 0; i < STRESS_READERS; ++i) {
+        readers[i] = (StressReader) {.recent_messages = recent_messages, .longest = longest, .done = &done};
+        pthread_create(&threads[i], NULL, run_reader_stress, &readers[i]);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (u_int64_t index = 0; index < STRESS_MESSAGES; ++index) {
+        add_recent_messages(recent_messages, message, format_stress(message, index, longest));
+    }
+    __atomic_store_n(&done, true, __ATOMIC_RELEASE);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    StressReader total = {.recent_messages = recent_messages, .longest = longest, .done = &done};
+    for (u_int32_t i = 0; i < STRESS_READERS; ++i) {
+        pthread_join(threads[i], NULL);
+        total.reads += readers[i].reads;
+        total.rejected += readers[i].rejected;
+        total.snapshots += readers[i].snapshots;
+        total.errors += readers[i].errors;
+    }
+    // The history left once the writer is done must be read back whole
+    read_range_stress(&total);
+    read_snapshot_stress(&total);
+    free_recent_messages(recent_messages);
+
+    double seconds = (double) (end.tv_sec - start.tv_sec) + (double) (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("%5zu entries %5zu bytes  %u messages in %.2f s with %u readers: "
+           "%lu reads, %lu rejected, %lu snapshots, %lu errors\n",
+           history_size, longest, STRESS_MESSAGES, seconds, STRESS_READERS,
+           total.reads, total.rejected, total.snapshots, total.errors);
+    return total.errors;
+}
+
+int main() {
+    u_int64_t errors = run_stress(STRESS_SHORT_HISTORY, STRESS_SHORT_MESSAGE)
+                       + run_stress(STRESS_LONG_HISTORY, STRESS_LONG_MESSAGE);
+    return errors == 0 ? 0 : 1;
+}
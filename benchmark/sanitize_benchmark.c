@@ -0,0 +1,277 @@
+#include <stdio.h>
+#include <time.h>
+#include "../misc/formatting.h"
+
+
+#define BENCHMARK_SANITIZE_BYTES (256 * 1024 * 1024)
+#define BENCHMARK_CHECK_ROUNDS 100000
+#define BENCHMARK_CHECK_PIECES 80
+
+
+// The strchr based routine the sanitizer used to be, kept to compare against
+bool legacy_is_allowed_char(char c) {
+    return strchr(MESSAGE_ALLOWED_SYMBOLS, c) != NULL;
+}
+
+bool legacy_sanitize_buffer(char *buffer, size_t size) {
+    bool valid = true;
+    size_t p = 0;
+
+    for (size_t i = 0; i < size; ++i) {
+        if (legacy_is_allowed_char(buffer[i])) buffer[p++] = buffer[i];
+        else valid = false;
+    }
+    memset(buffer + p, '\0', size - p);
+
+    return valid;
+}
+
+size_t table_sanitize_buffer(char *buffer, size_t size) {
+    size_t p = 0;
+
+    for (size_t i = 0; i < size; ++i) {
+        if (is_allowed_char(buffer[i])) buffer[p++] = buffer[i];
+    }
+    return p;
+}
+
+// Decodes every code point to check it, independently of the sanitizer
+size_t reference_utf8_sanitize_buffer(char *buffer, size_t size) {
+    const u_int32_t minimum[] = {0, 0, 0x80, 0x800, 0x10000};
+    u_int8_t *data = (u_int8_t *) buffer;
+    size_t p = 0;
+    size_t i = 0;
+
+    while (i < size) {
+        u_int8_t c = data[i];
+        size_t length = c < 0x80 ? 1 : c >= 0xc0 && c < 0xe0 ? 2 : c >= 0xe0 && c < 0xf0 ? 3 : c >= 0xf0 && c < 0xf8 ? 4 : 0;
+        u_int32_t point = length == 1 ? c : length == 2 ? c & 0x1f : length == 3 ? c & 0x0f : c & 0x07;
+        bool valid = length != 0 && i + length <= size;
+
+        for (size_t k = 1; valid && k < length; ++k) {
+            if ((data[i + k] & 0xc0) != 0x80) valid = false;
+            else point = point << 6 | (data[i + k] & 0x3f);
+        }
+        if (valid) {
+            valid = point >= minimum[length] && point <= 0x10ffff && (point < 0xd800 || point > 0xdfff) &&
+                    (point < 0x80 || point >= 0xa0);
+        }
+        if (valid && length == 1) valid = c != 0 && legacy_is_allowed_char((char) c);
+        if (!valid) {
+            ++i;
+            continue;
+        }
+        memmove(buffer + p, buffer + i, length);
+        p += length;
+        i += length;
+    }
+    return p;
+}
+
+
+double elapsed_benchmark(struct timespec *start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (double) (end.tv_sec - start->tv_sec) * 1e9 + (double) (end.tv_nsec - start->tv_nsec);
+}
+
+// Printable text with the specified share of disallowed characters in every thousand
+void fill_benchmark(char *buffer, size_t size, u_int32_t disallowed, u_int32_t seed) {
+    const char *text = "Hello there, how is it going? Fine: 42 messages & counting!\n";
+    size_t length = strlen(text);
+
+    for (size_t i = 0; i < size; ++i) {
+        seed = seed * 1103515245 + 12345;
+        buffer[i] = (seed >> 16) % 1000 < disallowed ? '~' : text[i % length];
+    }
+}
+
+bool check_benchmark() {
+    char input[MESSAGE_BUFFER_SIZE];
+    char legacy[MESSAGE_BUFFER_SIZE];
+    char current[MESSAGE_BUFFER_SIZE];
+    u_int32_t seed = 1;
+
+    for (int c = 0; c < 256; ++c) {
+        if (is_allowed_char((char) c) != (c != 0 && legacy_is_allowed_char((char) c))) {
+            printf("Table differs for %d\n", c);
+            return false;
+        }
+    }
+    for (size_t round = 0; round < BENCHMARK_CHECK_ROUNDS; ++round) {
+        seed = seed * 1103515245 + 12345;
+        size_t size = (seed >> 8) % 200;
+        for (size_t i = 0; i < size; ++i) {
+            seed = seed * 1103515245 + 12345;
+            // Mostly allowed characters so that whole blocks take the vector path, never null bytes
+            input[i] = (seed >> 16) % 8 == 0 ? (char) ((seed >> 8) % 255 + 1) : (char) ('a' + (seed >> 16) % 26);
+        }
+        memcpy(legacy, input, size);
+        memcpy(current, input, size);
+        legacy_sanitize_buffer(legacy, size);
+        size_t legacy_size = strnlen(legacy, size);
+        size_t current_size = sanitize_buffer(current, size);
+        if (legacy_size != current_size || memcmp(legacy, current, current_size) != 0) {
+            printf("Sanitized buffers differ for a buffer of %zu bytes\n", size);
+            return false;
+        }
+    }
+    return true;
+}
+
+bool check_utf8_benchmark() {
+    // Valid characters of every length mixed with rejected ones: control, C1 control, overlong, surrogate,
+    // past U+10FFFF, stray continuation and cut sequences
+    const char *pieces[] = {
+            "a", "Z", " ", "\n", "\x07", "\x7f", "~", "\xc3\xa9", "\xd0\x96", "\xc2\xa9", "\xc2\x85",
+            "\xe4\xbd\xa0", "\xef\xbf\xbd", "\xf0\x9f\x8e\x89", "\xf4\x8f\xbf\xbf", "\xc0\xaf", "\xe0\x80\xaf",
+            "\xed\xa0\x80", "\xf4\x90\x80\x80", "\xf8", "\xbf", "\xe4\xbd", "\xf0\x9f\x8e"};
+    size_t count = sizeof(pieces) / sizeof(pieces[0]);
+    char input[MESSAGE_BUFFER_SIZE];
+    char reference[MESSAGE_BUFFER_SIZE];
+    char current[MESSAGE_BUFFER_SIZE];
+    u_int32_t seed = 3;
+
+    // Whole blocks of every ASCII character are checked with the vectors
+    for (int c = 0; c < 128; ++c) {
+        memset(current, c, 64);
+        if (sanitize_utf8_buffer(current, 64) != (is_allowed_char((char) c) ? 64 : 0)) {
+            printf("UTF-8 vectors differ for %d\n", c);
+            return false;
+        }
+    }
+    for (size_t round = 0; round < BENCHMARK_CHECK_ROUNDS; ++round) {
+        size_t size = 0;
+        seed = seed * 1103515245 + 12345;
+        size_t total = (seed >> 8) % BENCHMARK_CHECK_PIECES;
+        for (size_t i = 0; i < total; ++i) {
+            seed = seed * 1103515245 + 12345;
+            // Mostly valid characters so that whole blocks pass the validation
+            const char *piece = pieces[(seed >> 16) % 4 != 0 ? (seed >> 8) % 15 : (seed >> 8) % count];
+            size_t length = strlen(piece);
+            memcpy(input + size, piece, length);
+            size += length;
+        }
+        memcpy(reference, input, size);
+        memcpy(current, input, size);
+        size_t reference_size = reference_utf8_sanitize_buffer(reference, size);
+        size_t current_size = sanitize_utf8_buffer(current, size);
+        if (reference_size != current_size || memcmp(reference, current, current_size) != 0) {
+            printf("Sanitized UTF-8 buffers differ for a buffer of %zu bytes\n", size);
+            return false;
+        }
+    }
+    return true;
+}
+
+void run_sanitize_benchmark(size_t size, u_int32_t disallowed) {
+    char *input = malloc(size);
+    char *buffer = malloc(size);
+    size_t rounds = BENCHMARK_SANITIZE_BYTES / size;
+    struct timespec start;
+    // Keeps the results from being optimized away
+    volatile size_t sink = 0;
+
+    fill_benchmark(input, size, disallowed, 7);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t i = 0; i < rounds; ++i) {
+        memcpy(buffer, input, size);
+        sink += legacy_sanitize_buffer(buffer, size);
+    }
+    double legacy = elapsed_benchmark(&start);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t i = 0; i < rounds; ++i) {
+        memcpy(buffer, input, size);
+        sink += table_sanitize_buffer(buffer, size);
+    }
+    double table = elapsed_benchmark(&start);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t i = 0; i < rounds; ++i) {
+        memcpy(buffer, input, size);
+        sink += sanitize_buffer(buffer, size);
+    }
+    double current = elapsed_benchmark(&start);
+
+    double bytes = (double) rounds * (double) size;
+    printf("%8zu bytes %4u/1000 disallowed  strchr %7.2f GB/s  table %7.2f GB/s  vector %7.2f GB/s\n",
+           size, disallowed, bytes / legacy, bytes / table, bytes / current);
+    free(input);
+    free(buffer);
+}
+
+// Repeats the text up to the last whole character, replacing the specified share of bytes in every thousand
+void fill_utf8_benchmark(char *buffer, size_t size, const char *text, u_int32_t disallowed, u_int32_t seed) {
+    size_t length = strlen(text);
+    size_t i = 0;
+
+    for (; i + length <= size; i += length) memcpy(buffer + i, text, length);
+    memset(buffer + i, ' ', size - i);
+    for (i = 0; i < size; ++i) {
+        seed = seed * 1103515245 + 12345;
+        if ((seed >> 16) % 1000 < disallowed) buffer[i] = '~';
+    }
+}
+
+void run_utf8_benchmark(const char *name, const char *text, size_t size, u_int32_t disallowed) {
+    char *input = malloc(size);
+    char *buffer = malloc(size);
+    size_t rounds = BENCHMARK_SANITIZE_BYTES / size;
+    struct timespec start;
+    volatile size_t sink = 0;
+
+    fill_utf8_benchmark(input, size, text, disallowed, 11);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t i = 0; i < rounds; ++i) {
+        memcpy(buffer, input, size);
+        sink += sanitize_buffer(buffer, size);
+    }
+    double ascii = elapsed_benchmark(&start);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t i = 0; i < rounds; ++i) {
+        memcpy(buffer, input, size);
+        sink += sanitize_utf8_buffer(buffer, size);
+    }
+    double utf8 = elapsed_benchmark(&start);
+
+    double bytes = (double) rounds * (double) size;
+    printf("%-8s %8zu bytes %4u/1000 disallowed  ascii %7.2f GB/s  utf8 %7.2f GB/s\n",
+           name, size, disallowed, bytes / ascii, bytes / utf8);
+    free(input);
+    free(buffer);
+}
+
+int main() {
+    size_t sizes[] = {64, 512, MESSAGE_BUFFER_SIZE - 1};
+    u_int32_t disallowed[] = {0, 1, 50};
+    // Mixed-script chat lines, the latin one has characters starting with 0xc2 which are checked one by one
+    const char *corpora[][2] = {
+            {"english", "Hello there, how is it going? Fine: 42 messages & counting!\n"},
+            {"latin", "\xc2\xab Ol\xc3\xa1, \xc3\xa7" "a va? 20 \xc2\xb0" "C \xc2\xbb \xc2\xa9 M\xc3\xbcller\n"},
+            {"cyrillic", "\xd0\x9f\xd1\x80\xd0\xb8\xd0\xb2\xd0\xb5\xd1\x82, \xd0\xba\xd0\xb0\xd0\xba "
+                         "\xd0\xb4\xd0\xb5\xd0\xbb\xd0\xb0? 42 \xd1\x81\xd0\xbe\xd0\xbe\xd0\xb1\xd1\x89\xd0\xb5\xd0\xbd\xd0\xb8\xd1\x8f!\n"},
+            {"cjk", "\xe4\xbd\xa0\xe5\xa5\xbd\xef\xbc\x8c\xe6\x9c\x80\xe8\xbf\x91\xe6\x80\x8e\xe4\xb9\x88\xe6\xa0\xb7"
+                    "\xef\xbc\x9f 42 \xe6\x9d\xa1\xe6\xb6\x88\xe6\x81\xaf\n"},
+            {"mixed", "Hi \xf0\x9f\x91\x8b \xd0\xbc\xd0\xb8\xd1\x80 \xe4\xb8\x96\xe7\x95\x8c caf\xc3\xa9 \xf0\x9f\x8e\x89 42!\n"}};
+    size_t utf8_sizes[] = {512, MESSAGE_BUFFER_SIZE - 1};
+    u_int32_t utf8_disallowed[] = {0, 1};
+
+    if (!check_benchmark() || !check_utf8_benchmark()) return 1;
+#ifdef FORMATTING_SIMD
+    printf("Sanitizing with %s\n", __builtin_cpu_supports("avx2") ? "AVX2" : "SSE2");
+#endif
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+        for (size_t j = 0; j < sizeof(disallowed) / sizeof(disallowed[0]); ++j) {
+            run_sanitize_benchmark(sizes[i], disallowed[j]);
+        }
+    }
+    for (size_t c = 0; c < sizeof(corpora) / sizeof(corpora[0]); ++c) {
+        for (size_t i = 0; i < sizeof(utf8_sizes) / sizeof(utf8_sizes[0]); ++i) {
+            for (size_t j = 0; j < sizeof(utf8_disallowed) / sizeof(utf8_disallowed[0]); ++j) {
+                run_utf8_benchmark(corpora[c][0], corpora[c][1], utf8_sizes[i], utf8_disallowed[j]);
+            }
+        }
+    }
+    return 0;
+}
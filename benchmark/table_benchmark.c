@@ -0,0 +1,205 @@
+#include <stdio.h>
+#include <time.h>
+#include "../hash_table/table.h"
+#include "../hash_table/int_table.h"
+
+
+// A miss in the legacy table walks every occupied slot, only a sample of them is timed
+#define BENCHMARK_MAX_MISSES 1024
+#define BENCHMARK_MAX_KEY_SIZE 1024
+#define BENCHMARK_HASH_BYTES (64 * 1024 * 1024)
+
+
+// File descriptor keys stored inline, the way the specialized tables are meant to be instantiated
+INT_TABLE_DECLARE(FdTable, fd_table, int32_t)
+INT_TABLE_DEFINE(FdTable, fd_table, int32_t)
+
+
+// The djb2 hash and fixed size linear probing table the connection table used to be, kept to compare against
+u_int64_t legacy_hash(const u_int8_t *data, size_t size) {
+    u_int64_t hash_value = 5381;
+    for (size_t i = 0; i < size; ++i) hash_value = hash_value * 33 + data[i];
+    return hash_value;
+}
+
+typedef struct {
+    void *key;
+    void *value;
+} LegacyItem;
+
+typedef struct {
+    size_t size;
+    LegacyItem *storage;
+} LegacyTable;
+
+
+LegacyTable *init_legacy_table(size_t size) {
+    LegacyTable *table = malloc(sizeof(LegacyTable));
+    if (table == NULL) return NULL;
+
+    table->storage = calloc(size, sizeof(LegacyItem));
+    if (table->storage == NULL) {
+        free(table);
+        return NULL;
+    }
+    table->size = size;
+    return table;
+}
+
+bool set_legacy_table(LegacyTable *table, void *key, size_t size, void *value) {
+    u_int64_t hash_value = legacy_hash(key, size) % table->size;
+
+    for (size_t i = 0; i < table->size; ++i) {
+        u_int64_t index = (hash_value + i) % table->size;
+        if (table->storage[index].key == NULL) {
+            table->storage[index].key = key;
+            table->storage[index].value = value;
+            return true;
+        } else if (memcmp(key, table->storage[index].key, size) == 0) {
+            table->storage[index].value = value;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool get_legacy_table(LegacyTable *table, void *key, size_t size, void **result) {
+    u_int64_t hash_value = legacy_hash(key, size) % table->size;
+
+    if (table->storage[hash_value].key == NULL) {
+        *result = NULL;
+        return false;
+    }
+    for (size_t i = 0; i < table->size; ++i) {
+        u_int64_t index = (hash_value + i) % table->size;
+        if (table->storage[index].key == NULL || memcmp(key, table->storage[index].key, size) != 0) continue;
+        *result = table->storage[index].value;
+        return true;
+    }
+    *result = NULL;
+    return false;
+}
+
+bool clear_legacy_table(LegacyTable *table, void *key, size_t size) {
+    return set_legacy_table(table, key, size, NULL);
+}
+
+void free_legacy_table(LegacyTable *table) {
+    free(table->storage);
+    free(table);
+}
+
+
+double elapsed_benchmark(struct timespec *start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (double) (end.tv_sec - start->tv_sec) * 1e9 + (double) (end.tv_nsec - start->tv_nsec);
+}
+
+void run_hash_benchmark(size_t size) {
+    u_int8_t data[BENCHMARK_MAX_KEY_SIZE];
+    size_t rounds = BENCHMARK_HASH_BYTES / size;
+    struct timespec start;
+    // Keeps the hashes from being optimized away
+    volatile u_int64_t sink = 0;
+
+    for (size_t i = 0; i < size; ++i) data[i] = (u_int8_t) (i * 7 + 1);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t i = 0; i < rounds; ++i) {
+        data[0] = (u_int8_t) i;
+        sink += legacy_hash(data, size);
+    }
+    double legacy = elapsed_benchmark(&start) / (double) rounds;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t i = 0; i < rounds; ++i) {
+        data[0] = (u_int8_t) i;
+        sink += hash(data, size);
+    }
+    double current = elapsed_benchmark(&start) / (double) rounds;
+
+    printf("%8zu bytes  djb2 %8.1f ns  wyhash %8.1f ns\n", size, legacy, current);
+}
+
+void print_benchmark(const char *implementation, double set, double get, double miss, double clear) {
+    printf("    %-10s  set %8.1f ns  get %8.1f ns  miss %12.1f ns  clear %8.1f ns\n",
+           implementation, set, get, miss, clear);
+}
+
+void run_table_benchmark(size_t count) {
+    // File descriptor like keys, the way the server uses the table
+    int32_t *keys = malloc(count * 2 * sizeof(int32_t));
+    size_t misses = count < BENCHMARK_MAX_MISSES ? count : BENCHMARK_MAX_MISSES;
+    double set, get, miss, clear;
+    struct timespec start;
+    void *value;
+    size_t found = 0;
+
+    if (keys == NULL) return;
+    for (size_t i = 0; i < count * 2; ++i) keys[i] = (int32_t) i;
+    printf("%8zu keys\n", count);
+
+    // The legacy table cannot grow, it gets twice the slots it needs
+    LegacyTable *legacy = init_legacy_table(count * 2);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t i = 0; i < count; ++i) set_legacy_table(legacy, &keys[i], sizeof(int32_t), &keys[i]);
+    set = elapsed_benchmark(&start) / (double) count;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t i = 0; i < count; ++i) found += get_legacy_table(legacy, &keys[i], sizeof(int32_t), &value);
+    get = elapsed_benchmark(&start) / (double) count;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t i = 0; i < misses; ++i) found += get_legacy_table(legacy, &keys[count + i], sizeof(int32_t), &value);
+    miss = elapsed_benchmark(&start) / (double) misses;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t i = 0; i < count; ++i) clear_legacy_table(legacy, &keys[i], sizeof(int32_t));
+    clear = elapsed_benchmark(&start) / (double) count;
+    free_legacy_table(legacy);
+    print_benchmark("legacy", set, get, miss, clear);
+
+    // The tables start at the server default and grow on their own
+    KVTable *table = init_table(SOCKET_MAX_CONNECTIONS);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t i = 0; i < count; ++i) set_table(table, &keys[i], sizeof(int32_t), &keys[i]);
+    set = elapsed_benchmark(&start) / (double) count;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t i = 0; i < count; ++i) found += get_table(table, &keys[i], sizeof(int32_t), &value);
+    get = elapsed_benchmark(&start) / (double) count;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t i = 0; i < misses; ++i) found += get_table(table, &keys[count + i], sizeof(int32_t), &value);
+    miss = elapsed_benchmark(&start) / (double) misses;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t i = 0; i < count; ++i) clear_table(table, &keys[i], sizeof(int32_t));
+    clear = elapsed_benchmark(&start) / (double) count;
+    free_table(table);
+    print_benchmark("table", set, get, miss, clear);
+
+    FdTable *fd_table = init_fd_table(SOCKET_MAX_CONNECTIONS);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t i = 0; i < count; ++i) set_fd_table(fd_table, keys[i], &keys[i]);
+    set = elapsed_benchmark(&start) / (double) count;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t i = 0; i < count; ++i) found += get_fd_table(fd_table, keys[i], &value);
+    get = elapsed_benchmark(&start) / (double) count;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t i = 0; i < misses; ++i) found += get_fd_table(fd_table, keys[count + i], &value);
+    miss = elapsed_benchmark(&start) / (double) misses;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t i = 0; i < count; ++i) clear_fd_table(fd_table, keys[i]);
+    clear = elapsed_benchmark(&start) / (double) count;
+    free_fd_table(fd_table);
+    print_benchmark("fd table", set, get, miss, clear);
+
+    if (found != count * 3) printf("Unexpected lookups: %zu\n", found);
+    free(keys);
+}
+
+int main() {
+    size_t sizes[] = {4, 8, 64, BENCHMARK_MAX_KEY_SIZE};
+    size_t counts[] = {256, 65536, 1048576};
+
+    printf("Hash per key\n");
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) run_hash_benchmark(sizes[i]);
+    printf("Table per operation\n");
+    for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); ++i) run_table_benchmark(counts[i]);
+    return 0;
+}
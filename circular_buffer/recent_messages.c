@@ -1,74 +1,214 @@
 #include "recent_messages.h"
 
 
+static char *map_recent_messages(size_t *size, bool *huge) {
+    char *storage;
+
+    // Large histories are backed by huge pages when the system has some reserved
+    if (*size >= RECENT_MESSAGES_HUGE_PAGE_SIZE) {
+        size_t huge_size = (*size + RECENT_MESSAGES_HUGE_PAGE_SIZE - 1) & ~(size_t) (RECENT_MESSAGES_HUGE_PAGE_SIZE - 1);
+        storage = mmap(NULL, huge_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (storage != MAP_FAILED) {
+            *size = huge_size;
+            *huge = true;
+            return storage;
+        }
+    }
+
+    *huge = false;
+    storage = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (storage == MAP_FAILED) return NULL;
+    if (*size >= RECENT_MESSAGES_HUGE_PAGE_SIZE) madvise(storage, *size, MADV_HUGEPAGE);
+    return storage;
+}
+
+static RecentMessage *entry_recent_messages(RecentMessages *recent_messages, u_int64_t index) {
+    return &recent_messages->entries[index % recent_messages->size];
+}
+
 RecentMessages *init_recent_messages(size_t size) {
+    if (size == 0) return NULL;
+
     RecentMessages *buffer = malloc(sizeof(RecentMessages));
     if (buffer == NULL) return NULL;
 
-    buffer->storage = malloc(size * sizeof(char *));
-    if (buffer->storage == NULL) {
+    buffer->entries = calloc(size, sizeof(RecentMessage));
+    if (buffer->entries == NULL) {
         free(buffer);
         return NULL;
     }
+    // Sequence 0 would match message 0 before it is written
+    for (size_t i = 0; i < size; ++i) buffer->entries[i].sequence = RECENT_MESSAGES_NO_SEQUENCE;
 
-    for (size_t i = 0; i < size; i++) {
-        buffer->storage[i] = malloc(MESSAGE_SIZE * sizeof(char));
-        if (buffer->storage[i] == NULL) {
-            // Free previously allocated memory
-            for (size_t j = 0; j < i; j++) {
-                free(buffer->storage[j]);
-            }
-            free(buffer->storage);
-            free(buffer);
-            return NULL;
-        }
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    buffer->storage_size = size * RECENT_MESSAGES_ENTRY_SIZE;
+    if (buffer->storage_size < MESSAGE_SIZE * 2) buffer->storage_size = MESSAGE_SIZE * 2;
+    buffer->storage_size = (buffer->storage_size + page_size - 1) / page_size * page_size;
+    buffer->storage = map_recent_messages(&buffer->storage_size, &buffer->huge);
+    if (buffer->storage == NULL) {
+        free(buffer->entries);
+        free(buffer);
+        return NULL;
     }
 
-    buffer->head = INVALID_ADDRESS;
-    buffer->tail = INVALID_ADDRESS;
+    pthread_mutex_init(&buffer->snapshot_lock, NULL);
+    buffer->snapshot = (RecentSnapshot) {.buffer = NULL, .next = 0, .size = 0};
     buffer->size = size;
+    buffer->first = 0;
+    buffer->next = 0;
+    buffer->write = 0;
+    buffer->reserved = 0;
     return buffer;
 }
 
-bool add_recent_messages(RecentMessages *recent_messages, char *data) {
+bool add_recent_messages(RecentMessages *recent_messages, char *data, size_t size) {
     bool replaced = false;
+    u_int64_t first = recent_messages->first;
+    u_int64_t next = recent_messages->next;
 
-    if (recent_messages->head == INVALID_ADDRESS) {
-        recent_messages->head = 0;
-        recent_messages->tail = 0;
-    } else {
-        recent_messages->head = (recent_messages->head + 1) % recent_messages->size;
-        if (recent_messages->head == recent_messages->tail) {
-            recent_messages->tail = (recent_messages->tail + 1) % recent_messages->size;
-            replaced = true;
-        }
+    if (size > MESSAGE_SIZE - 1) size = MESSAGE_SIZE - 1;
+
+    // Messages are never split, the end of the storage is skipped if the message does not fit there
+    size_t position = recent_messages->write % recent_messages->storage_size;
+    if (position + size > recent_messages->storage_size) {
+        recent_messages->write += recent_messages->storage_size - position;
+        position = 0;
+    }
+
+    // Drops the oldest messages until there is a free entry and their bytes are not about to be overwritten
+    while (first < next) {
+        RecentMessage *oldest = entry_recent_messages(recent_messages, first);
+        if (next - first < recent_messages->size
+            && oldest->offset + recent_messages->storage_size >= recent_messages->write + size) break;
+        ++first;
+        replaced = true;
     }
-    memcpy(recent_messages->storage[recent_messages->head], data, MESSAGE_SIZE);
+    __atomic_store_n(&recent_messages->first, first, __ATOMIC_RELEASE);
+
+    // Readers copying bytes past the reserved offset find out their message has been overwritten
+    RecentMessage *entry = entry_recent_messages(recent_messages, next);
+    __atomic_store_n(&recent_messages->reserved, recent_messages->write + size, __ATOMIC_RELAXED);
+    __atomic_store_n(&entry->sequence, RECENT_MESSAGES_NO_SEQUENCE, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    memcpy(recent_messages->storage + position, data, size);
+    __atomic_store_n(&entry->offset, recent_messages->write, __ATOMIC_RELAXED);
+    __atomic_store_n(&entry->size, size, __ATOMIC_RELAXED);
+    __atomic_store_n(&entry->sequence, next, __ATOMIC_RELEASE);
+    __atomic_store_n(&recent_messages->next, next + 1, __ATOMIC_RELEASE);
+    recent_messages->write += size;
     return replaced;
 }
 
-bool get_head_recent_messages(RecentMessages *recent_messages, char *result, size_t index) {
-    if (recent_messages->head == INVALID_ADDRESS) return false;
-    if (index >= recent_messages->size) return false;
+u_int64_t first_recent_messages(RecentMessages *recent_messages) {
+    return __atomic_load_n(&recent_messages->first, __ATOMIC_ACQUIRE);
+}
+
+u_int64_t next_recent_messages(RecentMessages *recent_messages) {
+    return __atomic_load_n(&recent_messages->next, __ATOMIC_ACQUIRE);
+}
+
+bool seek_recent_messages(RecentMessages *recent_messages, u_int64_t index) {
+    if (recent_messages->next != 0) return false;
 
-    size_t real_index = (recent_messages->head + recent_messages->size - index) % recent_messages->size;
-    memcpy(result, recent_messages->storage[real_index], MESSAGE_SIZE);
+    recent_messages->first = index;
+    recent_messages->next = index;
     return true;
 }
 
-bool get_tail_recent_messages(RecentMessages *recent_messages, char *result, size_t index) {
-    if (recent_messages->tail == INVALID_ADDRESS) return false;
-    if (index >= recent_messages->size) return false;
+bool read_recent_messages(RecentMessages *recent_messages, u_int64_t index, char *result, size_t *size) {
+    RecentMessage *entry = entry_recent_messages(recent_messages, index);
 
-    size_t real_index = (recent_messages->tail + index) % recent_messages->size;
-    memcpy(result, recent_messages->storage[real_index], MESSAGE_SIZE);
+    if (__atomic_load_n(&entry->sequence, __ATOMIC_ACQUIRE) != index) return false;
+    u_int64_t offset = __atomic_load_n(&entry->offset, __ATOMIC_RELAXED);
+    u_int32_t length = __atomic_load_n(&entry->size, __ATOMIC_RELAXED);
+    if (length > MESSAGE_SIZE - 1) return false;
+
+    memcpy(result, recent_messages->storage + offset % recent_messages->storage_size, length);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    // The entry has been reused or its bytes reserved for a newer message while they were copied
+    if (__atomic_load_n(&entry->sequence, __ATOMIC_RELAXED) != index) return false;
+    if (__atomic_load_n(&recent_messages->reserved, __ATOMIC_RELAXED) > offset + recent_messages->storage_size) {
+        return false;
+    }
+
+    result[length] = '\0';
+    *size = length;
     return true;
 }
 
-void free_recent_messages(RecentMessages *recent_messages) {
-    for (size_t i = 0; i < recent_messages->size; i++) {
-        free(recent_messages->storage[i]);
+bool get_head_recent_messages(RecentMessages *recent_messages, char *result, size_t *size, size_t index) {
+    u_int64_t first = first_recent_messages(recent_messages);
+    u_int64_t next = next_recent_messages(recent_messages);
+    if (index >= next - first) return false;
+    return read_recent_messages(recent_messages, next - 1 - index, result, size);
+}
+
+bool get_tail_recent_messages(RecentMessages *recent_messages, char *result, size_t *size, size_t index) {
+    u_int64_t first = first_recent_messages(recent_messages);
+    if (index >= next_recent_messages(recent_messages) - first) return false;
+    return read_recent_messages(recent_messages, first + index, result, size);
+}
+
+static bool build_snapshot_recent_messages(RecentMessages *recent_messages, RecentSnapshot *snapshot) {
+    size_t capacity = RECENT_MESSAGES_SNAPSHOT_SIZE;
+    SharedBuffer *buffer = acquire_shared_buffer(NULL, capacity);
+    if (buffer == NULL) return false;
+
+    snapshot->size = 0;
+    snapshot->next = next_recent_messages(recent_messages);
+    for (u_int64_t index = first_recent_messages(recent_messages); index < snapshot->next; ++index) {
+        // Room for the longest message and its null terminator
+        if (capacity - snapshot->size < MESSAGE_SIZE) {
+            capacity *= 2;
+            SharedBuffer *grown = acquire_shared_buffer(NULL, capacity);
+            if (grown == NULL) {
+                release_shared_buffer(buffer);
+                return false;
+            }
+            memcpy(grown->data, buffer->data, snapshot->size);
+            release_shared_buffer(buffer);
+            buffer = grown;
+        }
+
+        size_t size;
+        if (!read_recent_messages(recent_messages, index, buffer->data + snapshot->size, &size)) {
+            // Dropped while read, continue from the oldest message still stored
+            u_int64_t first = first_recent_messages(recent_messages);
+            if (first > index + 1) index = first - 1;
+            continue;
+        }
+        snapshot->size += size;
+    }
+    snapshot->buffer = buffer;
+    return true;
+}
+
+bool snapshot_recent_messages(RecentMessages *recent_messages, RecentSnapshot *snapshot) {
+    pthread_mutex_lock(&recent_messages->snapshot_lock);
+
+    RecentSnapshot *current = &recent_messages->snapshot;
+    if (current->buffer == NULL || current->next != next_recent_messages(recent_messages)) {
+        RecentSnapshot built;
+        if (!build_snapshot_recent_messages(recent_messages, &built)) {
+            pthread_mutex_unlock(&recent_messages->snapshot_lock);
+            return false;
+        }
+        if (current->buffer != NULL) release_shared_buffer(current->buffer);
+        *current = built;
     }
-    free(recent_messages->storage);
+    retain_shared_buffer(current->buffer);
+    *snapshot = *current;
+
+    pthread_mutex_unlock(&recent_messages->snapshot_lock);
+    return true;
+}
+
+void free_recent_messages(RecentMessages *recent_messages) {
+    if (recent_messages->snapshot.buffer != NULL) release_shared_buffer(recent_messages->snapshot.buffer);
+    pthread_mutex_destroy(&recent_messages->snapshot_lock);
+    munmap(recent_messages->storage, recent_messages->storage_size);
+    free(recent_messages->entries);
     free(recent_messages);
 }
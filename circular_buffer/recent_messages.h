@@ -4,61 +4,122 @@
 
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
 #include "../definitions.h"
+#include "../shared_buffer/shared_buffer.h"
 
 
-// In case of freshly initialized buffer
-// Invalid addresses are set to tail and head
-#define INVALID_ADDRESS -1
+// Sequence of an entry that does not hold a readable message
+#define RECENT_MESSAGES_NO_SEQUENCE UINT64_MAX
+
+
+/**
+ * Structure representing the location of a message in the storage of a RecentMessages buffer.
+ *
+ * The structure fields are defined as follows:
+ *  - sequence: The index of the message held by the entry, counted from the first message ever added,
+ *    or RECENT_MESSAGES_NO_SEQUENCE while the entry is being written.
+ *  - offset: The position of the first byte of the message, counted from the first byte ever written.
+ *    The message is stored at offset modulo the size of the storage.
+ *  - size: The length of the message in bytes.
+ */
+typedef struct {
+    u_int64_t sequence;
+    u_int64_t offset;
+    u_int32_t size;
+} RecentMessage;
+
+
+/**
+ * Structure representing the recent messages serialized into a single contiguous shared buffer.
+ *
+ * A snapshot is shared by every connection joining while the history does not change, so the history
+ * is queued to each of them as a reference to the same buffer and sent once the socket is writable.
+ *
+ * The structure fields are defined as follows:
+ *  - buffer: The shared buffer holding the messages, from the oldest to the newest one.
+ *  - next: The index of the newest message in the snapshot plus one.
+ *  - size: The number of bytes of messages in the buffer.
+ */
+typedef struct {
+    SharedBuffer *buffer;
+    u_int64_t next;
+    size_t size;
+} RecentSnapshot;
 
 
 /**
  * Structure representing a buffer for storing recent messages.
  *
- * This structure represents a buffer used for storing recent messages. It maintains information about
- * the size of the buffer, the current head and tail positions within the buffer, and a pointer to the
- * storage array containing the messages.
+ * This structure represents a buffer used for storing recent messages. The messages are packed one after
+ * another in a single contiguous, page aligned storage, each taking only its own length, and located
+ * through a circular array of entries, so neither adding nor reading a message follows a pointer
+ * to a separate allocation.
+ *
+ * A message is dropped once more than size messages are kept, or once its bytes are needed for a newer one.
+ * The storage reserves RECENT_MESSAGES_ENTRY_SIZE bytes per entry, so long messages shorten the history.
+ *
+ * Messages are added by a single thread and read by any number of threads without locking.
+ * The writer tags every entry with the index of its message and publishes the end of the bytes it is
+ * about to overwrite before copying a message, so a reader can tell after copying a message whether
+ * its entry or bytes were reused in the meantime, and skip to a newer message instead.
  *
  * The structure fields are defined as follows:
- *  - size: The size of the buffer, indicating the maximum number of messages it can store.
- *  - head: The index of the newest message in the buffer (current head position).
- *  - tail: The index of the oldest message in the buffer (current tail position).
- *  - storage: A pointer to an array of pointers to char arrays (messages), representing the storage buffer.
+ *  - size: The maximum number of messages the buffer can store.
+ *  - first: The index of the oldest stored message, counted from the first message ever added.
+ *  - next: The index the next message will be added with, next - first messages are stored.
+ *  - entries: A circular array of size entries, the message with index i is at i modulo size.
+ *  - storage: The contiguous storage of the messages.
+ *  - storage_size: The size of the storage in bytes.
+ *  - write: The offset the next message is written at, counted from the first byte ever written.
+ *  - reserved: The end of the bytes being written or last written, readers of messages stored
+ *    less than storage_size bytes before it cannot trust what they copied.
+ *  - huge: Whether the storage is backed by huge pages.
+ *  - snapshot_lock: The mutex serializing readers building or taking the snapshot, never taken by the writer.
+ *  - snapshot: The last snapshot of the messages, with a NULL buffer if none has been taken yet.
  *
  * Example usage:
  * @code
- * RecentMessages messages;
- * messages.size = 100;
- * messages.head = -1;
- * messages.tail = -1;
- * messages.storage = (char **)malloc(messages.size * sizeof(char *));
+ * RecentMessages *messages = init_recent_messages(RECENT_MESSAGES_SIZE);
+ * u_int64_t count = next_recent_messages(messages) - first_recent_messages(messages);
  * @endcode
  */
 typedef struct {
-    u_int16_t size;
-    int32_t head;
-    int32_t tail;
-    char **storage;
+    u_int32_t size;
+    u_int64_t first;
+    u_int64_t next;
+    RecentMessage *entries;
+    char *storage;
+    size_t storage_size;
+    u_int64_t write;
+    u_int64_t reserved;
+    bool huge;
+    pthread_mutex_t snapshot_lock;
+    RecentSnapshot snapshot;
 } RecentMessages;
 
 
 /**
  * @brief Initializes a RecentMessages buffer.
  *
- * Allocates memory for a RecentMessages buffer and initializes its storage array
- * with the specified size. Each element in the storage array is allocated memory for holding
- * a message of size MESSAGE_SIZE. The function also sets the head and tail to INVALID_ADDRESS.
+ * Allocates memory for a RecentMessages buffer holding up to the specified number of messages.
+ * The storage of the messages is mapped as a single region of RECENT_MESSAGES_ENTRY_SIZE bytes per message,
+ * backed by huge pages if it spans at least RECENT_MESSAGES_HUGE_PAGE_SIZE and the system has some reserved.
  *
  * @param size The number of messages the buffer can hold.
  *
- * @return A pointer to the initialized RecentMessages buffer, or NULL if the allocation fails.
+ * @return A pointer to the initialized RecentMessages buffer, or NULL if the size is 0 or the allocation fails.
  *
  * The function performs the following steps:
  * 1. Allocates memory for the RecentMessages structure.
- * 2. Allocates memory for the storage array within the structure.
- * 3. Allocates memory for each message slot in the storage array.
- * 4. Sets the head to INVALID_ADDRESS.
+ * 2. Allocates the circular array of entries.
+ * 3. Maps the storage of the messages, rounded up to whole pages, falling back to regular pages
+ *    if huge pages are unavailable.
+ * 4. Initializes the buffer as empty.
  *
  * If any memory allocation fails, the function frees all previously allocated memory and returns NULL.
  *
@@ -76,50 +137,129 @@ RecentMessages *init_recent_messages(size_t size);
 /**
  * Adds a new message to the RecentMessages buffer.
  *
- * Inserts a new message into the RecentMessages buffer at the current head position.
- * If the buffer is full, the oldest message is overwritten. The function updates the
- * head position and, if necessary, the tail position.
+ * Appends a new message to the RecentMessages buffer after the newest one.
+ * If the buffer is full, or the storage the message needs still holds older messages,
+ * the oldest messages are dropped. Only one thread may add messages to a buffer.
  *
  * @param recent_messages A pointer to the RecentMessages buffer.
- * @param data The message to be added to the buffer. The message must be no longer
- *             than MESSAGE_SIZE.
+ * @param data The message to be added to the buffer.
+ * @param size The length of the message in bytes. Messages longer than MESSAGE_SIZE - 1 are truncated.
  *
  * @return A boolean value indicating whether an existing message was replaced:
  *         - true: an existing message was replaced.
  *         - false: no existing message was replaced.
  *
  * The function performs the following steps:
- * 1. If the buffer is empty (head is INVALID_ADDRESS), initialize the head and tail to 0.
- * 2. Otherwise, update the head to the next position in the circular buffer.
- * 3. If the head position equals the tail position, update the tail to the next position
- *    in the circular buffer and set the replaced flag to true.
- * 4. Copy the new message into the storage at the head position.
+ * 1. Skips the end of the storage if the message does not fit there, so messages are never split.
+ * 2. Drops the oldest messages while there is no free entry or their bytes overlap the new message.
+ * 3. Publishes the end of the bytes about to be written and marks the entry of the new message as being written.
+ * 4. Copies exactly size bytes of the message into the storage, records its offset and length,
+ *    then publishes the entry with the index of the message.
  *
  * Example usage:
  * @code
  * RecentMessages *messages = init_recent_messages(10);
  * if (messages != NULL) {
- *     bool replaced = add_recent_messages(messages, "Hello, world!");
+ *     bool replaced = add_recent_messages(messages, "Hello, world!", 13);
  *     if (replaced) {
  *         // Handle message replacement logic
  *     }
  * }
  * @endcode
  */
-bool add_recent_messages(RecentMessages *recent_messages, char *data);
+bool add_recent_messages(RecentMessages *recent_messages, char *data, size_t size);
+
+
+/**
+ * Returns the index of the oldest message stored in the RecentMessages buffer.
+ *
+ * Message indexes count every message ever added to the buffer, starting from 0 or the index set
+ * by seek_recent_messages, and are the sequence numbers of the messages. Can be called from any thread.
+ *
+ * @param recent_messages A pointer to the RecentMessages buffer.
+ *
+ * @return The index of the oldest stored message, equal to next_recent_messages if the buffer is empty.
+ */
+u_int64_t first_recent_messages(RecentMessages *recent_messages);
+
+
+/**
+ * Returns the index the next message added to the RecentMessages buffer will get.
+ *
+ * Can be called from any thread.
+ *
+ * @param recent_messages A pointer to the RecentMessages buffer.
+ *
+ * @return The index of the newest stored message plus one.
+ */
+u_int64_t next_recent_messages(RecentMessages *recent_messages);
+
+
+/**
+ * Sets the index the next message added to an empty RecentMessages buffer will get.
+ *
+ * Used to continue the sequence of messages restored after a restart, it must be called
+ * before any message is added and before the buffer is shared with other threads.
+ *
+ * @param recent_messages A pointer to the RecentMessages buffer.
+ * @param index The index of the next message.
+ *
+ * @return true if the index is set, false if the buffer is not empty.
+ */
+bool seek_recent_messages(RecentMessages *recent_messages, u_int64_t index);
+
+
+/**
+ * Copies a consistent snapshot of the message with the specified index.
+ *
+ * Can be called from any thread while another thread adds messages. The message is copied without
+ * locking, then checked against the entry sequence and the bytes reserved by the writer, so a message
+ * dropped or overwritten during the copy is reported as missing rather than returned torn.
+ *
+ * @param recent_messages A pointer to the RecentMessages buffer.
+ * @param index The index of the message, counted from the first message ever added.
+ * @param result A pointer to a buffer of MESSAGE_SIZE bytes where the message will be copied,
+ *               followed by a null terminator.
+ * @param size A pointer where the length of the message will be stored.
+ *
+ * @return true if the message was copied, false if it has not been added yet or is no longer stored.
+ *
+ * The function performs the following steps:
+ * 1. Checks that the entry of the index holds the message with that index.
+ * 2. Copies the message from the storage.
+ * 3. Checks again that the entry still holds the message and that the writer has not reserved its bytes
+ *    for a newer message in the meantime.
+ *
+ * Example usage:
+ * @code
+ * char message[MESSAGE_SIZE];
+ * size_t size;
+ * for (u_int64_t i = first_recent_messages(messages); i < next_recent_messages(messages); ++i) {
+ *     if (!read_recent_messages(messages, i, message, &size)) {
+ *         // Dropped while reading, continue from the oldest message still stored
+ *         u_int64_t first = first_recent_messages(messages);
+ *         if (first > i + 1) i = first - 1;
+ *         continue;
+ *     }
+ *     // Use the message
+ * }
+ * @endcode
+ */
+bool read_recent_messages(RecentMessages *recent_messages, u_int64_t index, char *result, size_t *size);
 
 
 /**
  * Retrieves a message from the RecentMessages buffer based on the given index.
  *
- * Fetches the message at the specified index relative to the current head of the buffer.
+ * Fetches the message at the specified index relative to the newest message of the buffer.
  * The index is used to access messages in a reverse chronological order, with 0 being the
  * most recent message.
  *
  * @param recent_messages A pointer to the RecentMessages buffer.
- * @param result A pointer to a buffer where the retrieved message will be copied. The buffer
- *               must be large enough to hold a message of size MESSAGE_SIZE.
- * @param index The index relative to the current head position. An index of 0 fetches the
+ * @param result A pointer to a buffer where the retrieved message will be copied, followed by a null terminator.
+ *               The buffer must be large enough to hold a message of size MESSAGE_SIZE.
+ * @param size A pointer where the length of the retrieved message will be stored.
+ * @param index The index relative to the newest message. An index of 0 fetches the
  *              most recent message, 1 fetches the message before that, and so on.
  *
  * @return A boolean value indicating whether the retrieval was successful:
@@ -127,15 +267,15 @@ bool add_recent_messages(RecentMessages *recent_messages, char *data);
  *         - false: the buffer is empty or the index is out of range.
  *
  * The function performs the following checks and steps:
- * 1. If the buffer is empty (head is INVALID_ADDRESS), return false.
- * 2. If the index is out of range (greater than or equal to the buffer size), return false.
- * 3. Calculate the real index in the circular buffer based on the head and the given index.
- * 4. Copy the message at the calculated index to the result buffer.
+ * 1. If the index is out of range (greater than or equal to the number of stored messages), return false.
+ * 2. Reads the message with index next - 1 - index with read_recent_messages,
+ *    returning false if it is dropped while it is read.
  *
  * Example usage:
  * @code
  * char result[MESSAGE_SIZE];
- * bool success = get_head_recent_messages(messages, result, 0);
+ * size_t size;
+ * bool success = get_head_recent_messages(messages, result, &size, 0);
  * if (success) {
  *     // Use the retrieved message stored in result
  * } else {
@@ -143,19 +283,20 @@ bool add_recent_messages(RecentMessages *recent_messages, char *data);
  * }
  * @endcode
  */
-bool get_head_recent_messages(RecentMessages *recent_messages, char *result, size_t index);
+bool get_head_recent_messages(RecentMessages *recent_messages, char *result, size_t *size, size_t index);
 
 
 /**
  * Retrieves a message from the RecentMessages buffer based on the given index.
  *
- * Fetches the message at the specified index relative to the current tail of the buffer.
+ * Fetches the message at the specified index relative to the oldest message of the buffer.
  * The index is used to access messages in a chronological order, with 0 being the oldest message.
  *
  * @param recent_messages A pointer to the RecentMessages buffer.
- * @param result A pointer to a buffer where the retrieved message will be copied. The buffer
- *               must be large enough to hold a message of size MESSAGE_SIZE.
- * @param index The index relative to the current tail position. An index of 0 fetches the
+ * @param result A pointer to a buffer where the retrieved message will be copied, followed by a null terminator.
+ *               The buffer must be large enough to hold a message of size MESSAGE_SIZE.
+ * @param size A pointer where the length of the retrieved message will be stored.
+ * @param index The index relative to the oldest message. An index of 0 fetches the
  *              oldest message, 1 fetches the next oldest message, and so on.
  *
  * @return A boolean value indicating whether the retrieval was successful:
@@ -163,15 +304,15 @@ bool get_head_recent_messages(RecentMessages *recent_messages, char *result, siz
  *         - false: the buffer is empty or the index is out of range.
  *
  * The function performs the following checks and steps:
- * 1. If the buffer is empty (tail is INVALID_ADDRESS), return false.
- * 2. If the index is out of range (greater than or equal to the buffer size), return false.
- * 3. Calculate the real index in the circular buffer based on the tail and the given index.
- * 4. Copy the message at the calculated index to the result buffer.
+ * 1. If the index is out of range (greater than or equal to the number of stored messages), return false.
+ * 2. Reads the message with index first + index with read_recent_messages,
+ *    returning false if it is dropped while it is read.
  *
  * Example usage:
  * @code
  * char result[MESSAGE_SIZE];
- * bool success = get_tail_recent_messages(messages, result, 0);
+ * size_t size;
+ * bool success = get_tail_recent_messages(messages, result, &size, 0);
  * if (success) {
  *     // Use the retrieved message stored in result
  * } else {
@@ -179,20 +320,51 @@ bool get_head_recent_messages(RecentMessages *recent_messages, char *result, siz
  * }
  * @endcode
  */
-bool get_tail_recent_messages(RecentMessages *recent_messages, char *result, size_t index);
+bool get_tail_recent_messages(RecentMessages *recent_messages, char *result, size_t *size, size_t index);
+
+
+/**
+ * Returns a snapshot of the recent messages serialized into a single buffer.
+ *
+ * Can be called from any thread while another thread adds messages. The snapshot is built by the first
+ * caller after the history changed and shared with later callers until the next message is added,
+ * so a burst of joining connections serializes the history once. The thread adding messages is never blocked.
+ *
+ * @param recent_messages A pointer to the RecentMessages buffer.
+ * @param snapshot A pointer to the RecentSnapshot to fill, whose buffer is held by the caller
+ * and must be released with release_shared_buffer.
+ *
+ * @return true if the snapshot was taken, false if memory allocation fails.
+ *
+ * The function performs the following steps:
+ * 1. Locks the snapshot mutex.
+ * 2. If there is no snapshot yet or messages have been added since it was built, builds a new one
+ *    by copying consistent snapshots of every stored message one after another, and replaces the previous one.
+ * 3. Takes a reference to the buffer of the current snapshot and unlocks the mutex.
+ *
+ * Example usage:
+ * @code
+ * RecentSnapshot snapshot;
+ * if (snapshot_recent_messages(messages, &snapshot)) {
+ *     write_shared_connection(connection, snapshot.buffer, 0, snapshot.size);
+ *     release_shared_buffer(snapshot.buffer);
+ * }
+ * @endcode
+ */
+bool snapshot_recent_messages(RecentMessages *recent_messages, RecentSnapshot *snapshot);
 
 
 /**
  * Frees the memory allocated for a RecentMessages buffer.
  *
- * Deallocates the memory used by the RecentMessages buffer and its associated storage array.
+ * Deallocates the memory used by the RecentMessages buffer and its associated storage.
  * This function should be called when the buffer is no longer needed to prevent memory leaks.
  *
  * @param recent_messages A pointer to the RecentMessages buffer to be freed.
  *
  * The function performs the following steps:
- * 1. Frees the memory allocated for each message slot in the storage array.
- * 2. Frees the memory allocated for the storage array itself.
+ * 1. Releases the current snapshot and unmaps the storage of the messages.
+ * 2. Frees the memory allocated for the circular array of entries.
  * 3. Frees the memory allocated for the RecentMessages structure.
  *
  * Example usage:
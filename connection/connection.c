@@ -1,11 +1,47 @@
 #include "connection.h"
 
 
+// Writes the name in hexadecimal without leading zeros, as printf does with %lx
+static u_int8_t prefix_connection(char *prefix, u_int64_t name) {
+    const char *digits = "0123456789abcdef";
+    u_int8_t size = 0;
+
+    for (u_int64_t rest = name; size == 0 || rest != 0; rest >>= 4) ++size;
+    for (u_int8_t i = size; i > 0; --i, name >>= 4) prefix[i - 1] = digits[name & 0xf];
+    return size;
+}
+
+static OutboundSlice *slice_connection(Outbound *outbound, u_int32_t index) {
+    OutboundSlice *slices = (OutboundSlice *) outbound->slices->data;
+    return &slices[(outbound->head + index) & (outbound->capacity - 1)];
+}
+
+static void discard_connection(Outbound *outbound) {
+    for (u_int32_t i = 0; i < outbound->count; ++i) release_shared_buffer(slice_connection(outbound, i)->buffer);
+    if (outbound->slices != NULL) release_shared_buffer(outbound->slices);
+    outbound->slices = NULL;
+    outbound->head = 0;
+    outbound->count = 0;
+    outbound->capacity = 0;
+    outbound->size = 0;
+}
+
 void populate_connection(Connection *conn, int32_t fd, u_int32_t address, u_int16_t port) {
     conn->fd = fd;
     conn->address = address;
     conn->port = port;
     conn->name = ((((u_int64_t) address << 16) | port) ^ static_generate_random()) & 0x0000ffffffffffff;
+    conn->queued = 0;
+    conn->closed = false;
+    conn->registered = false;
+    conn->replayed = 0;
+    conn->prefix_size = prefix_connection(conn->prefix, conn->name);
+    conn->outbound = (Outbound) {.limit = OUTBOUND_LIMIT, .policy = OUTBOUND_POLICY};
+}
+
+void rename_connection(Connection *conn) {
+    conn->name = (conn->name + 1) & 0x0000ffffffffffff;
+    conn->prefix_size = prefix_connection(conn->prefix, conn->name);
 }
 
 void empty_connection(Connection *conn) {
@@ -13,6 +49,13 @@ void empty_connection(Connection *conn) {
     conn->address = 0;
     conn->port = 0;
     conn->name = 0;
+    conn->queued = 0;
+    conn->closed = false;
+    conn->registered = false;
+    conn->replayed = 0;
+    conn->prefix_size = 0;
+    discard_connection(&conn->outbound);
+    conn->outbound = (Outbound) {.limit = OUTBOUND_LIMIT, .policy = OUTBOUND_POLICY};
 }
 
 bool bind_connection(u_int16_t port, Connection *conn) {
@@ -21,26 +64,43 @@ bool bind_connection(u_int16_t port, Connection *conn) {
 
     fd = socket(AF_INET, SOCK_STREAM, 0);
 
-    if (fd == 0) return false;
-    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &opt, sizeof(opt))) return false;
+    if (fd == -1) return false;
 
     struct sockaddr_in address = {
             .sin_family = AF_INET,
             .sin_addr.s_addr = INADDR_ANY,
             .sin_port = htons(port)
     };
-    if (bind(fd, (struct sockaddr *) &address, sizeof(address)) != 0) return false;
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt))
+        || setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt))
+        || bind(fd, (struct sockaddr *) &address, sizeof(address)) != 0) {
+        close(fd);
+        return false;
+    }
 
     populate_connection(conn, fd, ntohl(address.sin_addr.s_addr), port);
     return true;
 }
 
+bool populate_peer_connection(Connection *conn, int32_t fd) {
+    struct sockaddr_in address;
+    socklen_t address_size = sizeof(address);
+
+    if (getpeername(fd, (struct sockaddr *) &address, &address_size) != 0) return false;
+    populate_connection(conn, fd, ntohl(address.sin_addr.s_addr), ntohs(address.sin_port));
+    return true;
+}
+
 bool accept_connection(Connection *server_connection, Connection *client_connection) {
     struct sockaddr_in client_socket_address;
     int32_t client_fd;
     uint32_t client_socket_address_size = sizeof(client_socket_address);
 
-    client_fd = accept(server_connection->fd, (struct sockaddr *) &client_socket_address, &client_socket_address_size);
+    client_fd = accept4(
+            server_connection->fd,
+            (struct sockaddr *) &client_socket_address,
+            &client_socket_address_size,
+            SOCK_NONBLOCK);
     if (client_fd < 0) return false;
     populate_connection(
             client_connection,
@@ -56,13 +116,195 @@ bool listen_on_connection(Connection *connection) {
     return listen(connection->fd, SOCKET_MAX_CONNECTIONS) == 0;
 }
 
-bool read_connection(Connection *conn, void *buffer, size_t buffer_size) {
-    if (recv(conn->fd, buffer, buffer_size, 0) <= 0) return false;
+bool set_nonblocking_connection(Connection *conn) {
+    int32_t flags = fcntl(conn->fd, F_GETFL, 0);
+    if (flags == -1) return false;
+    return fcntl(conn->fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+ConnectionState read_connection(Connection *conn, void *buffer, size_t buffer_size, size_t *received) {
+    ssize_t result;
+
+    *received = 0;
+    do {
+        result = recv(conn->fd, buffer, buffer_size, 0);
+    } while (result == -1 && errno == EINTR);
+
+    if (result > 0) {
+        *received = (size_t) result;
+        return CONNECTION_READY;
+    }
+    if (result == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) return CONNECTION_WOULD_BLOCK;
+    return CONNECTION_CLOSED;
+}
+
+// Sends what the socket takes without waiting, returns the number of bytes sent or -1 if the connection failed
+static ssize_t push_connection(Connection *conn, struct iovec *iov, u_int32_t count) {
+    struct msghdr message = {.msg_iov = iov, .msg_iovlen = count};
+    size_t sent = 0;
+    ssize_t result;
+
+    while (message.msg_iovlen > 0) {
+        result = sendmsg(conn->fd, &message, MSG_NOSIGNAL);
+        if (result >= 0) {
+            sent += result;
+            while (message.msg_iovlen > 0 && (size_t) result >= message.msg_iov->iov_len) {
+                result -= (ssize_t) message.msg_iov->iov_len;
+                ++message.msg_iov;
+                --message.msg_iovlen;
+            }
+            if (message.msg_iovlen > 0) {
+                message.msg_iov->iov_base = (char *) message.msg_iov->iov_base + result;
+                message.msg_iov->iov_len -= result;
+            }
+            continue;
+        }
+        if (errno == EINTR) continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+        if (__atomic_load_n(&conn->outbound.blocked, __ATOMIC_SEQ_CST)) break;
+        // The reactor only reports sockets flagged as blocked, the send is tried again in case it drained meanwhile
+        __atomic_store_n(&conn->outbound.blocked, true, __ATOMIC_SEQ_CST);
+    }
+    return (ssize_t) sent;
+}
+
+static u_int64_t count_lines_connection(char *data, size_t size) {
+    char *end = data + size;
+    u_int64_t count = 0;
+
+    while ((data = memchr(data, '\n', end - data)) != NULL) {
+        ++count;
+        ++data;
+    }
+    return count;
+}
+
+static bool reserve_connection(Outbound *outbound) {
+    if (outbound->count < outbound->capacity) return true;
+
+    u_int32_t capacity = outbound->capacity > 0 ? outbound->capacity * 2 : OUTBOUND_INITIAL_SLICES;
+    SharedBuffer *slices = acquire_shared_buffer(outbound->pool, capacity * sizeof(OutboundSlice));
+    if (slices == NULL) return false;
+    for (u_int32_t i = 0; i < outbound->count; ++i) ((OutboundSlice *) slices->data)[i] = *slice_connection(outbound, i);
+    if (outbound->slices != NULL) release_shared_buffer(outbound->slices);
+    outbound->slices = slices;
+    outbound->head = 0;
+    outbound->capacity = capacity;
     return true;
 }
 
-bool send_connection(Connection *conn, void *buffer, size_t buffer_size) {
-    if (send(conn->fd, buffer, buffer_size, 0) == -1) return false;
+// Brings the waiting bytes back under the limit, the first slice is kept as it may have been partly sent
+static bool limit_connection(Connection *conn) {
+    Outbound *outbound = &conn->outbound;
+
+    if (outbound->size <= outbound->limit) return true;
+    if (outbound->policy == OUTBOUND_DISCONNECT) {
+        shutdown(conn->fd, SHUT_RDWR);
+        discard_connection(outbound);
+        outbound->evicted = true;
+        return false;
+    }
+
+    while (outbound->size > outbound->limit && outbound->count > 1) {
+        OutboundSlice dropped = *slice_connection(outbound, outbound->count - 1);
+        if (outbound->policy == OUTBOUND_DROP_OLDEST) {
+            // The first slice moves over the second one, which is dropped
+            dropped = *slice_connection(outbound, 1);
+            *slice_connection(outbound, 1) = *slice_connection(outbound, 0);
+            outbound->head = (outbound->head + 1) & (outbound->capacity - 1);
+        }
+        outbound->dropped += count_lines_connection(dropped.buffer->data + dropped.offset, dropped.size);
+        outbound->size -= dropped.size;
+        release_shared_buffer(dropped.buffer);
+        --outbound->count;
+    }
+    return true;
+}
+
+static bool queue_connection(Connection *conn, SharedBuffer *buffer, size_t offset, size_t size) {
+    Outbound *outbound = &conn->outbound;
+
+    if (size == 0) return true;
+    if (!reserve_connection(outbound)) {
+        outbound->dropped += count_lines_connection(buffer->data + offset, size);
+        return true;
+    }
+    retain_shared_buffer(buffer);
+    *slice_connection(outbound, outbound->count++) = (OutboundSlice) {
+            .buffer = buffer,
+            .offset = offset,
+            .size = size
+    };
+    outbound->size += size;
+    return limit_connection(conn);
+}
+
+bool write_shared_connection(Connection *conn, SharedBuffer *buffer, size_t offset, size_t size) {
+    if (conn->outbound.evicted) return false;
+    if (conn->outbound.size == 0) {
+        struct iovec iov = {.iov_base = buffer->data + offset, .iov_len = size};
+        ssize_t result = push_connection(conn, &iov, 1);
+        // A failed connection is closed by its reactor, nothing is kept for it
+        if (result < 0 || (size_t) result == size) return true;
+        offset += result;
+        size -= result;
+    }
+    return queue_connection(conn, buffer, offset, size);
+}
+
+bool write_connection(Connection *conn, void *buffer, size_t buffer_size) {
+    size_t sent = 0;
+
+    if (conn->outbound.evicted) return false;
+    if (conn->outbound.size == 0) {
+        struct iovec iov = {.iov_base = buffer, .iov_len = buffer_size};
+        ssize_t result = push_connection(conn, &iov, 1);
+        if (result < 0 || (size_t) result == buffer_size) return true;
+        sent = result;
+    }
+
+    SharedBuffer *copy = acquire_shared_buffer(conn->outbound.pool, buffer_size - sent);
+    if (copy == NULL) {
+        conn->outbound.dropped += count_lines_connection((char *) buffer + sent, buffer_size - sent);
+        return true;
+    }
+    memcpy(copy->data, (char *) buffer + sent, buffer_size - sent);
+    bool result = queue_connection(conn, copy, 0, buffer_size - sent);
+    release_shared_buffer(copy);
+    return result;
+}
+
+bool flush_connection(Connection *conn) {
+    Outbound *outbound = &conn->outbound;
+    struct iovec iov[OUTBOUND_IOVECS];
+
+    while (outbound->count > 0) {
+        u_int32_t count = outbound->count < OUTBOUND_IOVECS ? outbound->count : OUTBOUND_IOVECS;
+        size_t size = 0;
+        for (u_int32_t i = 0; i < count; ++i) {
+            OutboundSlice *slice = slice_connection(outbound, i);
+            iov[i] = (struct iovec) {.iov_base = slice->buffer->data + slice->offset, .iov_len = slice->size};
+            size += slice->size;
+        }
+
+        ssize_t result = push_connection(conn, iov, count);
+        if (result < 0) break;
+        outbound->size -= result;
+        for (size_t left = result; left > 0;) {
+            OutboundSlice *slice = slice_connection(outbound, 0);
+            if (left < slice->size) {
+                slice->offset += left;
+                slice->size -= left;
+                break;
+            }
+            left -= slice->size;
+            release_shared_buffer(slice->buffer);
+            outbound->head = (outbound->head + 1) & (outbound->capacity - 1);
+            --outbound->count;
+        }
+        if ((size_t) result < size) return false;
+    }
+    discard_connection(outbound);
     return true;
 }
 
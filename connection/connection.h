@@ -5,13 +5,90 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <arpa/inet.h>
 #include <stdlib.h>
 #include <time.h>
 #include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 #include "../hash_table/hash.h"
 #include "../definitions.h"
 #include "../misc/secrets.h"
+#include "../shared_buffer/shared_buffer.h"
+
+
+/**
+ * Enumeration representing what happens when the bytes waiting to be sent to a client exceed their limit.
+ *
+ * The following policies are defined:
+ *  - OUTBOUND_DROP_OLDEST: The oldest waiting messages are dropped to make room for the new ones.
+ *  - OUTBOUND_DROP_NEWEST: The new messages are dropped while the waiting ones do not leave room for them.
+ *  - OUTBOUND_DISCONNECT: The connection is shut down as a slow consumer.
+ *
+ * The message being sent is never cut, so a client always receives whole lines.
+ */
+typedef enum {
+    OUTBOUND_DROP_OLDEST,
+    OUTBOUND_DROP_NEWEST,
+    OUTBOUND_DISCONNECT
+} OutboundPolicy;
+
+
+/**
+ * Structure representing a part of a shared buffer waiting to be sent to a client.
+ *
+ * The structure fields are defined as follows:
+ *  - buffer: A pointer to the SharedBuffer holding the bytes, held once by the slice.
+ *  - offset: The offset of the first waiting byte in the buffer.
+ *  - size: The number of waiting bytes.
+ */
+typedef struct {
+    SharedBuffer *buffer;
+    u_int32_t offset;
+    u_int32_t size;
+} OutboundSlice;
+
+
+/**
+ * Structure representing the bytes waiting to be sent to a client.
+ *
+ * Bytes the socket does not take right away are kept here in order and sent once the socket becomes writable,
+ * so a client with a full TCP window does not hold up the thread sending to every client.
+ * The bytes are not copied: every waiting part of a broadcast is a slice referencing the shared buffer
+ * it was formatted in, and all clients waiting for the same message reference the same buffer.
+ * The structure is owned by the thread writing to the connection, except for the blocked flag.
+ *
+ * The structure fields are defined as follows:
+ *  - slices: A pointer to the SharedBuffer holding the circular array of the waiting slices, taken from the pool
+ *    when a slice has to wait and returned once the connection is drained, NULL while nothing is waiting.
+ *  - size: The number of waiting bytes of all the slices.
+ *  - limit: The number of waiting bytes the policy keeps the connection under.
+ *  - pool: A pointer to the SharedPool holding the slices and the copies of data written without a shared buffer,
+ *    or NULL.
+ *  - dropped: The number of messages dropped by the policy.
+ *  - head: The index of the oldest waiting slice in the array.
+ *  - count: The number of waiting slices.
+ *  - capacity: The size of the array.
+ *  - policy: What happens when the limit is exceeded.
+ *  - blocked: Whether a send would have blocked, set by the writing thread before it stops sending.
+ *    The reactor of the connection clears it when the socket becomes writable and asks for a flush.
+ *  - evicted: Whether the connection has been shut down as a slow consumer.
+ */
+typedef struct {
+    SharedBuffer *slices;
+    size_t size;
+    size_t limit;
+    SharedPool *pool;
+    u_int64_t dropped;
+    u_int32_t head;
+    u_int32_t count;
+    u_int32_t capacity;
+    OutboundPolicy policy;
+    bool blocked;
+    bool evicted;
+} Outbound;
 
 
 /**
@@ -20,11 +97,20 @@
  * This structure represents a network connection, containing information about the socket file descriptor,
  * IP address, port number, and a unique name assigned to the connection.
  *
+ * The fields are ordered by size so the structure, kept for every client whether it is active or idle, has no padding.
+ *
  * The structure fields are defined as follows:
+ *  - name: A unique name assigned to the connection, typically derived from the combination of IP address and port.
+ *  - replayed: The index after the newest recent message sent to the client before it is registered.
  *  - fd: The socket file descriptor associated with the connection.
  *  - address: The IP address of the connection.
+ *  - queued: The number of received messages of the connection not yet handled by the main server thread.
  *  - port: The port number of the connection.
- *  - name: A unique name assigned to the connection, typically derived from the combination of IP address and port.
+ *  - prefix_size: The number of characters in the prefix.
+ *  - closed: Whether the main server thread has handled the closing of the connection.
+ *  - registered: Whether the main server thread has registered the connection and announced it.
+ *  - prefix: The name in hexadecimal as it is shown in messages, formatted once when the connection is populated.
+ *  - outbound: The bytes waiting to be sent to the client by the main server thread and its fan-out shards.
  *
  * Example usage:
  * @code
@@ -36,19 +122,48 @@
  * @endcode
  */
 typedef struct {
+    u_int64_t name;
+    u_int64_t replayed;
     int32_t fd;
     u_int32_t address;
+    u_int32_t queued;
     u_int16_t port;
-    u_int64_t name;
+    u_int8_t prefix_size;
+    bool closed;
+    bool registered;
+    char prefix[CONNECTION_PREFIX_SIZE];
+    Outbound outbound;
 } Connection;
 
 
+/**
+ * Enumeration representing the outcome of a read on a non-blocking connection.
+ *
+ * The following states are defined:
+ *  - CONNECTION_READY: Data was received and stored in the buffer.
+ *  - CONNECTION_WOULD_BLOCK: No data is available right now, the socket has been drained.
+ *  - CONNECTION_CLOSED: The peer closed the connection or an unrecoverable error occurred.
+ *
+ * Example usage:
+ * @code
+ * ConnectionState state = read_connection(&conn, buffer, sizeof(buffer), &received);
+ * if (state == CONNECTION_CLOSED) close_connection(&conn);
+ * @endcode
+ */
+typedef enum {
+    CONNECTION_READY,
+    CONNECTION_WOULD_BLOCK,
+    CONNECTION_CLOSED
+} ConnectionState;
+
+
 /**
  * Populates a Connection structure with the provided file descriptor, address, and port.
  *
  * This function initializes a Connection structure with the specified file descriptor (fd),
  * address, and port. Additionally, it generates a unique name for the connection based on
- * the provided address and port, combined with a random value.
+ * the provided address and port, combined with a random value, and formats the name in hexadecimal
+ * as the prefix of the messages of the connection.
  *
  * @param conn A pointer to the Connection structure to be populated.
  * @param fd The file descriptor associated with the connection.
@@ -64,11 +179,52 @@ typedef struct {
 void populate_connection(Connection *conn, int32_t fd, u_int32_t address, u_int16_t port);
 
 
+/**
+ * Moves the connection to the next name and formats it as the prefix of the messages of the connection.
+ *
+ * Names are derived from the address and port of the peer, so a client reconnecting from the same port
+ * gets the name of its previous connection, which may still be registered if another shard reports the close
+ * later than the open. The server renames a connection whose name is taken before announcing it.
+ *
+ * @param conn A pointer to the Connection structure to be renamed.
+ *
+ * Example usage:
+ * @code
+ * while (find_name_registry(registry, conn->name) != NULL) rename_connection(conn);
+ * @endcode
+ */
+void rename_connection(Connection *conn);
+
+
+/**
+ * Populates a Connection structure for an already accepted socket.
+ *
+ * This function looks up the address and port of the peer of the provided socket and populates
+ * the Connection structure with them. It is used when the socket has been accepted without
+ * reporting the peer address, as multishot accepts do.
+ *
+ * @param conn A pointer to the Connection structure to be populated.
+ * @param fd The file descriptor of the accepted socket.
+ *
+ * @return true if the peer address is resolved and the Connection structure is populated, otherwise false.
+ *
+ * Example usage:
+ * @code
+ * Connection conn;
+ * if (!populate_peer_connection(&conn, fd)) {
+ *     close(fd);
+ * }
+ * @endcode
+ */
+bool populate_peer_connection(Connection *conn, int32_t fd);
+
+
 /**
  * Empties a Connection structure by resetting its fields to zero.
  *
  * This function resets all fields of the provided Connection structure to zero,
- * effectively clearing any existing data associated with the connection.
+ * effectively clearing any existing data associated with the connection,
+ * and releases the bytes still waiting to be sent.
  *
  * @param conn A pointer to the Connection structure to be emptied.
 
@@ -85,7 +241,8 @@ void empty_connection(Connection *conn);
  * Binds a socket to the specified port and populates a Connection structure with the socket details.
  *
  * This function creates a socket and binds it to the specified port. It also sets the socket
- * options to allow reusing the address and port if available. After successful binding, it populates
+ * options to allow reusing the address and port, so several sockets can be bound to the same port
+ * and the kernel balances incoming connections between them. After successful binding, it populates
  * the provided Connection structure with the socket file descriptor (fd), address, and port details.
  *
  * @param port The port number to bind the socket to.
@@ -127,8 +284,10 @@ bool bind_connection(u_int16_t port, Connection *conn);
  * @return true if the connection is successfully accepted and the client Connection structure is populated, otherwise false.
  *
  * The function performs the following steps:
- * 1. Calls the accept() system call to accept an incoming connection on the server socket.
- * 2. If the accept() call fails (returns a negative value), returns false.
+ * 1. Calls the accept4() system call to accept an incoming connection on the server socket.
+ *    The accepted socket is created in non-blocking mode.
+ * 2. If the accept4() call fails (returns a negative value), returns false. On a non-blocking
+ *    server socket this also happens once all pending connections have been accepted.
  * 3. Populates the client Connection structure with the accepted client's socket file descriptor,
  *    IP address, and port details obtained from the accepted socket address.
  * 4. Returns true upon successful acceptance and population of the client Connection structure.
@@ -179,71 +338,145 @@ bool listen_on_connection(Connection *connection);
 
 
 /**
- * Reads data from the specified connection socket into the provided buffer.
+ * Switches the specified connection socket to non-blocking mode.
+ *
+ * This function sets the O_NONBLOCK flag on the socket file descriptor of the connection,
+ * so that accept, recv and send calls return immediately instead of waiting for the peer.
+ *
+ * @param conn A pointer to the Connection structure representing the connection socket.
+ *
+ * @return true if the flag is successfully set, otherwise false.
+ *
+ * Example usage:
+ * @code
+ * Connection conn;
+ * // Populate conn with socket details
+ * if (!set_nonblocking_connection(&conn)) {
+ *     // Error occurred while changing the socket mode.
+ * }
+ * @endcode
+ */
+bool set_nonblocking_connection(Connection *conn);
+
+
+/**
+ * Reads data from the specified non-blocking connection socket into the provided buffer.
  *
- * This function reads data from the specified connection socket into the provided buffer.
- * It attempts to receive data from the socket and store it in the buffer.
+ * This function performs a single recv() call on the connection socket and reports whether
+ * data was received, the socket has no more data available, or the connection is gone.
  *
  * @param conn A pointer to the Connection structure representing the connection socket.
  * @param buffer A pointer to the buffer where the received data will be stored.
  * @param buffer_size The size of the buffer in bytes.
+ * @param received A pointer where the number of received bytes will be stored.
  *
- * @return true if data is successfully read from the socket and stored in the buffer, otherwise false.
+ * @return The state of the connection after the read:
+ *         - CONNECTION_READY: data was read, the amount is stored in received.
+ *         - CONNECTION_WOULD_BLOCK: the socket is drained, wait for the next readiness event.
+ *         - CONNECTION_CLOSED: the peer closed the connection or an error occurred.
  *
  * The function performs the following steps:
- * 1. Calls the recv() system call to attempt to receive data from the connection socket.
- * 2. Copies the received data into the provided buffer.
- * 3. Returns true if the recv() call succeeds and data is read from the socket.
- *    Returns false if the recv() call fails (returns a non-positive value), indicating
- *    either an error or that the connection has been closed by the peer.
+ * 1. Calls the recv() system call, retrying if it is interrupted by a signal.
+ * 2. Returns CONNECTION_READY with the amount of received bytes if recv() returns a positive value.
+ * 3. Returns CONNECTION_WOULD_BLOCK if recv() fails with EAGAIN or EWOULDBLOCK.
+ * 4. Returns CONNECTION_CLOSED otherwise.
  *
  * Example usage:
  * @code
  * Connection conn;
  * // Populate conn with connection details
  * char buffer[1024];
- * if (read_connection(&conn, buffer, sizeof(buffer))) {
- *     // Data successfully read from the connection socket.
- * } else {
- *     // Error occurred while reading from the socket or connection closed by the peer.
+ * size_t received;
+ * while (read_connection(&conn, buffer, sizeof(buffer), &received) == CONNECTION_READY) {
+ *     // Process received bytes.
  * }
  * @endcode
  */
-bool read_connection(Connection *conn, void *buffer, size_t buffer_size);
+ConnectionState read_connection(Connection *conn, void *buffer, size_t buffer_size, size_t *received);
 
 
 /**
- * Sends data from the provided buffer over the specified connection socket.
+ * Sends part of a shared buffer over the specified connection without ever waiting for the socket.
  *
- * This function sends data from the provided buffer over the specified connection socket.
- * It attempts to send the data to the connected peer.
+ * This function sends as much of the data as the socket takes right away and keeps the rest
+ * after the bytes already waiting for the connection, to be sent with the flush_connection function
+ * once the reactor reports the socket writable. The rest is not copied, the connection holds a reference
+ * to the buffer until it is sent. While bytes are waiting, new data is only queued after them,
+ * so the client receives everything in order. If the waiting bytes exceed the limit of the connection,
+ * its policy drops the oldest or newest slices of whole messages or shuts the connection down,
+ * the reactor then sees it closed and closes it as usual.
  *
  * @param conn A pointer to the Connection structure representing the connection socket.
- * @param buffer A pointer to the buffer containing the data to be sent.
- * @param buffer_size The size of the data to be sent in bytes.
+ * @param buffer A pointer to the SharedBuffer holding the data, which must not change once it is shared.
+ * @param offset The offset of the data to be sent in the buffer.
+ * @param size The size of the data to be sent in bytes, made of whole lines.
  *
- * @return true if the data is successfully sent over the connection socket, otherwise false.
+ * @return false if the connection has been shut down as a slow consumer, otherwise true.
  *
  * The function performs the following steps:
- * 1. Calls the send() system call to attempt to send data from the buffer over the connection socket.
- * 2. Returns true if the send() call succeeds (returns the number of bytes sent),
- *    indicating that the data is successfully sent over the socket.
- *    Returns false if the send() call fails (returns -1), indicating an error occurred
- *    while attempting to send the data.
+ * 1. Returns false right away for a connection already shut down as a slow consumer.
+ * 2. Sends the data with non-blocking send() calls if no bytes are waiting. Once the socket is full,
+ *    sets the blocked flag and tries once more, so the reactor cannot miss the socket becoming writable.
+ * 3. Queues a slice referencing the data that has not been sent, growing the array of slices as needed.
+ * 4. Applies the policy of the connection if the waiting bytes exceed its limit.
+ *    The first waiting slice, which may have been partly sent, is always kept.
  *
  * Example usage:
  * @code
- * Connection conn;
- * // Populate conn with connection details
- * char buffer[] = "Hello, world!";
- * if (send_connection(&conn, buffer, sizeof(buffer))) {
- *     // Data successfully sent over the connection socket.
- * } else {
- *     // Error occurred while sending data over the socket.
+ * SharedBuffer *buffer = acquire_shared_buffer(pool, MESSAGE_SIZE);
+ * size_t size = format_message(buffer->data, payload, payload_size, author, MESSAGE_SENT, sequence);
+ * for (size_t i = 0; i < count; ++i) write_shared_connection(connections[i], buffer, 0, size);
+ * release_shared_buffer(buffer);
+ * @endcode
+ */
+bool write_shared_connection(Connection *conn, SharedBuffer *buffer, size_t offset, size_t size);
+
+
+/**
+ * Sends data over the specified connection without ever waiting for the socket.
+ *
+ * This function behaves as the write_shared_connection function for data that is not in a shared buffer,
+ * such as data private to the connection. The data that is not sent right away is copied
+ * into a shared buffer taken from the pool of the connection.
+ *
+ * @param conn A pointer to the Connection structure representing the connection socket.
+ * @param buffer A pointer to the buffer containing the data to be sent, made of whole lines.
+ * @param buffer_size The size of the data to be sent in bytes.
+ *
+ * @return false if the connection has been shut down as a slow consumer, otherwise true.
+ *
+ * Example usage:
+ * @code
+ * Connection *conn;
+ * char buffer[] = "Hello, world!\n";
+ * if (!write_connection(conn, buffer, strlen(buffer))) {
+ *     // The client is too slow and its connection is being closed.
+ * }
+ * @endcode
+ */
+bool write_connection(Connection *conn, void *buffer, size_t buffer_size);
+
+
+/**
+ * Sends the bytes waiting for the specified connection.
+ *
+ * This function is called by the thread writing to the connection once the reactor reports
+ * the socket writable. It sends as much of the waiting slices as the socket takes without waiting,
+ * up to OUTBOUND_IOVECS slices per system call, and releases the buffers of the slices sent.
+ *
+ * @param conn A pointer to the Connection structure representing the connection socket.
+ *
+ * @return true if no bytes are left waiting, otherwise false.
+ *
+ * Example usage:
+ * @code
+ * Connection *conn;
+ * if (!flush_connection(conn)) {
+ *     // The socket is full again, the reactor reports it once it drains.
  * }
  * @endcode
  */
-bool send_connection(Connection *conn, void *buffer, size_t buffer_size);
+bool flush_connection(Connection *conn);
 
 
 /**
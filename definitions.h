@@ -4,17 +4,120 @@
 
 #define QUEUE_NAME "/c_server"
 #define QUEUE_MAX_MESSAGES 10
-#define QUEUE_PAYLOAD_SIZE 256
+#define QUEUE_PAYLOAD_SIZE 4096
 #define QUEUE_PERMISSIONS 0660
+#define QUEUE_RING_SIZE 4096
+#define QUEUE_CACHE_LINE_SIZE 64
+#define QUEUE_BATCH_SIZE 64
+// Fairness between the chat and bulk lanes, control events are always read first
+// QUEUE_POLICY_STRICT drains chat before bulk, QUEUE_POLICY_WEIGHTED alternates between them by weight
+#define QUEUE_LANE_POLICY QUEUE_POLICY_WEIGHTED
+#define QUEUE_CHAT_WEIGHT 16
+#define QUEUE_BULK_WEIGHT 4
 
 #define MESSAGE_BUFFER_SIZE QUEUE_PAYLOAD_SIZE
-#define MESSAGE_FORMATTING_SIZE 16
+// Room for the sequence, the connection name and the newline around a message
+#define MESSAGE_FORMATTING_SIZE 48
 #define MESSAGE_SIZE (MESSAGE_BUFFER_SIZE + MESSAGE_FORMATTING_SIZE)
+// Bytes of a line kept as a message, the rest of a longer line is dropped, overridden at startup by the variable named below
+#define MESSAGE_LINE_LIMIT (MESSAGE_BUFFER_SIZE - 1)
+#define MESSAGE_LINE_LIMIT_VARIABLE "SERVER_LINE_LIMIT"
+// Bytes read from a client socket at once, the lines in them are split and forwarded together
+#define MESSAGE_READ_SIZE (64 * 1024)
 #define MESSAGE_ALLOWED_SYMBOLS "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789()?!,;:&*+@$%^/><'.-_\r\n "
+// Marker of the sequence number at the start of every message
+#define MESSAGE_SEQUENCE_MARKER '#'
+// Room for the name of a connection in hexadecimal, names are 48 bits long,
+// one byte short of 16 so the flags before it in a connection need no padding
+#define CONNECTION_PREFIX_SIZE 15
+// A client sending the command followed by the last sequence it has seen receives only the messages after it
+#define RESUME_COMMAND "/resume "
+#define RESUME_BUFFER_SIZE (16 * 1024)
+// Milliseconds a joining client has to send the command before the whole history is replayed
+#define RESUME_WAIT 50
+// Default number of messages kept in the history, overridden at startup by the variable named below
 #define RECENT_MESSAGES_SIZE 100
+#define RECENT_MESSAGES_SIZE_VARIABLE "SERVER_HISTORY_SIZE"
+#define RECENT_MESSAGES_MAX_SIZE 1000000
+// Bytes of history storage reserved per message, long messages drop older ones earlier
+#define RECENT_MESSAGES_ENTRY_SIZE 512
+#define RECENT_MESSAGES_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+// Initial size of the history snapshot sent to joining clients, doubled as needed
+#define RECENT_MESSAGES_SNAPSHOT_SIZE (16 * 1024)
+
+// Directory of the message journal, overridden at startup by the variable named below, an empty value disables it
+// The journal is disabled by default, its segments take JOURNAL_SEGMENT_SIZE bytes each and belong outside the sources
+#define JOURNAL_DIRECTORY ""
+#define JOURNAL_DIRECTORY_VARIABLE "SERVER_JOURNAL_DIRECTORY"
+#define JOURNAL_DIRECTORY_PERMISSIONS 0750
+#define JOURNAL_PERMISSIONS 0640
+#define JOURNAL_SEGMENT_EXTENSION ".log"
+#define JOURNAL_SEGMENT_SIZE (64 * 1024 * 1024)
+// Number of segments kept on disk, the oldest one is removed when a new one is started
+#define JOURNAL_MAX_SEGMENTS 16
+
+// Seconds between statistics printed by the main loop
+#define SERVER_STATS_INTERVAL 10
 
 #define SOCKET_MAX_CONNECTIONS 256
+
+// Bytes waiting to be sent to a client before the policy applies, overridden at startup by the variable named below
+#define OUTBOUND_LIMIT (1024 * 1024)
+#define OUTBOUND_LIMIT_VARIABLE "SERVER_OUTBOUND_LIMIT"
+// OUTBOUND_DROP_OLDEST, OUTBOUND_DROP_NEWEST or OUTBOUND_DISCONNECT
+// The variable named below takes "oldest", "newest" or "disconnect"
+#define OUTBOUND_POLICY OUTBOUND_DISCONNECT
+#define OUTBOUND_POLICY_VARIABLE "SERVER_OUTBOUND_POLICY"
+// Initial number of buffer slices waiting to be sent to a client, doubled as needed
+#define OUTBOUND_INITIAL_SLICES 16
+// Slices sent with a single system call when a client is flushed
+#define OUTBOUND_IOVECS 64
+// Smallest pooled broadcast buffer, size classes double up to 512 KiB, which holds a whole queue batch
+#define SHARED_BUFFER_MIN_SIZE 256
+#define SHARED_BUFFER_CLASSES 12
+// Released broadcast buffers kept for reuse per size class
+#define SHARED_POOL_DEPTH 64
+// Free objects a thread keeps per object pool before handing a batch back to the pool
+#define OBJECT_CACHE_DEPTH 64
+// Objects moved at once between a thread cache and its pool
+#define OBJECT_CACHE_BATCH 32
+// Free objects kept per object pool for all the threads, further ones are freed
+#define OBJECT_POOL_DEPTH 4096
+// Object pools of the process, every thread has a cache for each of them
+#define OBJECT_POOL_LIMIT 8
+// Message payloads up to this size, null terminator included, are taken from the message pool
+#define OBJECT_MESSAGE_SIZE 256
 #define PORT 6969
 
+// Number of listener shards, each with its own listening socket and reactor
+// 0 starts one shard per online CPU
+#define LISTENER_SHARDS 0
+#define LISTENER_SHARDS_VARIABLE "SERVER_SHARDS"
+#define LISTENER_SHARDS_MAX 256
+// Client connections a shard must have over the least loaded shard before it hands it the connections it accepts
+#define LISTENER_HANDOFF_MARGIN 4
+// Initial number of client connections waiting in the inbox of a shard, doubled as needed
+#define LISTENER_INBOX_SIZE 16
+
+#define REACTOR_MAX_EVENTS 64
+#define REACTOR_RING_ENTRIES 256
+#define REACTOR_RING_BUFFERS 256
+#define SERVER_RING_ENTRIES 256
+
+// Number of fan-out shards delivering every broadcast in parallel, the main thread being the first one
+// 0 starts one shard per online CPU
+#define FANOUT_SHARDS 0
+#define FANOUT_SHARDS_VARIABLE "SERVER_FANOUT_SHARDS"
+#define FANOUT_SHARDS_MAX 256
+// Clients every fan-out shard is given at least, smaller broadcasts take fewer shards
+#define FANOUT_MIN_CONNECTIONS 256
+
+// The table grows once live items and tombstones exceed NUMERATOR/DENOMINATOR of its capacity
+// Each operation moves TABLE_REHASH_STEP slots of a running rehash into the grown storage
+#define TABLE_MIN_CAPACITY 16
+#define TABLE_LOAD_NUMERATOR 3
+#define TABLE_LOAD_DENOMINATOR 4
+#define TABLE_REHASH_STEP 8
+
 
 #endif //SERVER_DEFINITIONS_H
@@ -0,0 +1,109 @@
+#include "fanout.h"
+
+
+static void wait_fanout(u_int32_t *address, u_int32_t expected) {
+    syscall(SYS_futex, address, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0);
+}
+
+static void wake_fanout(u_int32_t *address) {
+    syscall(SYS_futex, address, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+static u_int64_t clock_fanout() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (u_int64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void measure_fanout(Fanout *fanout, FanoutShard *shard) {
+    u_int64_t start = clock_fanout();
+    fanout->task(fanout->argument, shard->index, fanout->active);
+    u_int64_t elapsed = clock_fanout() - start;
+
+    // Statistics are only written by the shard and read by the calling thread between runs
+    __atomic_store_n(&shard->runs, shard->runs + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&shard->busy, shard->busy + elapsed, __ATOMIC_RELAXED);
+    if (elapsed > shard->slowest) __atomic_store_n(&shard->slowest, elapsed, __ATOMIC_RELAXED);
+}
+
+static void *run_fanout_shard(void *args) {
+    FanoutShard *shard = args;
+    Fanout *fanout = shard->fanout;
+    u_int32_t seen = 0;
+
+    while (true) {
+        u_int32_t generation;
+        while ((generation = __atomic_load_n(&shard->generation, __ATOMIC_ACQUIRE)) == seen) {
+            wait_fanout(&shard->generation, seen);
+        }
+        seen = generation;
+        if (__atomic_load_n(&fanout->stopping, __ATOMIC_ACQUIRE)) return NULL;
+
+        measure_fanout(fanout, shard);
+        if (__atomic_sub_fetch(&fanout->pending, 1, __ATOMIC_ACQ_REL) == 0) wake_fanout(&fanout->pending);
+    }
+}
+
+// Wakes the threads of the shards from 1 to count - 1 for the next run
+static void start_fanout(Fanout *fanout, u_int32_t count) {
+    for (u_int32_t i = 1; i < count; ++i) {
+        __atomic_add_fetch(&fanout->shards[i].generation, 1, __ATOMIC_RELEASE);
+        wake_fanout(&fanout->shards[i].generation);
+    }
+}
+
+static void stop_fanout(Fanout *fanout, u_int32_t count) {
+    __atomic_store_n(&fanout->stopping, true, __ATOMIC_RELEASE);
+    start_fanout(fanout, count);
+    for (u_int32_t i = 1; i < count; ++i) pthread_join(fanout->shards[i].thread, NULL);
+}
+
+Fanout *init_fanout(u_int32_t count) {
+    Fanout *fanout = aligned_alloc(QUEUE_CACHE_LINE_SIZE, sizeof(Fanout));
+    if (fanout == NULL) return NULL;
+    fanout->shards = aligned_alloc(QUEUE_CACHE_LINE_SIZE, count * sizeof(FanoutShard));
+    if (fanout->shards == NULL) {
+        free(fanout);
+        return NULL;
+    }
+    fanout->count = count;
+    fanout->task = NULL;
+    fanout->argument = NULL;
+    fanout->active = 0;
+    fanout->pending = 0;
+    fanout->stopping = false;
+
+    for (u_int32_t i = 0; i < count; ++i) {
+        FanoutShard *shard = &fanout->shards[i];
+        *shard = (FanoutShard) {.fanout = fanout, .index = i, .generation = 0, .runs = 0, .busy = 0, .slowest = 0};
+        if (i == 0 || pthread_create(&shard->thread, NULL, run_fanout_shard, shard) == 0) continue;
+
+        printf("Cannot start fan-out shard %u\n", i);
+        stop_fanout(fanout, i);
+        free(fanout->shards);
+        free(fanout);
+        return NULL;
+    }
+    return fanout;
+}
+
+void run_fanout(Fanout *fanout, u_int32_t count, FanoutTask task, void *argument) {
+    if (count > fanout->count) count = fanout->count;
+    if (count == 0) count = 1;
+    fanout->task = task;
+    fanout->argument = argument;
+    fanout->active = count;
+    __atomic_store_n(&fanout->pending, count - 1, __ATOMIC_RELAXED);
+
+    start_fanout(fanout, count);
+    measure_fanout(fanout, &fanout->shards[0]);
+
+    u_int32_t pending;
+    while ((pending = __atomic_load_n(&fanout->pending, __ATOMIC_ACQUIRE)) > 0) wait_fanout(&fanout->pending, pending);
+}
+
+void free_fanout(Fanout *fanout) {
+    stop_fanout(fanout, fanout->count);
+    free(fanout->shards);
+    free(fanout);
+}
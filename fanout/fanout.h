@@ -0,0 +1,151 @@
+#ifndef SERVER_FANOUT_H
+#define SERVER_FANOUT_H
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdalign.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include "../definitions.h"
+
+
+struct Fanout;
+
+
+/**
+ * Function run by every shard taking part in a fan-out.
+ *
+ * @param argument The argument the fan-out was run with.
+ * @param index The index of the shard, from 0 to count - 1.
+ * @param count The number of shards taking part in the fan-out.
+ */
+typedef void (*FanoutTask)(void *argument, u_int32_t index, u_int32_t count);
+
+
+/**
+ * Structure representing a shard of a fan-out and the time it spends on its part of every run.
+ *
+ * Shard 0 is run by the thread starting the fan-out, every other shard by a thread of its own.
+ * Shards are kept on separate cache lines, as every one of them updates its own statistics.
+ *
+ * The structure fields are defined as follows:
+ *  - fanout: A pointer to the Fanout structure the shard belongs to.
+ *  - thread: The thread running the shard, unused for shard 0.
+ *  - index: The index of the shard.
+ *  - generation: The number of runs the shard has been started for, the shard thread sleeps on it between runs.
+ *  - runs: The number of runs the shard has taken part in.
+ *  - busy: The total time in nanoseconds the shard has spent on its part of the runs.
+ *  - slowest: The longest time in nanoseconds the shard has spent on its part of a run.
+ */
+typedef struct {
+    alignas(QUEUE_CACHE_LINE_SIZE) struct Fanout *fanout;
+    pthread_t thread;
+    u_int32_t index;
+    u_int32_t generation;
+    u_int64_t runs;
+    u_int64_t busy;
+    u_int64_t slowest;
+} FanoutShard;
+
+
+/**
+ * Structure representing a fixed set of threads running the same task on disjoint parts of a work in parallel.
+ *
+ * A run hands the task to every shard once and returns when all of them are done, so the work
+ * it is given is only touched by the shards while the run lasts and by the calling thread otherwise.
+ *
+ * The structure fields are defined as follows:
+ *  - shards: An array of FanoutShard structures.
+ *  - count: The number of shards.
+ *  - task: The task of the current run.
+ *  - argument: The argument of the task of the current run.
+ *  - active: The number of shards taking part in the current run.
+ *  - pending: The number of shard threads that have not finished the current run,
+ *    the calling thread sleeps on it once its own part is done.
+ *  - stopping: Whether the shard threads have been asked to exit.
+ *
+ * Example usage:
+ * @code
+ * Fanout *fanout = init_fanout(4);
+ * run_fanout(fanout, 4, deliver, &delivery);
+ * free_fanout(fanout);
+ * @endcode
+ */
+typedef struct Fanout {
+    FanoutShard *shards;
+    u_int32_t count;
+    FanoutTask task;
+    void *argument;
+    u_int32_t active;
+    alignas(QUEUE_CACHE_LINE_SIZE) u_int32_t pending;
+    bool stopping;
+} Fanout;
+
+
+/**
+ * Initializes a fan-out with the specified number of shards and starts a thread for every shard but the first.
+ *
+ * @param count The number of shards, at least 1.
+ *
+ * @return A pointer to the initialized Fanout structure, or NULL if memory allocation or thread creation fails.
+ *
+ * The function performs the following steps:
+ * 1. Allocates memory for the Fanout structure and its shards.
+ * 2. Starts a thread for every shard but the first, waiting for its first run.
+ * 3. Returns a pointer to the fan-out, or NULL after stopping the threads started if one cannot be started.
+ *
+ * Example usage:
+ * @code
+ * Fanout *fanout = init_fanout(4);
+ * if (fanout == NULL) {
+ *     // Error: Failed to start the fan-out.
+ * }
+ * @endcode
+ */
+Fanout *init_fanout(u_int32_t count);
+
+
+/**
+ * Runs the task on the specified number of shards in parallel and waits for all of them to finish.
+ *
+ * The calling thread runs shard 0 itself, so a run on a single shard makes no system call.
+ * The time every shard spends on its part is added to its statistics.
+ *
+ * @param fanout A pointer to the Fanout structure.
+ * @param count The number of shards taking part, lowered to the number of shards of the fan-out.
+ * @param task The task every shard runs.
+ * @param argument The argument passed to the task.
+ *
+ * The function performs the following steps:
+ * 1. Stores the task and wakes the threads of the shards taking part but the first.
+ * 2. Runs the task of shard 0.
+ * 3. Waits until every other shard has finished its part.
+ *
+ * Example usage:
+ * @code
+ * run_fanout(fanout, fanout->count, deliver, &delivery);
+ * @endcode
+ */
+void run_fanout(Fanout *fanout, u_int32_t count, FanoutTask task, void *argument);
+
+
+/**
+ * Stops the threads of the fan-out and frees it.
+ *
+ * @param fanout A pointer to the Fanout structure to free, which must not be running.
+ *
+ * Example usage:
+ * @code
+ * free_fanout(context->fanout);
+ * @endcode
+ */
+void free_fanout(Fanout *fanout);
+
+
+#endif //SERVER_FANOUT_H
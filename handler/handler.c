@@ -1,43 +1,214 @@
 #include "handler.h"
 
 
-void send_recent_messages(Connection *connection, RecentMessages *recent_messages) {
-    char message[MESSAGE_SIZE] = {0};
-    u_int32_t index = 0;
-    while (get_tail_recent_messages(recent_messages, message, index)) {
-        send_connection(connection, message, strlen(message));
-        ++index;
+u_int64_t send_range_recent_messages(
+        Connection *connection,
+        RecentMessages *recent_messages,
+        u_int64_t from) {
+    char buffer[RESUME_BUFFER_SIZE];
+    size_t size = 0;
+    size_t length;
+    u_int64_t next = next_recent_messages(recent_messages);
+
+    if (from < first_recent_messages(recent_messages)) from = first_recent_messages(recent_messages);
+    for (u_int64_t index = from; index < next; ++index) {
+        if (RESUME_BUFFER_SIZE - size < MESSAGE_SIZE) {
+            write_connection(connection, buffer, size);
+            size = 0;
+        }
+        if (!read_recent_messages(recent_messages, index, buffer + size, &length)) {
+            // Dropped while read, continue from the oldest message still stored
+            u_int64_t first = first_recent_messages(recent_messages);
+            if (first > index + 1) index = first - 1;
+            continue;
+        }
+        size += length;
     }
+    if (size > 0) write_connection(connection, buffer, size);
+    return next;
 }
 
-void *handle_connection(void *arg) {
-    HandlerArgs *t_args = (HandlerArgs *) arg;
-
-    Queue *queue = open_queue(QUEUE_MODE_WRITE);
-    if (queue == NULL) {
-        printf("Cannot open mqueue\n");
-        return NULL;
+u_int64_t send_recent_messages(Connection *connection, RecentMessages *recent_messages) {
+    RecentSnapshot snapshot;
+    if (!snapshot_recent_messages(recent_messages, &snapshot)) {
+        return send_range_recent_messages(connection, recent_messages, 0);
     }
-    Connection *client_connection = t_args->client_connection;
-    ServerContext *context = t_args->context;
-    char buffer[MESSAGE_SIZE] = {0};
+
+    write_shared_connection(connection, snapshot.buffer, 0, snapshot.size);
+    release_shared_buffer(snapshot.buffer);
+    return snapshot.next;
+}
+
+void open_connection_handler(HandlerArgs *args, Queue *queue, u_int64_t replayed) {
     QMessage message;
 
-    populate_message(&message, Q_MESSAGE_OPEN_CONNECTION, client_connection, NULL);
+    args->joined = 0;
+    args->client_connection->replayed = replayed;
+    populate_message(&message, Q_MESSAGE_OPEN_CONNECTION, args->client_connection, NULL, 0, NULL);
     send_queue(queue, &message);
-    send_recent_messages(client_connection, context->recent_messages);
-    while (read_connection(client_connection, buffer, MESSAGE_BUFFER_SIZE - 1)) {
-        sanitize_buffer(buffer, MESSAGE_BUFFER_SIZE);
-        memcpy(message.payload, buffer, sizeof(message.payload));
-        populate_message(&message, Q_MESSAGE_RECEIVED, client_connection, buffer);
-        send_queue(queue, &message);
-        memset(buffer, '\0', MESSAGE_BUFFER_SIZE);
-    }
-    close_connection(client_connection);
-    populate_message(&message, Q_MESSAGE_CLOSE_CONNECTION, client_connection, NULL);
+}
+
+void join_connection_handler(HandlerArgs *args, Queue *queue) {
+    open_connection_handler(
+            args,
+            queue,
+            send_recent_messages(args->client_connection, args->context->recent_messages));
+}
+
+void resume_connection_handler(HandlerArgs *args, Queue *queue, char *line, size_t size) {
+    RecentMessages *recent_messages = args->context->recent_messages;
+    size_t position = sizeof(RESUME_COMMAND) - 1;
+    u_int64_t sequence = 0;
+
+    while (position < size && line[position] >= '0' && line[position] <= '9') {
+        sequence = sequence * 10 + line[position++] - '0';
+    }
+
+    u_int64_t from = sequence + 1;
+    u_int64_t first = first_recent_messages(recent_messages);
+    if (from < first || from > next_recent_messages(recent_messages)) {
+        char marker[MESSAGE_SIZE];
+        write_connection(args->client_connection, marker, format_resume_gap(marker, sequence, first));
+        from = first;
+    }
+    open_connection_handler(
+            args,
+            queue,
+            send_range_recent_messages(args->client_connection, recent_messages, from));
+}
+
+static bool attach_framer_handler(HandlerArgs *args, size_t limit) {
+    Framer *framer = &args->framer;
+
+    framer->buffer = acquire_shared_buffer(args->shard->pool, limit);
+    if (framer->buffer == NULL) return false;
+    __atomic_add_fetch(&args->shard->receive_bytes, framer->buffer->capacity, __ATOMIC_RELAXED);
+    return true;
+}
+
+static void release_framer_handler(HandlerArgs *args) {
+    Framer *framer = &args->framer;
+
+    if (framer->buffer == NULL) return;
+    __atomic_sub_fetch(&args->shard->receive_bytes, framer->buffer->capacity, __ATOMIC_RELAXED);
+    release_shared_buffer(framer->buffer);
+    framer->buffer = NULL;
+    framer->size = 0;
+}
+
+static void flush_lines_handler(HandlerArgs *args, Queue *queue, QMessage *messages, size_t *count) {
+    if (*count == 0) return;
+
+    // Chat messages may be read after the close event of the connection, which is on a higher priority lane
+    __atomic_add_fetch(&args->client_connection->queued, *count, __ATOMIC_RELAXED);
+    size_t sent = send_queue_batch(queue, messages, *count);
+    if (sent < *count) __atomic_sub_fetch(&args->client_connection->queued, *count - sent, __ATOMIC_RELAXED);
+    for (size_t i = sent; i < *count; ++i) free_message(&messages[i]);
+    *count = 0;
+}
+
+static void line_handler(HandlerArgs *args, Queue *queue, char *line, size_t size, QMessage *messages, size_t *count) {
+    // The line ending is added back when the message is formatted
+    while (size > 0 && (line[size - 1] == '\n' || line[size - 1] == '\r')) --size;
+    if (size > args->context->line_limit) size = args->context->line_limit;
+#ifdef USE_UTF8
+    size = sanitize_utf8_buffer(line, size);
+#else
+    size = sanitize_buffer(line, size);
+#endif
+    if (args->joined != 0) {
+        if (size >= sizeof(RESUME_COMMAND) - 1 && memcmp(line, RESUME_COMMAND, sizeof(RESUME_COMMAND) - 1) == 0) {
+            resume_connection_handler(args, queue, line, size);
+            return;
+        }
+        join_connection_handler(args, queue);
+    }
+    if (size == 0) return;
+
+    ObjectPool *pool = args->context->message_pool;
+    if (!populate_message(&messages[*count], Q_MESSAGE_RECEIVED, args->client_connection, line, size, pool)) return;
+    if (++*count == QUEUE_BATCH_SIZE) flush_lines_handler(args, queue, messages, count);
+}
+
+void receive_connection_handler(HandlerArgs *args, Queue *queue, char *data, size_t size) {
+    Framer *framer = &args->framer;
+    size_t limit = args->context->line_limit;
+    QMessage messages[QUEUE_BATCH_SIZE];
+    size_t count = 0;
+    char *end = data + size;
+
+    __atomic_add_fetch(&args->shard->received, size, __ATOMIC_RELAXED);
+    while (data < end) {
+        char *newline = memchr(data, '\n', end - data);
+        char *next = newline != NULL ? newline + 1 : end;
+        size_t length = next - data;
+
+        if (framer->discarding) {
+            framer->discarding = newline == NULL;
+        } else if (framer->size == 0 && newline != NULL) {
+            line_handler(args, queue, data, length, messages, &count);
+        } else if (framer->buffer == NULL && !attach_framer_handler(args, limit)) {
+            // The start of the line cannot be kept, the line is dropped
+            framer->discarding = newline == NULL;
+        } else {
+            size_t room = limit - framer->size;
+            size_t taken = length < room ? length : room;
+            memcpy(framer->buffer->data + framer->size, data, taken);
+            framer->size += taken;
+            if (newline != NULL || length >= room) {
+                line_handler(args, queue, framer->buffer->data, framer->size, messages, &count);
+                release_framer_handler(args);
+                framer->discarding = newline == NULL;
+            }
+        }
+        data = next;
+    }
+    flush_lines_handler(args, queue, messages, &count);
+}
+
+bool handle_connection(HandlerArgs *args, Queue *queue) {
+    char buffer[MESSAGE_READ_SIZE];
+    size_t received;
+
+    while (true) {
+        switch (read_connection(args->client_connection, buffer, MESSAGE_READ_SIZE, &received)) {
+            case CONNECTION_READY:
+                receive_connection_handler(args, queue, buffer, received);
+                break;
+            case CONNECTION_WOULD_BLOCK:
+                return true;
+            case CONNECTION_CLOSED:
+                return false;
+        }
+    }
+}
+
+void close_connection_handler(HandlerArgs *args, Queue *queue) {
+    QMessage message;
+
+    // A client leaving before it joined is unknown to the main server thread
+    if (args->joined != 0) {
+        close_connection(args->client_connection);
+        release_object(args->client_connection);
+        release_framer_handler(args);
+        release_object(args);
+        return;
+    }
+    if (args->framer.size > 0) {
+        size_t count = 0;
+        line_handler(args, queue, args->framer.buffer->data, args->framer.size, &message, &count);
+        flush_lines_handler(args, queue, &message, &count);
+    }
+    release_framer_handler(args);
+    populate_message(&message, Q_MESSAGE_CLOSE_CONNECTION, args->client_connection, NULL, 0, NULL);
     send_queue(queue, &message);
+    release_object(args);
+}
 
-    free(arg);
-    close_queue(queue);
-    return NULL;
+void writable_connection_handler(HandlerArgs *args, Queue *queue) {
+    QMessage message;
+
+    if (!__atomic_exchange_n(&args->client_connection->outbound.blocked, false, __ATOMIC_SEQ_CST)) return;
+    populate_message(&message, Q_MESSAGE_WRITABLE, args->client_connection, NULL, 0, NULL);
+    send_queue(queue, &message);
 }
@@ -12,42 +12,114 @@
 
 
 /**
- * Structure representing arguments for a connection handler thread.
+ * Structure representing the line a client has started sending but not finished yet.
  *
- * This structure represents the arguments passed to a connection handler thread.
+ * Received chunks are split into lines, each forwarded as its own message. The lines complete in a chunk
+ * are forwarded from the chunk itself, only a line cut by the end of a chunk is copied here until
+ * the chunk completing it arrives. The buffer holding it is taken from the pool of the shard when a line is cut
+ * and returned as soon as the line is forwarded, so an idle client holds no receive buffer.
+ *
+ * The structure fields are defined as follows:
+ *  - buffer: A pointer to the SharedBuffer holding the start of the line, able to hold the line limit
+ *    of the server context, NULL while no line is cut.
+ *  - size: The number of bytes of the line received so far.
+ *  - discarding: Whether the rest of a line longer than the limit is being dropped until its newline.
+ */
+typedef struct {
+    SharedBuffer *buffer;
+    u_int32_t size;
+    bool discarding;
+} Framer;
+
+
+/**
+ * Structure representing arguments for a connection handler.
+ *
+ * This structure represents the state the reactor keeps for every registered client connection.
  * It contains pointers to the client connection and the server context associated with the handler.
  *
  * The structure fields are defined as follows:
  *  - client_connection: A pointer to the client connection structure associated with the handler.
  *  - context: A pointer to the server context structure containing context information for the handler.
+ *  - shard: A pointer to the listener shard handling the connection.
+ *  - joined: The monotonic time in milliseconds the client connected at while it may still ask to resume,
+ *    0 once it has been sent the recent messages and announced to the main server thread.
+ *  - previous: The previous connection waiting to be sent the recent messages in the reactor.
+ *  - next: The next connection waiting to be sent the recent messages in the reactor.
+ *  - framer: The line of the client cut by the end of the last received chunk.
+ *  - closing: Whether the peer closed the connection and the reactor waits for its pending requests to complete
+ *    before releasing it.
  *
  * Example usage:
  * @code
- * HandlerArgs args;
- * args.client_connection = client_conn;
- * args.context = server_ctx;
- * pthread_create(&thread_id, NULL, handle_connection, (void*)&args);
+ * HandlerArgs *args = malloc(sizeof(HandlerArgs));
+ * args->client_connection = client_conn;
+ * args->context = server_ctx;
+ * add_reactor(reactor, client_conn, args);
  * @endcode
  */
-typedef struct {
+typedef struct HandlerArgs {
     Connection *client_connection;
     ServerContext *context;
+    Shard *shard;
+    u_int64_t joined;
+    struct HandlerArgs *previous;
+    struct HandlerArgs *next;
+    Framer framer;
+    bool closing;
 } HandlerArgs;
 
 
+/**
+ * Sends the recent messages from the specified index to the specified connection.
+ *
+ * The messages are copied into a buffer of RESUME_BUFFER_SIZE bytes and written with write_connection whenever
+ * it is full, so a delta of a few messages takes a single write and what the socket does not take waits in the
+ * outbound queue of the connection. It runs on a reactor thread without blocking the main thread adding messages,
+ * and on the main thread, neither of them ever waiting on the client.
+ *
+ * @param connection A pointer to the Connection structure representing the destination connection.
+ * @param recent_messages A pointer to the RecentMessages buffer containing recent messages to be sent.
+ * @param from The index of the first message to send, the oldest stored message is sent first if it is newer.
+ *
+ * @return The index after the newest message sent.
+ *
+ * The function performs the following steps:
+ * 1. Iterates through the message indexes from the specified one up to the newest one.
+ * 2. Copies a consistent snapshot of each message after the previous one in the buffer, writing the buffer
+ *    when the next message may not fit. If a message is dropped while it is copied,
+ *    continues from the oldest message still stored.
+ * 3. Writes the rest of the buffer.
+ *
+ * Example usage:
+ * @code
+ * // Sends the messages after #41
+ * send_range_recent_messages(connection, messages, 42);
+ * @endcode
+ */
+u_int64_t send_range_recent_messages(
+        Connection *connection,
+        RecentMessages *recent_messages,
+        u_int64_t from);
+
+
 /**
  * Sends recent messages stored in a RecentMessages buffer to the specified connection.
  *
  * This function sends recent messages stored in a RecentMessages buffer to the specified connection.
- * It iterates through the messages from the tail of the buffer and sends each message to the connection.
+ * It queues a reference to a snapshot of the whole history, shared by every connection joining until the next
+ * message, to the outbound queue of the connection, so the reactor never waits on a slow client: what the socket
+ * does not take right away is sent once it is writable, and the outbound policy applies to it.
+ * It runs on a reactor thread while the main thread keeps adding messages, without blocking it.
  *
  * @param connection A pointer to the Connection structure representing the destination connection.
  * @param recent_messages A pointer to the RecentMessages buffer containing recent messages to be sent.
  *
+ * @return The index after the newest message sent.
+ *
  * The function performs the following steps:
- * 1. Initializes a message buffer to store each message.
- * 2. Iterates through the recent messages in the buffer starting from the tail.
- * 3. Retrieves each message from the buffer and sends it to the specified connection.
+ * 1. Takes the current snapshot of the recent messages and writes it to the specified connection at once.
+ * 2. If the snapshot cannot be allocated, writes every stored message with the send_range_recent_messages function.
  *
  * Example usage:
  * @code
@@ -58,41 +130,183 @@ typedef struct {
  * send_recent_messages(&conn, messages);
  * @endcode
  */
-void send_recent_messages(Connection *connection, RecentMessages *recent_messages);
+u_int64_t send_recent_messages(Connection *connection, RecentMessages *recent_messages);
 
 
 /**
- * Thread function for handling communication with a client connection.
- *
- * This function is invoked as a separate thread to handle communication with a client connection.
- * It reads incoming messages from the client, processes them, and sends responses accordingly.
- * Communication with the main server thread is facilitated through a message queue.
+ * Announces a client connection that has been sent the recent messages.
  *
- * @param arg A pointer to a structure containing arguments for the thread function.
- *            It must be of type HandlerArgs, containing a client connection and server context.
+ * A freshly accepted client waits up to RESUME_WAIT milliseconds before it is sent the recent messages,
+ * so a reconnecting client can ask for the messages it missed only. It is announced once they are sent,
+ * and the main server thread sends it the messages added in between before registering it for broadcasts,
+ * so the client gets every message once and in order.
  *
- * @return NULL after handling the connection.
+ * @param args A pointer to the HandlerArgs structure describing the client connection.
+ * @param queue A pointer to the Queue structure used to communicate with the main server thread.
+ * @param replayed The index after the newest recent message sent to the client.
  *
  * The function performs the following steps:
- * 1. Initializes a message queue for communication with the main server thread.
+ * 1. Marks the client as joined and stores the index in the client connection.
  * 2. Sends an open connection message to the main server thread via the message queue.
- * 3. Sends recent messages to the client.
- * 4. Enters a loop to read incoming messages from the client, sanitize them, and send them to the main server thread
- *    via the message queue.
- * 5. Closes the client connection when communication ends and sends a close connection message to the main server
- *    thread via the message queue.
- * 6. Frees memory allocated for argument structure and message queue.
  *
  * Example usage:
  * @code
- * pthread_t thread;
- * HandlerArgs *args = (HandlerArgs*)malloc(sizeof(HandlerArgs));
- * args->client_connection = &client_conn;
- * args->context = &server_context;
- * pthread_create(&thread, NULL, handle_connection, (void*)args);
+ * open_connection_handler(args, queue, send_recent_messages(args->client_connection, recent_messages));
+ * @endcode
+ */
+void open_connection_handler(HandlerArgs *args, Queue *queue, u_int64_t replayed);
+
+
+/**
+ * Sends every recent message to a client that has not asked to resume and announces it.
+ *
+ * Invoked by the reactor RESUME_WAIT milliseconds after the client connected, or by receive_connection_handler
+ * if the first data of the client is not RESUME_COMMAND.
+ *
+ * @param args A pointer to the HandlerArgs structure describing the client connection.
+ * @param queue A pointer to the Queue structure used to communicate with the main server thread.
+ *
+ * Example usage:
+ * @code
+ * if (args->joined != 0 && args->joined + RESUME_WAIT <= now) join_connection_handler(args, queue);
+ * @endcode
+ */
+void join_connection_handler(HandlerArgs *args, Queue *queue);
+
+
+/**
+ * Sends a reconnecting client the recent messages it missed and announces it.
+ *
+ * The client sends RESUME_COMMAND followed by the sequence number of the last message it has received
+ * as its first line. If the following message is no longer stored, or the sequence is ahead of the history,
+ * the client gets a gap marker formatted by format_resume_gap followed by every stored message.
+ *
+ * @param args A pointer to the HandlerArgs structure describing the client connection.
+ * @param queue A pointer to the Queue structure used to communicate with the main server thread.
+ * @param line A pointer to the received line starting with RESUME_COMMAND.
+ * @param size The number of bytes of the line.
+ *
+ * The function performs the following steps:
+ * 1. Parses the sequence number following RESUME_COMMAND.
+ * 2. Writes the gap marker if the messages after the sequence cannot be sent, starting from the oldest stored one.
+ * 3. Writes the messages with the send_range_recent_messages function, through the outbound queue of the connection
+ *    like every other write of the reactor, and announces the client
+ *    with the open_connection_handler function.
+ *
+ * Example usage:
+ * @code
+ * char line[] = "/resume 41\n";
+ * resume_connection_handler(args, queue, line, strlen(line));
+ * @endcode
+ */
+void resume_connection_handler(HandlerArgs *args, Queue *queue, char *line, size_t size);
+
+
+/**
+ * Splits a chunk received from a client connection into lines and forwards them to the main server thread.
+ *
+ * Every line is sanitized in place, keeping UTF-8 text if the server is built with USE_UTF8, and forwarded
+ * as its own received message, so lines sent together are not merged and a line cut between chunks
+ * is not sent as fragments. Newlines are found with memchr, which scans whole vectors at once.
+ * The lines of a chunk are sent to the queue together with the send_queue_batch function.
+ * Line endings are removed, as the formatting of the message adds a newline back. Lines longer than
+ * the line limit of the server context are cut to the limit and their rest is dropped,
+ * lines left empty after sanitization are dropped. A first line starting with RESUME_COMMAND is handled
+ * with the resume_connection_handler function, any other first line makes the recent messages sent right away
+ * with the join_connection_handler function.
+ *
+ * @param args A pointer to the HandlerArgs structure describing the client connection.
+ * @param queue A pointer to the Queue structure used to communicate with the main server thread.
+ * @param data A pointer to the received data, it is modified by the sanitization.
+ * @param size The number of received bytes.
+ *
+ * The function performs the following steps:
+ * 1. Counts the bytes of the chunk as received by the shard of the connection and finds the end
+ *    of the next line in the chunk.
+ * 2. Forwards a line found whole in the chunk from the chunk itself.
+ * 3. Otherwise appends the part of the line to the framer of the connection, and forwards the line
+ *    once its newline arrives or it reaches the limit.
+ * 4. Sends the forwarded lines to the queue in batches of up to QUEUE_BATCH_SIZE messages.
+ *
+ * Example usage:
+ * @code
+ * receive_connection_handler(args, queue, buffer, received);
+ * @endcode
+ */
+void receive_connection_handler(HandlerArgs *args, Queue *queue, char *data, size_t size);
+
+
+/**
+ * Handles a readiness event on a non-blocking client connection.
+ *
+ * This function is invoked by the reactor whenever the client socket becomes readable.
+ * As readiness is reported in edge-triggered mode, it reads incoming messages until the socket
+ * is drained in chunks of up to MESSAGE_READ_SIZE bytes, and forwards the lines in them to the main server thread
+ * via the message queue.
+ *
+ * @param args A pointer to the HandlerArgs structure describing the client connection.
+ * @param queue A pointer to the Queue structure used to communicate with the main server thread.
+ *
+ * @return true if the connection is still alive and waits for the next event,
+ *         false if the peer closed the connection and it should be released.
+ *
+ * The function performs the following steps:
+ * 1. Reads from the client connection until it reports CONNECTION_WOULD_BLOCK or CONNECTION_CLOSED.
+ * 2. Passes every received chunk to the receive_connection_handler function.
+ * 3. Returns whether the connection should stay registered in the reactor.
+ *
+ * Example usage:
+ * @code
+ * if (!handle_connection(args, queue)) {
+ *     close_connection_handler(args, queue);
+ * }
+ * @endcode
+ */
+bool handle_connection(HandlerArgs *args, Queue *queue);
+
+
+/**
+ * Releases a client connection that has been closed by the peer.
+ *
+ * This function notifies the main server thread that the client connection is closed and frees
+ * the handler arguments. A last line the client did not end before closing is forwarded first.
+ * The connection itself is closed and freed by the main server thread once it has been removed
+ * from the registry of connections, so its file descriptor cannot be reused in between.
+ * A client closed before it has been announced is closed and freed right away.
+ *
+ * @param args A pointer to the HandlerArgs structure describing the client connection.
+ * @param queue A pointer to the Queue structure used to communicate with the main server thread.
+ *
+ * The function performs the following steps:
+ * 1. Closes and frees the connection if it has not been announced to the main server thread.
+ * 2. Otherwise sends a close connection message to the main server thread via the message queue.
+ * 3. Frees memory allocated for the argument structure.
+ *
+ * Example usage:
+ * @code
+ * close_connection_handler(args, queue);
+ * @endcode
+ */
+void close_connection_handler(HandlerArgs *args, Queue *queue);
+
+
+/**
+ * Handles a writability event on a client connection.
+ *
+ * The main server thread flags a connection as blocked when the socket does not take all the bytes it writes.
+ * This function is invoked by the reactor whenever the client socket becomes writable and, if the flag is set,
+ * clears it and asks the main server thread to flush the waiting bytes, so the reactor never touches
+ * the outbound queue owned by the main server thread.
+ *
+ * @param args A pointer to the HandlerArgs structure describing the client connection.
+ * @param queue A pointer to the Queue structure used to communicate with the main server thread.
+ *
+ * Example usage:
+ * @code
+ * if (events & EPOLLOUT) writable_connection_handler(args, queue);
  * @endcode
  */
-void *handle_connection(void *arg);
+void writable_connection_handler(HandlerArgs *args, Queue *queue);
 
 
 #endif //SERVER_HANDLER_H
@@ -1,10 +1,81 @@
 #include "hash.h"
 
 
+// Default secret of wyhash, odd constants with balanced bits
+static const u_int64_t hash_secret[4] = {
+        0xa0761d6478bd642fULL,
+        0xe7037ed1a0b428dbULL,
+        0x8ebc6af09c88c6e3ULL,
+        0x589965cc75374cc3ULL
+};
+
+static inline void multiply_hash(u_int64_t *low, u_int64_t *high) {
+    __uint128_t product = (__uint128_t) *low * *high;
+    *low = (u_int64_t) product;
+    *high = (u_int64_t) (product >> 64);
+}
+
+static inline u_int64_t mix_hash(u_int64_t a, u_int64_t b) {
+    multiply_hash(&a, &b);
+    return a ^ b;
+}
+
+static inline u_int64_t read_8_hash(const u_int8_t *data) {
+    u_int64_t value;
+    memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+static inline u_int64_t read_4_hash(const u_int8_t *data) {
+    u_int32_t value;
+    memcpy(&value, data, sizeof(value));
+    return value;
+}
+
 u_int64_t hash(const u_int8_t *data, size_t size) {
-    u_int64_t hash = 5381;
-    for (size_t i = 0; i < size; ++i) {
-        hash = hash * 33 + data[i];
+    u_int64_t seed = mix_hash(hash_secret[0], hash_secret[1]);
+    u_int64_t a, b;
+
+    if (size <= 16) {
+        if (size >= 4) {
+            // Two overlapping reads from each end cover every byte of keys up to 16 bytes
+            size_t middle = (size >> 3) << 2;
+            a = (read_4_hash(data) << 32) | read_4_hash(data + middle);
+            b = (read_4_hash(data + size - 4) << 32) | read_4_hash(data + size - 4 - middle);
+        } else if (size > 0) {
+            a = ((u_int64_t) data[0] << 16) | ((u_int64_t) data[size >> 1] << 8) | data[size - 1];
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        size_t left = size;
+        if (left > 48) {
+            u_int64_t second = seed, third = seed;
+            do {
+                seed = mix_hash(read_8_hash(data) ^ hash_secret[1], read_8_hash(data + 8) ^ seed);
+                second = mix_hash(read_8_hash(data + 16) ^ hash_secret[2], read_8_hash(data + 24) ^ second);
+                third = mix_hash(read_8_hash(data + 32) ^ hash_secret[3], read_8_hash(data + 40) ^ third);
+                data += 48;
+                left -= 48;
+            } while (left > 48);
+            seed ^= second ^ third;
+        }
+        while (left > 16) {
+            seed = mix_hash(read_8_hash(data) ^ hash_secret[1], read_8_hash(data + 8) ^ seed);
+            data += 16;
+            left -= 16;
+        }
+        a = read_8_hash(data + left - 16);
+        b = read_8_hash(data + left - 8);
     }
-    return hash;
+
+    a ^= hash_secret[1];
+    b ^= seed;
+    multiply_hash(&a, &b);
+    return mix_hash(a ^ hash_secret[0] ^ size, b ^ hash_secret[1]);
+}
+
+u_int64_t hash_integer(u_int64_t key) {
+    return mix_hash(key ^ hash_secret[0], hash_secret[1]);
 }
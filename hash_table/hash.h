@@ -3,14 +3,16 @@
 
 
 #include <stdlib.h>
+#include <string.h>
 
 
 /**
- * Computes a hash value for the given data using the djb2 algorithm.
+ * Computes a hash value for the given data using the wyhash algorithm.
  *
- * This function computes a hash value for the given data using the djb2 algorithm,
- * which is a simple, non-cryptographic hash function. It iterates over each byte
- * of the data and updates the hash value based on the current byte and the previous hash value.
+ * This function computes a hash value for the given data using wyhash, a fast non-cryptographic
+ * hash function built on 64x64 to 128 bit multiplications. Instead of processing one byte at a time,
+ * it reads the data in 4 and 8 byte words, so short keys such as file descriptors or connection names
+ * are hashed with a couple of multiplications, and every bit of the key affects every bit of the hash.
  *
  * @param data A pointer to an array of bytes representing the data to be hashed.
  * @param size The size of the data array in bytes.
@@ -18,20 +20,38 @@
  * @return The computed hash value as a 64-bit unsigned integer.
  *
  * The function performs the following steps:
- * 1. Initializes the hash value to 5381.
- * 2. Iterates through each byte of the data array.
- * 3. Updates the hash value using the djb2 algorithm: hash = hash * 33 + data[i].
- * 4. Returns the computed hash value.
+ * 1. Reads keys up to 16 bytes with overlapping 4 byte reads from both ends.
+ * 2. Mixes longer keys 48 bytes at a time in three independent lanes, then 16 bytes at a time.
+ * 3. Mixes the last two words with the size of the data and returns the result.
  *
  * Example usage:
  * @code
  * const char *data = "hello";
  * size_t size = strlen(data);
  * u_int64_t h = hash((const u_int8_t *)data, size);
- * printf("Hash value: %llu\n", h);
+ * printf("Hash value: %lu\n", h);
  * @endcode
  */
 u_int64_t hash(const u_int8_t *data, size_t size);
 
 
+/**
+ * Computes a hash value for an integer key.
+ *
+ * This function mixes an integer of up to 64 bits with a single multiplication,
+ * without going through memory as the hash function for byte arrays does.
+ * It is used by the tables specialized for integer keys.
+ *
+ * @param key The integer to be hashed.
+ *
+ * @return The computed hash value as a 64-bit unsigned integer.
+ *
+ * Example usage:
+ * @code
+ * u_int64_t h = hash_integer(connection->fd);
+ * @endcode
+ */
+u_int64_t hash_integer(u_int64_t key);
+
+
 #endif //HASH_TABLE_HASH_H
@@ -0,0 +1,4 @@
+#include "int_table.h"
+
+
+INT_TABLE_DEFINE(NameTable, name_table, u_int64_t)
@@ -0,0 +1,280 @@
+#ifndef HASH_TABLE_INT_TABLE_H
+#define HASH_TABLE_INT_TABLE_H
+
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include "hash.h"
+#include "table.h"
+#include "../definitions.h"
+
+
+/**
+ * Declares a key-value table specialized for an integer key type.
+ *
+ * The generated table works as KVTable, with Robin Hood probing, tombstones and incremental rehashing,
+ * but stores keys inline in its slots, hashes them with hash_integer and compares them
+ * with integer equality, so a lookup never follows a key pointer nor calls memcmp.
+ *
+ * @param Type The name of the generated table type, its slots are of type Type##Item.
+ * @param name The suffix of the generated functions, e.g. set_##name.
+ * @param Key The integer type of the keys.
+ *
+ * The macro declares the following, with the same behaviour as their KVTable counterparts:
+ *  - Type *init_##name(size_t size);
+ *  - bool set_##name(Type *table, Key key, void *value);
+ *  - bool clear_##name(Type *table, Key key);
+ *  - bool get_##name(Type *table, Key key, void **result);
+ *  - size_t count_##name(Type *table);
+ *  - bool iterate_##name(Type *table, size_t *cursor, Key *key, void **result);
+ *  - void free_##name(Type *table);
+ *
+ * Example usage:
+ * @code
+ * INT_TABLE_DECLARE(FdTable, fd_table, int32_t)
+ *
+ * FdTable *table = init_fd_table(SOCKET_MAX_CONNECTIONS);
+ * set_fd_table(table, connection->fd, connection);
+ * @endcode
+ */
+#define INT_TABLE_DECLARE(Type, name, Key)                                                              \
+typedef struct {                                                                                        \
+    Key key;                                                                                            \
+    u_int16_t distance;                                                                                 \
+    u_int8_t state;                                                                                     \
+    void *value;                                                                                        \
+} Type##Item;                                                                                           \
+                                                                                                        \
+typedef struct {                                                                                        \
+    Type##Item *items;                                                                                  \
+    size_t capacity;                                                                                    \
+    size_t count;                                                                                       \
+    size_t tombstones;                                                                                  \
+} Type##Storage;                                                                                        \
+                                                                                                        \
+typedef struct {                                                                                        \
+    Type##Storage current;                                                                              \
+    Type##Storage previous;                                                                             \
+    size_t rehash_index;                                                                                \
+    size_t rehash_step;                                                                                 \
+} Type;                                                                                                 \
+                                                                                                        \
+Type *init_##name(size_t size);                                                                         \
+bool set_##name(Type *table, Key key, void *value);                                                     \
+bool clear_##name(Type *table, Key key);                                                                \
+bool get_##name(Type *table, Key key, void **result);                                                   \
+size_t count_##name(Type *table);                                                                       \
+bool iterate_##name(Type *table, size_t *cursor, Key *key, void **result);                              \
+void free_##name(Type *table);
+
+
+/**
+ * Defines the functions of a key-value table declared with INT_TABLE_DECLARE.
+ *
+ * Must be expanded once, in a single translation unit, with the same arguments as the declaration.
+ */
+#define INT_TABLE_DEFINE(Type, name, Key)                                                               \
+static bool init_storage_##name(Type##Storage *storage, size_t capacity) {                              \
+    storage->items = calloc(capacity, sizeof(Type##Item));                                             \
+    if (storage->items == NULL) return false;                                                           \
+    storage->capacity = capacity;                                                                       \
+    storage->count = 0;                                                                                 \
+    storage->tombstones = 0;                                                                            \
+    return true;                                                                                        \
+}                                                                                                       \
+                                                                                                        \
+static void free_storage_##name(Type##Storage *storage) {                                               \
+    free(storage->items);                                                                               \
+    storage->items = NULL;                                                                              \
+    storage->capacity = 0;                                                                              \
+    storage->count = 0;                                                                                 \
+    storage->tombstones = 0;                                                                            \
+}                                                                                                       \
+                                                                                                        \
+static bool find_storage_##name(Type##Storage *storage, Key key, size_t *result) {                      \
+    if (storage->capacity == 0) return false;                                                           \
+                                                                                                        \
+    size_t mask = storage->capacity - 1;                                                                \
+    size_t index = hash_integer((u_int64_t) key) & mask;                                                \
+                                                                                                        \
+    for (u_int32_t distance = 0; distance < storage->capacity; ++distance) {                            \
+        Type##Item *item = &storage->items[index];                                                      \
+        if (item->state == KV_EMPTY || item->distance < distance) return false;                         \
+        if (item->state == KV_FULL && item->key == key) {                                               \
+            *result = index;                                                                            \
+            return true;                                                                                \
+        }                                                                                               \
+        index = (index + 1) & mask;                                                                     \
+    }                                                                                                   \
+    return false;                                                                                       \
+}                                                                                                       \
+                                                                                                        \
+static void insert_storage_##name(Type##Storage *storage, Type##Item inserted) {                        \
+    size_t mask = storage->capacity - 1;                                                                \
+    size_t index = hash_integer((u_int64_t) inserted.key) & mask;                                       \
+                                                                                                        \
+    inserted.state = KV_FULL;                                                                           \
+    inserted.distance = 0;                                                                              \
+    while (true) {                                                                                      \
+        Type##Item *item = &storage->items[index];                                                      \
+        if (item->state == KV_EMPTY) {                                                                  \
+            *item = inserted;                                                                           \
+            ++storage->count;                                                                           \
+            return;                                                                                     \
+        }                                                                                               \
+        if (item->state == KV_TOMBSTONE && item->distance <= inserted.distance) {                       \
+            *item = inserted;                                                                           \
+            ++storage->count;                                                                           \
+            --storage->tombstones;                                                                      \
+            return;                                                                                     \
+        }                                                                                               \
+        if (item->state == KV_FULL && item->distance < inserted.distance) {                             \
+            Type##Item displaced = *item;                                                               \
+            *item = inserted;                                                                           \
+            inserted = displaced;                                                                       \
+        }                                                                                               \
+        index = (index + 1) & mask;                                                                     \
+        ++inserted.distance;                                                                            \
+    }                                                                                                   \
+}                                                                                                       \
+                                                                                                        \
+static void remove_storage_##name(Type##Storage *storage, size_t index) {                               \
+    storage->items[index].state = KV_TOMBSTONE;                                                         \
+    storage->items[index].value = NULL;                                                                 \
+    --storage->count;                                                                                   \
+    ++storage->tombstones;                                                                              \
+}                                                                                                       \
+                                                                                                        \
+static void migrate_##name(Type *table, size_t steps) {                                                 \
+    Type##Storage *previous = &table->previous;                                                         \
+                                                                                                        \
+    while (previous->capacity > 0 && steps > 0) {                                                       \
+        --steps;                                                                                        \
+        Type##Item *item = &previous->items[table->rehash_index];                                       \
+        if (item->state == KV_FULL) {                                                                   \
+            insert_storage_##name(&table->current, *item);                                              \
+            remove_storage_##name(previous, table->rehash_index);                                       \
+        }                                                                                               \
+        if (++table->rehash_index == previous->capacity) free_storage_##name(previous);                 \
+    }                                                                                                   \
+}                                                                                                       \
+                                                                                                        \
+static bool reserve_##name(Type *table) {                                                               \
+    Type##Storage *current = &table->current;                                                           \
+    if ((current->count + current->tombstones + 1) * TABLE_LOAD_DENOMINATOR                             \
+        <= current->capacity * TABLE_LOAD_NUMERATOR) return true;                                       \
+                                                                                                        \
+    migrate_##name(table, SIZE_MAX);                                                                    \
+                                                                                                        \
+    Type##Storage grown;                                                                                \
+    size_t capacity = TABLE_MIN_CAPACITY;                                                               \
+    while (capacity < (current->count + 1) * 2) capacity <<= 1;                                         \
+    if (!init_storage_##name(&grown, capacity)) return false;                                           \
+                                                                                                        \
+    size_t headroom = grown.capacity * TABLE_LOAD_NUMERATOR / TABLE_LOAD_DENOMINATOR - current->count - 1; \
+    table->rehash_step = current->capacity / headroom + 1;                                              \
+    if (table->rehash_step < TABLE_REHASH_STEP) table->rehash_step = TABLE_REHASH_STEP;                 \
+                                                                                                        \
+    table->previous = *current;                                                                         \
+    table->current = grown;                                                                             \
+    table->rehash_index = 0;                                                                            \
+    return true;                                                                                        \
+}                                                                                                       \
+                                                                                                        \
+Type *init_##name(size_t size) {                                                                        \
+    Type *table = malloc(sizeof(Type));                                                                 \
+    if (table == NULL) return NULL;                                                                     \
+                                                                                                        \
+    size_t capacity = TABLE_MIN_CAPACITY;                                                               \
+    while (capacity < size) capacity <<= 1;                                                             \
+    if (!init_storage_##name(&table->current, capacity)) {                                              \
+        free(table);                                                                                    \
+        return NULL;                                                                                    \
+    }                                                                                                   \
+    table->previous = (Type##Storage) {.items = NULL, .capacity = 0, .count = 0, .tombstones = 0};      \
+    table->rehash_index = 0;                                                                            \
+    table->rehash_step = TABLE_REHASH_STEP;                                                             \
+    return table;                                                                                       \
+}                                                                                                       \
+                                                                                                        \
+bool set_##name(Type *table, Key key, void *value) {                                                    \
+    size_t index;                                                                                       \
+                                                                                                        \
+    migrate_##name(table, table->rehash_step);                                                          \
+    if (find_storage_##name(&table->current, key, &index)) {                                            \
+        table->current.items[index].value = value;                                                      \
+        return true;                                                                                    \
+    }                                                                                                   \
+    if (find_storage_##name(&table->previous, key, &index)) {                                           \
+        remove_storage_##name(&table->previous, index);                                                 \
+    }                                                                                                   \
+    if (!reserve_##name(table)) return false;                                                           \
+                                                                                                        \
+    Type##Item item = {.key = key, .value = value};                                                     \
+    insert_storage_##name(&table->current, item);                                                       \
+    return true;                                                                                        \
+}                                                                                                       \
+                                                                                                        \
+bool clear_##name(Type *table, Key key) {                                                               \
+    size_t index;                                                                                       \
+    bool cleared = false;                                                                               \
+                                                                                                        \
+    migrate_##name(table, table->rehash_step);                                                          \
+    if (find_storage_##name(&table->current, key, &index)) {                                            \
+        remove_storage_##name(&table->current, index);                                                  \
+        cleared = true;                                                                                 \
+    }                                                                                                   \
+    if (find_storage_##name(&table->previous, key, &index)) {                                           \
+        remove_storage_##name(&table->previous, index);                                                 \
+        cleared = true;                                                                                 \
+    }                                                                                                   \
+    return cleared;                                                                                     \
+}                                                                                                       \
+                                                                                                        \
+bool get_##name(Type *table, Key key, void **result) {                                                  \
+    size_t index;                                                                                       \
+                                                                                                        \
+    migrate_##name(table, table->rehash_step);                                                          \
+    if (find_storage_##name(&table->current, key, &index)) {                                            \
+        *result = table->current.items[index].value;                                                    \
+        return true;                                                                                    \
+    }                                                                                                   \
+    if (find_storage_##name(&table->previous, key, &index)) {                                           \
+        *result = table->previous.items[index].value;                                                   \
+        return true;                                                                                    \
+    }                                                                                                   \
+    *result = NULL;                                                                                     \
+    return false;                                                                                       \
+}                                                                                                       \
+                                                                                                        \
+size_t count_##name(Type *table) {                                                                      \
+    return table->current.count + table->previous.count;                                                \
+}                                                                                                       \
+                                                                                                        \
+bool iterate_##name(Type *table, size_t *cursor, Key *key, void **result) {                             \
+    while (*cursor < table->previous.capacity + table->current.capacity) {                              \
+        Type##Item *item = *cursor < table->previous.capacity                                           \
+                           ? &table->previous.items[*cursor]                                            \
+                           : &table->current.items[*cursor - table->previous.capacity];                 \
+        ++*cursor;                                                                                      \
+        if (item->state != KV_FULL) continue;                                                           \
+        if (key != NULL) *key = item->key;                                                              \
+        *result = item->value;                                                                          \
+        return true;                                                                                    \
+    }                                                                                                   \
+    return false;                                                                                       \
+}                                                                                                       \
+                                                                                                        \
+void free_##name(Type *table) {                                                                         \
+    free_storage_##name(&table->previous);                                                              \
+    free_storage_##name(&table->current);                                                               \
+    free(table);                                                                                        \
+}
+
+
+// Table keyed by connection names
+INT_TABLE_DECLARE(NameTable, name_table, u_int64_t)
+
+
+#endif //HASH_TABLE_INT_TABLE_H
@@ -1,56 +1,204 @@
 #include "table.h"
 
 
+static size_t capacity_table(size_t size) {
+    size_t capacity = TABLE_MIN_CAPACITY;
+    while (capacity < size) capacity <<= 1;
+    return capacity;
+}
+
+static bool init_storage(KVStorage *storage, size_t capacity) {
+    storage->items = calloc(capacity, sizeof(KVItem));
+    if (storage->items == NULL) return false;
+    storage->capacity = capacity;
+    storage->count = 0;
+    storage->tombstones = 0;
+    return true;
+}
+
+static void free_storage(KVStorage *storage) {
+    free(storage->items);
+    storage->items = NULL;
+    storage->capacity = 0;
+    storage->count = 0;
+    storage->tombstones = 0;
+}
+
+// Keys the size of an integer, such as file descriptors, are mixed with the single multiplication of hash_integer
+static u_int64_t hash_key_table(void *key, size_t size) {
+    if (size == sizeof(u_int32_t)) {
+        u_int32_t value;
+        memcpy(&value, key, sizeof(value));
+        return hash_integer(value);
+    }
+    if (size == sizeof(u_int64_t)) {
+        u_int64_t value;
+        memcpy(&value, key, sizeof(value));
+        return hash_integer(value);
+    }
+    return hash(key, size);
+}
+
+static bool find_storage(KVStorage *storage, void *key, size_t size, u_int64_t hash_value, size_t *result) {
+    if (storage->capacity == 0) return false;
+
+    size_t mask = storage->capacity - 1;
+    size_t index = hash_value & mask;
+
+    for (u_int32_t distance = 0; distance < storage->capacity; ++distance) {
+        KVItem *item = &storage->items[index];
+        // Robin Hood ordering guarantees the key would have been placed before a richer slot
+        if (item->state == KV_EMPTY || item->distance < distance) return false;
+        if (item->state == KV_FULL && item->hash == hash_value && item->size == size
+            && memcmp(item->key, key, size) == 0) {
+            *result = index;
+            return true;
+        }
+        index = (index + 1) & mask;
+    }
+    return false;
+}
+
+static void insert_storage(KVStorage *storage, KVItem inserted) {
+    size_t mask = storage->capacity - 1;
+    size_t index = inserted.hash & mask;
+
+    inserted.state = KV_FULL;
+    inserted.distance = 0;
+    while (true) {
+        KVItem *item = &storage->items[index];
+        if (item->state == KV_EMPTY) {
+            *item = inserted;
+            ++storage->count;
+            return;
+        }
+        if (item->state == KV_TOMBSTONE && item->distance <= inserted.distance) {
+            *item = inserted;
+            ++storage->count;
+            --storage->tombstones;
+            return;
+        }
+        if (item->state == KV_FULL && item->distance < inserted.distance) {
+            // Take the slot from the richer item and carry on placing it
+            KVItem displaced = *item;
+            *item = inserted;
+            inserted = displaced;
+        }
+        index = (index + 1) & mask;
+        ++inserted.distance;
+    }
+}
+
+static void remove_storage(KVStorage *storage, size_t index) {
+    // The distance is kept so lookups can still stop early past the tombstone
+    storage->items[index].state = KV_TOMBSTONE;
+    storage->items[index].key = NULL;
+    storage->items[index].value = NULL;
+    --storage->count;
+    ++storage->tombstones;
+}
+
+static void migrate_table(KVTable *table, size_t steps) {
+    KVStorage *previous = &table->previous;
+
+    while (previous->capacity > 0 && steps > 0) {
+        --steps;
+        KVItem *item = &previous->items[table->rehash_index];
+        if (item->state == KV_FULL) {
+            insert_storage(&table->current, *item);
+            remove_storage(previous, table->rehash_index);
+        }
+        if (++table->rehash_index == previous->capacity) free_storage(previous);
+    }
+}
+
+static bool reserve_table(KVTable *table) {
+    KVStorage *current = &table->current;
+    if ((current->count + current->tombstones + 1) * TABLE_LOAD_DENOMINATOR
+        <= current->capacity * TABLE_LOAD_NUMERATOR) return true;
+
+    // Only one rehash at a time, the step below makes sure the running one is already done
+    migrate_table(table, SIZE_MAX);
+
+    KVStorage grown;
+    if (!init_storage(&grown, capacity_table((current->count + 1) * 2))) return false;
+
+    // Move the previous storage fast enough to finish before the grown one reaches its limit
+    size_t headroom = grown.capacity * TABLE_LOAD_NUMERATOR / TABLE_LOAD_DENOMINATOR - current->count - 1;
+    table->rehash_step = current->capacity / headroom + 1;
+    if (table->rehash_step < TABLE_REHASH_STEP) table->rehash_step = TABLE_REHASH_STEP;
+
+    table->previous = *current;
+    table->current = grown;
+    table->rehash_index = 0;
+    return true;
+}
+
 KVTable *init_table(size_t size) {
     KVTable *table = malloc(sizeof(KVTable));
     if (table == NULL) return NULL;
 
-    table->storage = (KVItem *) calloc(size, sizeof(KVItem));
-    if (table->storage == NULL) {
+    if (!init_storage(&table->current, capacity_table(size))) {
         free(table);
         return NULL;
     }
-    table->size = size;
+    table->previous.items = NULL;
+    table->previous.capacity = 0;
+    table->previous.count = 0;
+    table->previous.tombstones = 0;
+    table->rehash_index = 0;
+    table->rehash_step = TABLE_REHASH_STEP;
 
     return table;
 }
 
 bool set_table(KVTable *table, void *key, size_t size, void *value) {
-    u_int64_t hash_value = hash(key, size) % table->size;
-    u_int64_t index;
-
-    for (size_t i = 0; i < table->size; ++i) {
-        index = (hash_value + i) % table->size;
-        if (table->storage[index].key == NULL) {
-            table->storage[index].key = key;
-            table->storage[index].value = value;
-            return true;
-        } else if (memcmp(key, table->storage[index].key, size) == 0) {
-            table->storage[index].value = value;
-            return true;
-        }
+    u_int64_t hash_value = hash_key_table(key, size);
+    size_t index;
+
+    migrate_table(table, table->rehash_step);
+    if (find_storage(&table->current, key, size, hash_value, &index)) {
+        table->current.items[index].value = value;
+        return true;
     }
+    if (find_storage(&table->previous, key, size, hash_value, &index)) {
+        remove_storage(&table->previous, index);
+    }
+    if (!reserve_table(table)) return false;
 
-    return false;
+    KVItem item = {.key = key, .value = value, .hash = hash_value, .size = size};
+    insert_storage(&table->current, item);
+    return true;
 }
 
 bool clear_table(KVTable *table, void *key, size_t size) {
-    return set_table(table, key, size, NULL);
+    u_int64_t hash_value = hash_key_table(key, size);
+    size_t index;
+    bool cleared = false;
+
+    migrate_table(table, table->rehash_step);
+    if (find_storage(&table->current, key, size, hash_value, &index)) {
+        remove_storage(&table->current, index);
+        cleared = true;
+    }
+    if (find_storage(&table->previous, key, size, hash_value, &index)) {
+        remove_storage(&table->previous, index);
+        cleared = true;
+    }
+    return cleared;
 }
 
 bool get_table(KVTable *table, void *key, size_t size, void **result) {
-    u_int64_t hash_value = hash(key, size) % table->size;
-    u_int64_t index;
+    u_int64_t hash_value = hash_key_table(key, size);
+    size_t index;
 
-    if (table->storage[hash_value].key == NULL) {
-        *result = NULL;
-        return false;
+    migrate_table(table, table->rehash_step);
+    if (find_storage(&table->current, key, size, hash_value, &index)) {
+        *result = table->current.items[index].value;
+        return true;
     }
-
-    for (size_t i = 0; i < table->size; ++i) {
-        index = (hash_value + i) % table->size;
-        if (table->storage[index].key == NULL || memcmp(key, table->storage[index].key, size) != 0) continue;
-        *result = table->storage[index].value;
+    if (find_storage(&table->previous, key, size, hash_value, &index)) {
+        *result = table->previous.items[index].value;
         return true;
     }
 
@@ -58,7 +206,25 @@ bool get_table(KVTable *table, void *key, size_t size, void **result) {
     return false;
 }
 
+size_t count_table(KVTable *table) {
+    return table->current.count + table->previous.count;
+}
+
+bool iterate_table(KVTable *table, size_t *cursor, void **result) {
+    while (*cursor < table->previous.capacity + table->current.capacity) {
+        KVItem *item = *cursor < table->previous.capacity
+                       ? &table->previous.items[*cursor]
+                       : &table->current.items[*cursor - table->previous.capacity];
+        ++*cursor;
+        if (item->state != KV_FULL) continue;
+        *result = item->value;
+        return true;
+    }
+    return false;
+}
+
 void free_table(KVTable *table) {
-    free(table->storage);
+    free_storage(&table->previous);
+    free_storage(&table->current);
     free(table);
 }
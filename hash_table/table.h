@@ -5,70 +5,121 @@
 #include <stdbool.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include "hash.h"
+#include "../definitions.h"
+
+
+/**
+ * Enumeration representing the state of a slot in a key-value table.
+ *
+ * The enumeration values are defined as follows:
+ *  - KV_EMPTY: The slot has never been used since the storage was allocated.
+ *  - KV_FULL: The slot holds a live key-value pair.
+ *  - KV_TOMBSTONE: The slot held a key-value pair that has been removed.
+ *    Tombstones keep probe sequences intact and are reused by later insertions.
+ */
+typedef enum {
+    KV_EMPTY,
+    KV_FULL,
+    KV_TOMBSTONE
+} KVState;
 
 
 /**
  * Structure representing a key-value pair.
  *
- * This structure represents a key-value pair used in a key-value table (KVTable).
- * It contains pointers to the key and value associated with the pair.
+ * This structure represents a slot of a key-value table (KVTable).
+ * It contains pointers to the key and value associated with the pair,
+ * the hash of the key and its probe distance from the slot the hash points to.
  *
  * The structure fields are defined as follows:
- *  - key: A pointer to the key in the key-value pair.
+ *  - key: A pointer to the key in the key-value pair, the key is not copied
+ *    and must outlive the pair in the table.
  *  - value: A pointer to the value in the key-value pair.
+ *  - hash: The hash value of the key, kept to compare keys and move pairs without hashing them again.
+ *  - size: The size of the key in bytes.
+ *  - distance: The number of slots between the slot the hash points to and the slot of the pair.
+ *  - state: The state of the slot.
  *
  * Example usage:
  * @code
- * KVItem item;
- * item.key = "example_key";
- * item.value = "example_value";
+ * KVItem item = {.key = "example_key", .value = "example_value", .size = 11, .state = KV_FULL};
  * @endcode
  */
 typedef struct {
     void *key;
     void *value;
+    u_int64_t hash;
+    u_int32_t size;
+    u_int16_t distance;
+    u_int8_t state;
 } KVItem;
 
 
+/**
+ * Structure representing the storage array of a key-value table.
+ *
+ * The structure fields are defined as follows:
+ *  - items: A pointer to the array of KVItem structures.
+ *  - capacity: The number of slots in the array, always a power of two.
+ *  - count: The number of live key-value pairs in the array.
+ *  - tombstones: The number of removed pairs still marked in the array.
+ */
+typedef struct {
+    KVItem *items;
+    size_t capacity;
+    size_t count;
+    size_t tombstones;
+} KVStorage;
+
+
 /**
  * Structure representing a key-value table.
  *
- * This structure represents a key-value table used for storing key-value pairs.
- * It contains information about the size of the table and a pointer to the storage array
- * containing the key-value pairs.
+ * This structure represents a growable open addressing key-value table using Robin Hood probing:
+ * an insertion takes the slot of any pair closer to its own hash slot than the inserted pair,
+ * which keeps probe sequences short and lets lookups stop as soon as they reach such a pair.
+ * Keys of 4 or 8 bytes are hashed as integers with hash_integer, any other key with hash.
+ *
+ * Once the table is loaded past TABLE_LOAD_NUMERATOR/TABLE_LOAD_DENOMINATOR, a larger storage is
+ * allocated and the pairs of the previous one are moved over incrementally, at least TABLE_REHASH_STEP
+ * slots on every operation, so no single insertion pays for copying the whole table.
  *
  * The structure fields are defined as follows:
- *  - size: The size of the table, indicating the maximum number of key-value pairs it can store.
- *  - storage: A pointer to the array of KVItem structures representing the storage buffer.
+ *  - current: The storage receiving new pairs.
+ *  - previous: The storage being moved into current, with a capacity of 0 when no rehash is running.
+ *  - rehash_index: The next slot of previous to be moved.
+ *  - rehash_step: The number of slots moved on every operation, large enough for the rehash
+ *    to finish before current is loaded past its own limit.
  *
  * Example usage:
  * @code
- * KVTable table;
- * table.size = 100;
- * table.storage = (KVItem *)malloc(table.size * sizeof(KVItem));
+ * KVTable *table = init_table(100);
  * @endcode
  */
 typedef struct {
-    size_t size;
-    KVItem *storage;
+    KVStorage current;
+    KVStorage previous;
+    size_t rehash_index;
+    size_t rehash_step;
 } KVTable;
 
 
 /**
- * Initializes a key-value table with the specified size.
+ * Initializes a key-value table with the specified initial size.
  *
- * This function initializes a key-value table with the specified size.
- * It allocates memory for the table structure and the underlying storage array.
+ * This function initializes a key-value table able to hold at least the specified number
+ * of slots before growing. It allocates memory for the table structure and its storage array.
  *
- * @param size The number of elements in the key-value table.
+ * @param size The initial number of slots in the key-value table, rounded up to a power of two.
  *
  * @return A pointer to the initialized key-value table, or NULL if memory allocation fails.
  *
  * The function performs the following steps:
  * 1. Allocates memory for the KVTable structure.
  * 2. Allocates memory for the storage array of KVItem elements.
- * 3. Initializes the size of the table.
+ * 3. Initializes the table with no rehash running.
  * 4. Returns a pointer to the initialized table if successful, or NULL if memory allocation fails.
  *
  * Example usage:
@@ -89,8 +140,7 @@ KVTable *init_table(size_t size);
  * Inserts or updates a key-value pair in the specified key-value table.
  *
  * This function inserts or updates a key-value pair in the specified key-value table.
- * It computes the hash value of the key to determine the index in the table's storage array
- * where the key-value pair should be stored.
+ * The key is not copied, the pointer must remain valid until the pair is cleared.
  *
  * @param table A pointer to the KVTable structure representing the key-value table.
  * @param key A pointer to the key data.
@@ -100,13 +150,11 @@ KVTable *init_table(size_t size);
  * @return true if the key-value pair is successfully inserted or updated, otherwise false.
  *
  * The function performs the following steps:
- * 1. Computes the hash value of the key and calculates the initial index in the table's storage array.
- * 2. Iterates through the storage array using linear probing to find an empty slot or a slot
- *    containing the same key as the one being inserted or updated.
- * 3. If an empty slot is found, the key-value pair is inserted at that slot.
- *    If a slot with the same key is found, the value associated with the key is updated.
- * 4. Returns true if the operation is successful, indicating the key-value pair is inserted or updated.
- *    Returns false if the table is full and no empty slots are found.
+ * 1. Moves the next slots of a running rehash into the current storage.
+ * 2. Updates the value in place if the key is found in the current storage.
+ * 3. Otherwise removes the key from the previous storage, grows the table if it is loaded past its limit,
+ *    and inserts the pair with Robin Hood probing, reusing tombstones on the way.
+ * 4. Returns false only if the grown storage cannot be allocated.
  *
  * Example usage:
  * @code
@@ -125,21 +173,16 @@ bool set_table(KVTable *table, void *key, size_t size, void *value);
 
 
 /**
- * Clears the value associated with the specified key in the key-value table.
+ * Removes the key-value pair with the specified key from the key-value table.
  *
- * This function clears the value associated with the specified key in the key-value table
- * by setting the value to NULL. It is equivalent to updating the key-value pair with a NULL value.
+ * This function marks the slot of the pair as a tombstone, so the table no longer
+ * references the key and the slot can be reused by later insertions.
  *
  * @param table A pointer to the KVTable structure representing the key-value table.
  * @param key A pointer to the key data.
  * @param size The size of the key data in bytes.
  *
- * @return true if the value associated with the key is successfully cleared, otherwise false.
- *
- * The function internally calls the set_table function with the specified key and a NULL value,
- * effectively clearing the value associated with the key in the table.
- * Returns true if the set operation is successful, indicating the value associated with the key
- * is cleared or updated to NULL. Returns false if the set operation fails.
+ * @return true if a pair with the key was removed, otherwise false.
  *
  * Example usage:
  * @code
@@ -147,22 +190,18 @@ bool set_table(KVTable *table, void *key, size_t size, void *value);
  * char *key = "example_key";
  * size_t key_size = strlen(key);
  * if (clear_table(table, key, key_size)) {
- *     // Value associated with the key successfully cleared.
+ *     // Key-value pair successfully removed.
  * } else {
- *     // Error: Failed to clear value associated with the key.
+ *     // The key was not in the table.
  * }
  * @endcode
  */
-bool get_table(KVTable *table, void *key, size_t size, void **result);
+bool clear_table(KVTable *table, void *key, size_t size);
 
 
 /**
  * Retrieves the value associated with the specified key from the key-value table.
  *
- * This function retrieves the value associated with the specified key from the key-value table.
- * It computes the hash value of the key to determine the index in the table's storage array
- * where the key-value pair is expected to be stored.
- *
  * @param table A pointer to the KVTable structure representing the key-value table.
  * @param key A pointer to the key data.
  * @param size The size of the key data in bytes.
@@ -171,11 +210,11 @@ bool get_table(KVTable *table, void *key, size_t size, void **result);
  * @return true if the value associated with the key is successfully retrieved, otherwise false.
  *
  * The function performs the following steps:
- * 1. Computes the hash value of the key and calculates the initial index in the table's storage array.
- * 2. Checks if the key-value pair at the computed index matches the specified key.
- *    If it matches, retrieves the value associated with the key and stores it in the result pointer.
- * 3. Returns true if the value associated with the key is found and retrieved successfully.
- *    Returns false if the key is not found or if the table slot is empty.
+ * 1. Moves the next slots of a running rehash into the current storage.
+ * 2. Probes the current storage, then the previous one, from the slot the hash of the key points to,
+ *    stopping at an empty slot or at a pair closer to its own slot than the key would be.
+ * 3. Stores the value in the result pointer and returns true if the key is found,
+ *    otherwise stores NULL and returns false.
  *
  * Example usage:
  * @code
@@ -190,19 +229,50 @@ bool get_table(KVTable *table, void *key, size_t size, void **result);
  * }
  * @endcode
  */
-bool clear_table(KVTable *table, void *key, size_t size);
+bool get_table(KVTable *table, void *key, size_t size, void **result);
+
+
+/**
+ * Returns the number of key-value pairs in the key-value table.
+ *
+ * @param table A pointer to the KVTable structure representing the key-value table.
+ *
+ * @return The number of live key-value pairs in both storages of the table.
+ */
+size_t count_table(KVTable *table);
 
 
 /**
- * Frees the memory allocated for the key-value table and its storage array.
+ * Iterates over the values of the key-value table.
+ *
+ * The table must not be modified while it is iterated over.
+ *
+ * @param table A pointer to the KVTable structure representing the key-value table.
+ * @param cursor A pointer to the position of the iteration, set to 0 before the first call.
+ * @param result A pointer to a pointer where the next value will be stored.
+ *
+ * @return true if a value is stored in the result pointer, false once every pair has been visited.
  *
- * This function frees the memory allocated for the key-value table structure
- * and the underlying storage array of key-value pairs.
+ * Example usage:
+ * @code
+ * KVTable *table;
+ * size_t cursor = 0;
+ * void *value;
+ * while (iterate_table(table, &cursor, &value)) {
+ *     // Use the value.
+ * }
+ * @endcode
+ */
+bool iterate_table(KVTable *table, size_t *cursor, void **result);
+
+
+/**
+ * Frees the memory allocated for the key-value table and its storage arrays.
  *
  * @param table A pointer to the KVTable structure representing the key-value table.
  *
  * The function performs the following steps:
- * 1. Frees the memory allocated for the storage array.
+ * 1. Frees the memory allocated for the storage arrays.
  * 2. Frees the memory allocated for the KVTable structure.
  *
  * Example usage:
@@ -0,0 +1,306 @@
+#include "journal.h"
+
+
+static size_t length_journal(u_int32_t size) {
+    return (sizeof(JournalRecord) + size + 7) & ~(size_t) 7;
+}
+
+static u_int32_t check_journal(u_int64_t sequence, char *data, u_int32_t size) {
+    return (u_int32_t) hash_integer(hash((u_int8_t *) data, size) ^ sequence);
+}
+
+// Returns the length of the record with the sequence at the position, or 0 if it is missing or torn
+static size_t record_journal(char *segment, size_t limit, size_t position, u_int64_t sequence) {
+    if (position + sizeof(JournalRecord) > limit) return 0;
+
+    JournalRecord *record = (JournalRecord *) (segment + position);
+    if (record->sequence != sequence || record->size > MESSAGE_SIZE - 1) return 0;
+    size_t length = length_journal(record->size);
+    if (position + length > limit) return 0;
+    if (record->check != check_journal(sequence, segment + position + sizeof(JournalRecord), record->size)) return 0;
+    return length;
+}
+
+// Writes the bytes of the segment from the synced ones up to the end to disk, blocking until they are
+static bool flush_journal(char *segment, size_t synced, size_t end) {
+    if (segment == NULL || synced >= end) return true;
+
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t start = synced / page_size * page_size;
+    return msync(segment + start, end - start, MS_SYNC) == 0;
+}
+
+// Syncs the committed messages whenever the main thread commits a batch, every batch committed
+// while a sync runs is written by the next one
+static void *run_journal(void *args) {
+    Journal *journal = args;
+
+    pthread_mutex_lock(&journal->lock);
+    while (true) {
+        while (journal->committed == journal->synced && !journal->stopping) {
+            pthread_cond_wait(&journal->wake, &journal->lock);
+        }
+        if (journal->committed == journal->synced) break;
+
+        char *segment = journal->segment;
+        size_t synced = journal->synced;
+        size_t end = journal->committed;
+        journal->syncing = true;
+        pthread_mutex_unlock(&journal->lock);
+
+        bool flushed = flush_journal(segment, synced, end);
+        if (!flushed) printf("Cannot sync journal\n");
+
+        pthread_mutex_lock(&journal->lock);
+        journal->syncing = false;
+        // A failed range is tried again with the next commit
+        if (flushed) journal->synced = end;
+        else journal->committed = journal->synced;
+        pthread_cond_broadcast(&journal->idle);
+    }
+    pthread_mutex_unlock(&journal->lock);
+    return NULL;
+}
+
+static void path_journal(Journal *journal, u_int64_t first, char *path) {
+    snprintf(path, PATH_MAX, "%s/%020lu%s", journal->directory, first, JOURNAL_SEGMENT_EXTENSION);
+}
+
+static int filter_journal(const struct dirent *entry) {
+    size_t length = strlen(entry->d_name);
+    size_t extension = strlen(JOURNAL_SEGMENT_EXTENSION);
+    return length > extension && strcmp(entry->d_name + length - extension, JOURNAL_SEGMENT_EXTENSION) == 0;
+}
+
+static bool add_segment_journal(Journal *journal, u_int64_t first) {
+    if (journal->segment_count == journal->segment_capacity) {
+        size_t capacity = journal->segment_capacity > 0 ? journal->segment_capacity * 2 : JOURNAL_MAX_SEGMENTS;
+        u_int64_t *segments = realloc(journal->segments, capacity * sizeof(u_int64_t));
+        if (segments == NULL) return false;
+        journal->segments = segments;
+        journal->segment_capacity = capacity;
+    }
+    journal->segments[journal->segment_count++] = first;
+    return true;
+}
+
+static bool open_segment_journal(Journal *journal, u_int64_t first) {
+    char path[PATH_MAX];
+    path_journal(journal, first, path);
+
+    int descriptor = open(path, O_RDWR | O_CREAT, JOURNAL_PERMISSIONS);
+    if (descriptor < 0) return false;
+    // Blocks are reserved up front, a full disk fails here rather than on a write to the mapping
+    if (posix_fallocate(descriptor, 0, JOURNAL_SEGMENT_SIZE) != 0) {
+        close(descriptor);
+        return false;
+    }
+    char *segment = mmap(NULL, JOURNAL_SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, descriptor, 0);
+    if (segment == MAP_FAILED) {
+        close(descriptor);
+        return false;
+    }
+
+    journal->descriptor = descriptor;
+    journal->segment = segment;
+    journal->size = 0;
+    journal->committed = 0;
+    journal->synced = 0;
+    return true;
+}
+
+// The sync thread must be done with the segment, it is only closed under the lock or once the thread is stopped
+static void close_segment_journal(Journal *journal) {
+    if (journal->segment == NULL) return;
+    if (!flush_journal(journal->segment, journal->synced, journal->size)) printf("Cannot sync journal\n");
+    munmap(journal->segment, JOURNAL_SEGMENT_SIZE);
+    close(journal->descriptor);
+    journal->segment = NULL;
+    journal->descriptor = -1;
+}
+
+static bool rotate_journal(Journal *journal) {
+    close_segment_journal(journal);
+    if (!open_segment_journal(journal, journal->next)) return false;
+    if (journal->segments[journal->segment_count - 1] != journal->next
+        && !add_segment_journal(journal, journal->next)) {
+        close_segment_journal(journal);
+        return false;
+    }
+
+    // The entry of the new segment is written to disk with the directory
+    int directory = open(journal->directory, O_RDONLY | O_DIRECTORY);
+    if (directory >= 0) {
+        fsync(directory);
+        close(directory);
+    }
+
+    while (journal->segment_count > JOURNAL_MAX_SEGMENTS) {
+        char path[PATH_MAX];
+        path_journal(journal, journal->segments[0], path);
+        unlink(path);
+        memmove(journal->segments, journal->segments + 1, --journal->segment_count * sizeof(u_int64_t));
+    }
+    return true;
+}
+
+Journal *init_journal(const char *directory) {
+    if (mkdir(directory, JOURNAL_DIRECTORY_PERMISSIONS) < 0 && errno != EEXIST) return NULL;
+
+    Journal *journal = calloc(1, sizeof(Journal));
+    if (journal == NULL) return NULL;
+    journal->descriptor = -1;
+    pthread_mutex_init(&journal->lock, NULL);
+    pthread_cond_init(&journal->wake, NULL);
+    pthread_cond_init(&journal->idle, NULL);
+    journal->directory = strdup(directory);
+    if (journal->directory == NULL) {
+        free(journal);
+        return NULL;
+    }
+
+    struct dirent **entries;
+    int count = scandir(directory, &entries, filter_journal, alphasort);
+    if (count < 0) {
+        free_journal(journal);
+        return NULL;
+    }
+    bool listed = true;
+    for (int i = 0; i < count; ++i) {
+        // Names are zero padded, so they sort in the order of their sequences
+        if (listed) listed = add_segment_journal(journal, strtoull(entries[i]->d_name, NULL, 10));
+        free(entries[i]);
+    }
+    free(entries);
+    if (!listed || (journal->segment_count == 0 && !add_segment_journal(journal, 0))) {
+        free_journal(journal);
+        return NULL;
+    }
+
+    u_int64_t sequence = journal->segments[journal->segment_count - 1];
+    if (!open_segment_journal(journal, sequence)) {
+        free_journal(journal);
+        return NULL;
+    }
+    size_t position = 0;
+    size_t length;
+    while ((length = record_journal(journal->segment, JOURNAL_SEGMENT_SIZE, position, sequence)) > 0) {
+        position += length;
+        ++sequence;
+    }
+    journal->size = position;
+    journal->committed = position;
+    journal->synced = position;
+    journal->next = sequence;
+
+    if (pthread_create(&journal->thread, NULL, run_journal, journal) != 0) {
+        free_journal(journal);
+        return NULL;
+    }
+    journal->running = true;
+    return journal;
+}
+
+bool append_journal(Journal *journal, char *data, size_t size) {
+    if (size > MESSAGE_SIZE - 1) size = MESSAGE_SIZE - 1;
+
+    size_t length = length_journal(size);
+    if (journal->segment == NULL || journal->size + length > JOURNAL_SEGMENT_SIZE) {
+        // The sync thread is done with the segment before it is unmapped, which happens once per segment
+        pthread_mutex_lock(&journal->lock);
+        while (journal->syncing) pthread_cond_wait(&journal->idle, &journal->lock);
+        bool rotated = rotate_journal(journal);
+        pthread_mutex_unlock(&journal->lock);
+        if (!rotated) return false;
+    }
+
+    JournalRecord *record = (JournalRecord *) (journal->segment + journal->size);
+    memcpy(journal->segment + journal->size + sizeof(JournalRecord), data, size);
+    record->sequence = journal->next;
+    record->size = size;
+    record->check = check_journal(journal->next, data, size);
+
+    journal->size += length;
+    ++journal->next;
+    return true;
+}
+
+void commit_journal(Journal *journal) {
+    pthread_mutex_lock(&journal->lock);
+    journal->committed = journal->size;
+    pthread_cond_signal(&journal->wake);
+    pthread_mutex_unlock(&journal->lock);
+}
+
+size_t restore_journal(Journal *journal, RecentMessages *recent_messages) {
+    u_int64_t start = journal->segments[0];
+    if (journal->next - start > recent_messages->size) start = journal->next - recent_messages->size;
+
+    size_t index = journal->segment_count - 1;
+    while (index > 0 && journal->segments[index] > start) --index;
+    // Restored messages keep their sequence numbers
+    seek_recent_messages(recent_messages, start);
+
+    size_t restored = 0;
+    for (; index < journal->segment_count; ++index) {
+        u_int64_t sequence = journal->segments[index];
+        char *segment = journal->segment;
+        size_t limit = journal->size;
+        int descriptor = -1;
+
+        // Segments written before the last one are only read
+        if (index < journal->segment_count - 1) {
+            char path[PATH_MAX];
+            struct stat status;
+            path_journal(journal, sequence, path);
+            descriptor = open(path, O_RDONLY);
+            if (descriptor < 0) continue;
+            if (fstat(descriptor, &status) < 0 || status.st_size == 0) {
+                close(descriptor);
+                continue;
+            }
+            limit = status.st_size;
+            segment = mmap(NULL, limit, PROT_READ, MAP_PRIVATE, descriptor, 0);
+            if (segment == MAP_FAILED) {
+                close(descriptor);
+                continue;
+            }
+        }
+        if (segment == NULL) continue;
+
+        size_t position = 0;
+        size_t length;
+        while ((length = record_journal(segment, limit, position, sequence)) > 0) {
+            if (sequence >= start) {
+                JournalRecord *record = (JournalRecord *) (segment + position);
+                add_recent_messages(recent_messages, segment + position + sizeof(JournalRecord), record->size);
+                ++restored;
+            }
+            position += length;
+            ++sequence;
+        }
+
+        if (descriptor >= 0) {
+            munmap(segment, limit);
+            close(descriptor);
+        }
+    }
+    return restored;
+}
+
+void free_journal(Journal *journal) {
+    if (journal->running) {
+        pthread_mutex_lock(&journal->lock);
+        journal->stopping = true;
+        pthread_cond_signal(&journal->wake);
+        pthread_mutex_unlock(&journal->lock);
+        pthread_join(journal->thread, NULL);
+    }
+    close_segment_journal(journal);
+    pthread_cond_destroy(&journal->idle);
+    pthread_cond_destroy(&journal->wake);
+    pthread_mutex_destroy(&journal->lock);
+    free(journal->segments);
+    free(journal->directory);
+    free(journal);
+}
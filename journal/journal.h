@@ -0,0 +1,208 @@
+#ifndef SERVER_JOURNAL_H
+#define SERVER_JOURNAL_H
+
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "../circular_buffer/recent_messages.h"
+#include "../hash_table/hash.h"
+#include "../definitions.h"
+
+
+/**
+ * Structure representing the header of a record in a journal segment.
+ *
+ * Every record is followed by its message and padded to a multiple of 8 bytes.
+ * The rest of a segment is zero filled, the first record failing the check ends the segment.
+ *
+ * The structure fields are defined as follows:
+ *  - sequence: The sequence number of the message, one more than the sequence of the previous record.
+ *  - size: The size of the message in bytes.
+ *  - check: The hash of the message mixed with its sequence, detecting records torn by a crash.
+ */
+typedef struct {
+    u_int64_t sequence;
+    u_int32_t size;
+    u_int32_t check;
+} JournalRecord;
+
+
+/**
+ * Structure representing an append-only journal of messages.
+ *
+ * The journal is a directory of segment files of JOURNAL_SEGMENT_SIZE bytes, each named after the sequence
+ * of its first record, so the names make the index locating a sequence without reading the segments.
+ * The last segment is mapped into memory and appended to with plain copies. Once per batch of messages,
+ * commit_journal hands the appended bytes to a thread of the journal, which writes the dirty pages to disk
+ * while the main thread goes on with the next batch, so broadcasts never wait on the disk. Batches committed
+ * while a sync runs are written together by the next one. Only the last JOURNAL_MAX_SEGMENTS segments are kept.
+ *
+ * The structure fields are defined as follows:
+ *  - directory: The path of the directory holding the segments.
+ *  - segments: The sorted array of the first sequences of the segments on disk, the last one is being written.
+ *  - segment_count: The number of segments on disk.
+ *  - segment_capacity: The number of entries allocated in the segments array.
+ *  - descriptor: The file descriptor of the segment being written.
+ *  - segment: The mapping of the segment being written.
+ *  - size: The number of bytes of records in the segment being written.
+ *  - committed: The number of bytes of the segment being written handed to the sync thread.
+ *  - synced: The number of bytes of the segment being written known to be on disk.
+ *  - next: The sequence of the next record.
+ *  - thread: The thread writing the committed bytes to disk.
+ *  - lock: The mutex protecting the segment, the committed and synced sizes and the flags of the sync thread.
+ *  - wake: The condition the sync thread waits on for bytes to be committed.
+ *  - idle: The condition signaled when the sync thread leaves the segment, a segment is only closed once it has.
+ *  - syncing: Whether the sync thread is writing the segment to disk without the lock.
+ *  - running: Whether the sync thread has been started.
+ *  - stopping: Whether the sync thread has been asked to exit once the committed bytes are written.
+ *
+ * Example usage:
+ * @code
+ * Journal *journal = init_journal("/var/lib/c_server");
+ * append_journal(journal, "Hello\n", 6);
+ * commit_journal(journal);
+ * @endcode
+ */
+typedef struct {
+    char *directory;
+    u_int64_t *segments;
+    size_t segment_count;
+    size_t segment_capacity;
+    int descriptor;
+    char *segment;
+    size_t size;
+    size_t committed;
+    size_t synced;
+    u_int64_t next;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t idle;
+    bool syncing;
+    bool running;
+    bool stopping;
+} Journal;
+
+
+/**
+ * Opens the journal stored in the specified directory, creating both if they do not exist.
+ *
+ * @param directory The path of the directory holding the segments.
+ *
+ * @return A pointer to the opened journal, or NULL if the directory or the segment cannot be opened,
+ * memory allocation fails or the sync thread cannot be started.
+ *
+ * The function performs the following steps:
+ * 1. Creates the directory if it does not exist and lists the segments in it.
+ * 2. Maps the last segment, or a new one starting at sequence 0 if there is none.
+ * 3. Walks the record headers of the last segment to find its end, stopping at the first record
+ *    that is not fully written, so the records after a crash are appended over a torn one.
+ * 4. Starts the sync thread.
+ *
+ * Example usage:
+ * @code
+ * Journal *journal = init_journal("/var/lib/c_server");
+ * if (journal == NULL) {
+ *     // Error: Failed to open the journal.
+ * }
+ * @endcode
+ */
+Journal *init_journal(const char *directory);
+
+
+/**
+ * Appends a message to the journal.
+ *
+ * The message is copied into the mapped segment, it is on disk only once it is committed with commit_journal
+ * and the sync thread has written it.
+ * Messages longer than MESSAGE_SIZE - 1 bytes are truncated like in the buffer of recent messages.
+ *
+ * @param journal A pointer to the Journal structure.
+ * @param data A pointer to the message.
+ * @param size The size of the message in bytes.
+ *
+ * @return true if the message is appended, false if a new segment cannot be opened.
+ *
+ * The function performs the following steps:
+ * 1. If the record does not fit in the segment, waits for the sync thread to leave it, syncs and closes it,
+ *    opens a new segment named after the next sequence and removes the oldest segments past JOURNAL_MAX_SEGMENTS.
+ * 2. Copies the message and its header at the end of the segment.
+ *
+ * Example usage:
+ * @code
+ * if (!append_journal(journal, message, strlen(message))) {
+ *     // Error: Failed to append the message.
+ * }
+ * @endcode
+ */
+bool append_journal(Journal *journal, char *data, size_t size);
+
+
+/**
+ * Hands the messages appended since the last call to the sync thread, without waiting for the disk.
+ *
+ * Called once per batch of messages, so a single flush commits every message of the batch. The sync thread
+ * writes them with msync and prints an error if it fails, the failed bytes are written again with the next commit.
+ *
+ * @param journal A pointer to the Journal structure.
+ *
+ * Example usage:
+ * @code
+ * for (size_t i = 0; i < count; ++i) append_journal(journal, messages[i], sizes[i]);
+ * commit_journal(journal);
+ * @endcode
+ */
+void commit_journal(Journal *journal);
+
+
+/**
+ * Fills a buffer of recent messages with the newest messages of the journal.
+ *
+ * @param journal A pointer to the Journal structure.
+ * @param recent_messages A pointer to the RecentMessages buffer, expected to be empty.
+ *
+ * @return The number of messages added to the buffer.
+ *
+ * The function performs the following steps:
+ * 1. Computes the sequence of the oldest message fitting in the buffer and finds the segment holding it
+ *    from the segment names.
+ * 2. Maps that segment and the following ones, hopping over record headers up to that sequence.
+ * 3. Sets the index of the next message of the buffer to that sequence and adds every message from there
+ *    straight from the mapped segments, so the messages keep their sequence numbers.
+ *
+ * Example usage:
+ * @code
+ * RecentMessages *recent_messages = init_recent_messages(RECENT_MESSAGES_SIZE);
+ * size_t restored = restore_journal(journal, recent_messages);
+ * @endcode
+ */
+size_t restore_journal(Journal *journal, RecentMessages *recent_messages);
+
+
+/**
+ * Stops the sync thread, writes the pending messages to disk and frees the memory allocated for the journal.
+ *
+ * @param journal A pointer to the Journal structure.
+ *
+ * Example usage:
+ * @code
+ * Journal *journal = init_journal("/var/lib/c_server");
+ * // Use the journal...
+ * free_journal(journal);
+ * @endcode
+ */
+void free_journal(Journal *journal);
+
+
+#endif //SERVER_JOURNAL_H
@@ -10,30 +10,34 @@ void *listen_connections(void *args) {
         return NULL;
     }
     Connection *server_connection = malloc(sizeof(Connection));
+    if (server_connection == NULL) {
+        printf("Cannot allocate listening connection\n");
+        close_queue(queue);
+        free(args);
+        return NULL;
+    }
     ServerContext *context = t_args->context;
+    Reactor *reactor = NULL;
     QMessage message;
 
-    if (bind_connection(PORT, server_connection) != true) NULL;
-    populate_message(&message, Q_MESSAGE_START_LISTENING, NULL, NULL);
-    send_queue(queue, &message);
-
-    while (listen_on_connection(server_connection)) {
-        pthread_t thread_id;
-        Connection *client_connection = malloc(sizeof(Connection));
-        if (!accept_connection(server_connection, client_connection)) break;
-
-        HandlerArgs *handler_args = malloc(sizeof(HandlerArgs));
-        if(handler_args == NULL) break;
-        handler_args->client_connection = client_connection;
-        handler_args->context = context;
-
-        pthread_create(&thread_id, NULL, handle_connection, (void *) handler_args);
+    if (bind_connection(PORT, server_connection)) {
+        if (listen_on_connection(server_connection) && set_nonblocking_connection(server_connection)) {
+            reactor = init_reactor(server_connection, context, queue, t_args->shard);
+        }
+        if (reactor != NULL) {
+            populate_message(&message, Q_MESSAGE_START_LISTENING, NULL, NULL, 0, NULL);
+            send_queue(queue, &message);
+
+            run_reactor(reactor);
+            free_reactor(reactor);
+        }
+        close_connection(server_connection);
     }
 
-    populate_message(&message, Q_MESSAGE_STOP_LISTENING, NULL, NULL);
+    populate_message(&message, Q_MESSAGE_STOP_LISTENING, NULL, NULL, 0, NULL);
     send_queue(queue, &message);
 
-    free(queue);
+    close_queue(queue);
     free(args);
     free(server_connection);
     return NULL;
@@ -8,6 +8,7 @@
 #include "../connection/connection.h"
 #include "../queue/queue.h"
 #include "../handler/handler.h"
+#include "../reactor/reactor.h"
 #include "../server/context.h"
 #include "../definitions.h"
 
@@ -16,29 +17,34 @@
  * Structure representing arguments for a listener thread.
  *
  * This structure represents the arguments passed to a listener thread.
- * It contains a pointer to the server context associated with the listener.
+ * It contains a pointer to the server context associated with the listener and the shard it runs.
  *
  * The structure fields are defined as follows:
  *  - context: A pointer to the server context structure containing context information for the listener.
+ *  - shard: A pointer to the statistics of the listener shard run by the thread.
  *
  * Example usage:
  * @code
  * ListenerArgs args;
  * args.context = server_ctx;
+ * args.shard = &server_ctx->shards[0];
  * pthread_create(&thread_id, NULL, listen_connections, (void*)&args);
  * @endcode
  */
 typedef struct {
     ServerContext *context;
+    Shard *shard;
 } ListenerArgs;
 
 
 /**
- * Listens for incoming connections and handles them in separate threads.
+ * Listens for incoming connections and handles them in an event loop.
  *
- * This function listens for incoming connections on the specified port and handles each connection
- * in a separate thread. It communicates with the main server thread using a message queue to send
- * notifications about the start and stop of the listening process.
+ * This function listens for incoming connections on the specified port and runs a reactor that accepts
+ * and reads from every connection on the calling thread. Every listener shard binds its own listening socket
+ * to the port with SO_REUSEPORT, so the kernel spreads incoming connections across the shards, and publishes
+ * what its clients send to the shared message queue, from which the main server thread broadcasts to all shards. It communicates with the main server thread
+ * using a message queue to send notifications about the start and stop of the listening process.
  *
  * @param args A pointer to a structure containing arguments for the listener function.
  *             It must be of type ListenerArgs, containing the server context.
@@ -47,16 +53,18 @@ typedef struct {
  *
  * The function performs the following steps:
  * 1. Initializes a message queue for communication with the main server thread.
- * 2. Creates a server connection and binds it to the specified port.
- * 3. Sends a start listening message to the main server thread via the message queue.
- * 4. Enters a loop to listen for incoming connections and handle each connection in a separate thread.
- * 5. Sends a stop listening message to the main server thread via the message queue when listening ends.
- * 6. Frees memory allocated for the message queue, arguments structure, and server connection.
+ * 2. Creates a non-blocking server connection, binds it to the specified port and starts listening.
+ * 3. Initializes a reactor owning the server connection.
+ * 4. Sends a start listening message to the main server thread via the message queue.
+ * 5. Runs the reactor, accepting and handling connections until the event loop fails.
+ * 6. Sends a stop listening message to the main server thread via the message queue when listening ends.
+ * 7. Frees memory allocated for the message queue, arguments structure, and server connection.
  *
  * Example usage:
  * @code
  * ListenerArgs *args = (ListenerArgs*)malloc(sizeof(ListenerArgs));
  * args->context = &server_context;
+ * args->shard = &server_context.shards[0];
  * pthread_create(&thread_id, NULL, listen_connections, (void*)args);
  * @endcode
  */
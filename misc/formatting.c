@@ -1,36 +1,362 @@
 #include "formatting.h"
 
 
+// The characters of MESSAGE_ALLOWED_SYMBOLS, indexed by their value
+static const u_int8_t allowed_symbols[256] = {
+        ['A' ... 'Z'] = 1, ['a' ... 'z'] = 1, ['0' ... '9'] = 1,
+        ['('] = 1, [')'] = 1, ['?'] = 1, ['!'] = 1, [','] = 1, [';'] = 1, [':'] = 1, ['&'] = 1,
+        ['*'] = 1, ['+'] = 1, ['@'] = 1, ['$'] = 1, ['%'] = 1, ['^'] = 1, ['/'] = 1, ['>'] = 1,
+        ['<'] = 1, ['\''] = 1, ['.'] = 1, ['-'] = 1, ['_'] = 1, ['\r'] = 1, ['\n'] = 1, [' '] = 1,
+};
+
 bool is_allowed_char(char c) {
-    return strchr(MESSAGE_ALLOWED_SYMBOLS, c) != NULL;
+    return allowed_symbols[(u_int8_t) c];
+}
+
+static size_t sanitize_table(char *buffer, size_t index, size_t size, size_t position) {
+    for (; index < size; ++index) {
+        buffer[position] = buffer[index];
+        position += allowed_symbols[(u_int8_t) buffer[index]];
+    }
+    return position;
 }
 
-bool sanitize_buffer(char *buffer, size_t size) {
-    bool valid = true;
-    size_t p = 0;
+#ifdef FORMATTING_SIMD
+// Allowed characters are printable up to 'z', except for the excluded ones, or line breaks
+#define FORMATTING_ALLOWED(prefix, bits, v) \
+    prefix##_or_si##bits( \
+        prefix##_andnot_si##bits( \
+            prefix##_or_si##bits( \
+                prefix##_or_si##bits( \
+                    prefix##_or_si##bits( \
+                        prefix##_cmpeq_epi8(v, prefix##_set1_epi8('"')), \
+                        prefix##_cmpeq_epi8(v, prefix##_set1_epi8('#'))), \
+                    prefix##_or_si##bits( \
+                        prefix##_cmpeq_epi8(v, prefix##_set1_epi8('=')), \
+                        prefix##_cmpeq_epi8(v, prefix##_set1_epi8('`')))), \
+                prefix##_or_si##bits( \
+                    prefix##_or_si##bits( \
+                        prefix##_cmpeq_epi8(v, prefix##_set1_epi8('[')), \
+                        prefix##_cmpeq_epi8(v, prefix##_set1_epi8('\\'))), \
+                    prefix##_cmpeq_epi8(v, prefix##_set1_epi8(']')))), \
+            prefix##_and_si##bits( \
+                prefix##_cmpgt_epi8(v, prefix##_set1_epi8(' ' - 1)), \
+                prefix##_cmpgt_epi8(prefix##_set1_epi8('z' + 1), v))), \
+        prefix##_or_si##bits( \
+            prefix##_cmpeq_epi8(v, prefix##_set1_epi8('\r')), \
+            prefix##_cmpeq_epi8(v, prefix##_set1_epi8('\n'))))
+
+static size_t sanitize_sse2(char *buffer, size_t index, size_t size, size_t position) {
+    for (; index + 16 <= size; index += 16) {
+        __m128i block = _mm_loadu_si128((__m128i *) (buffer + index));
+        // Blocks without disallowed characters are moved as a whole, the others byte by byte
+        if (_mm_movemask_epi8(FORMATTING_ALLOWED(_mm, 128, block)) != 0xffff) {
+            position = sanitize_table(buffer, index, index + 16, position);
+            continue;
+        }
+        _mm_storeu_si128((__m128i *) (buffer + position), block);
+        position += 16;
+    }
+    return sanitize_table(buffer, index, size, position);
+}
 
-    for (size_t i = 0; i < size; ++i) {
-        if (is_allowed_char(buffer[i])) buffer[p++] = buffer[i];
-        else valid = false;
+__attribute__((target("avx2")))
+static size_t sanitize_avx2(char *buffer, size_t index, size_t size, size_t position) {
+    for (; index + 32 <= size; index += 32) {
+        __m256i block = _mm256_loadu_si256((__m256i *) (buffer + index));
+        if ((u_int32_t) _mm256_movemask_epi8(FORMATTING_ALLOWED(_mm256, 256, block)) != 0xffffffff) {
+            position = sanitize_table(buffer, index, index + 32, position);
+            continue;
+        }
+        _mm256_storeu_si256((__m256i *) (buffer + position), block);
+        position += 32;
     }
-    memset(buffer + p, '\0', size - p);
+    return sanitize_sse2(buffer, index, size, position);
+}
+#endif
 
-    return valid;
+size_t sanitize_buffer(char *buffer, size_t size) {
+#ifdef FORMATTING_SIMD
+    if (__builtin_cpu_supports("avx2")) return sanitize_avx2(buffer, 0, size, 0);
+    return sanitize_sse2(buffer, 0, size, 0);
+#else
+    return sanitize_table(buffer, 0, size, 0);
+#endif
 }
 
-void format_message(char *result, char *message, Connection *connection, MessageType type) {
+// Returns the length of the allowed character starting at the index, 0 if it is invalid or not allowed
+static size_t sequence_utf8(const u_int8_t *data, size_t index, size_t size) {
+    u_int8_t lead = data[index];
+    u_int8_t low = 0x80;
+    u_int8_t high = 0xbf;
+    size_t length;
+
+    if (lead < 0x80) return allowed_symbols[lead];
+    // C1 control characters are encoded from 0xc2 0x80 to 0xc2 0x9f
+    if (lead == 0xc2) low = 0xa0;
+    if (lead >= 0xc2 && lead <= 0xdf) length = 2;
+    else if (lead >= 0xe0 && lead <= 0xef) length = 3;
+    else if (lead >= 0xf0 && lead <= 0xf4) length = 4;
+    else return 0;
+    // Overlong forms, surrogates and code points past U+10FFFF
+    if (lead == 0xe0) low = 0xa0;
+    if (lead == 0xed) high = 0x9f;
+    if (lead == 0xf0) low = 0x90;
+    if (lead == 0xf4) high = 0x8f;
+
+    if (index + length > size || data[index + 1] < low || data[index + 1] > high) return 0;
+    for (size_t i = 2; i < length; ++i) {
+        if ((data[index + i] & 0xc0) != 0x80) return 0;
+    }
+    return length;
+}
+
+static size_t sanitize_utf8_table(char *buffer, size_t index, size_t size, size_t position) {
+    while (index < size) {
+        size_t length = sequence_utf8((u_int8_t *) buffer, index, size);
+        // Bytes of invalid sequences are dropped one by one, the rest of the sequence is checked again
+        if (length == 0) {
+            ++index;
+            continue;
+        }
+        memmove(buffer + position, buffer + index, length);
+        position += length;
+        index += length;
+    }
+    return position;
+}
+
+#ifdef FORMATTING_SIMD
+// Bytes of the previous block and the block, shifted by the specified count
+#define FORMATTING_PREVIOUS(block, previous, count) \
+    _mm256_alignr_epi8(block, _mm256_permute2x128_si256(previous, block, 0x21), 16 - (count))
+
+// Classes of errors of the lookup validator by Keiser and Lemire, checked with the last two bytes
+#define UTF8_TOO_SHORT (1 << 0)
+#define UTF8_TOO_LONG (1 << 1)
+#define UTF8_OVERLONG_3 (1 << 2)
+#define UTF8_TOO_LARGE (1 << 3)
+#define UTF8_SURROGATE (1 << 4)
+#define UTF8_OVERLONG_2 (1 << 5)
+#define UTF8_TOO_LARGE_1000 (1 << 6)
+#define UTF8_OVERLONG_4 (1 << 6)
+#define UTF8_TWO_CONTINUATIONS (1 << 7)
+#define UTF8_CARRY (UTF8_TOO_SHORT | UTF8_TOO_LONG | UTF8_TWO_CONTINUATIONS)
+#define UTF8_LARGE (UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000)
+#define UTF8_CONTINUATION (UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTINUATIONS)
+#define UTF8_TABLE(...) _mm256_setr_epi8(__VA_ARGS__, __VA_ARGS__)
+
+__attribute__((target("avx2")))
+static __m256i errors_utf8(__m256i block, __m256i previous, __m256i high) {
+    const __m256i first_high = UTF8_TABLE(
+            UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+            UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+            UTF8_TWO_CONTINUATIONS, UTF8_TWO_CONTINUATIONS, UTF8_TWO_CONTINUATIONS, UTF8_TWO_CONTINUATIONS,
+            UTF8_TOO_SHORT | UTF8_OVERLONG_2,
+            UTF8_TOO_SHORT,
+            UTF8_TOO_SHORT | UTF8_OVERLONG_3 | UTF8_SURROGATE,
+            UTF8_TOO_SHORT | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4);
+    const __m256i first_low = UTF8_TABLE(
+            UTF8_CARRY | UTF8_OVERLONG_3 | UTF8_OVERLONG_2 | UTF8_OVERLONG_4,
+            UTF8_CARRY | UTF8_OVERLONG_2,
+            UTF8_CARRY, UTF8_CARRY,
+            UTF8_CARRY | UTF8_TOO_LARGE,
+            UTF8_LARGE, UTF8_LARGE, UTF8_LARGE, UTF8_LARGE, UTF8_LARGE, UTF8_LARGE, UTF8_LARGE, UTF8_LARGE,
+            UTF8_LARGE | UTF8_SURROGATE,
+            UTF8_LARGE, UTF8_LARGE);
+    const __m256i second_high = UTF8_TABLE(
+            UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+            UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+            UTF8_CONTINUATION | UTF8_OVERLONG_3 | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4,
+            UTF8_CONTINUATION | UTF8_OVERLONG_3 | UTF8_TOO_LARGE,
+            UTF8_CONTINUATION | UTF8_SURROGATE | UTF8_TOO_LARGE,
+            UTF8_CONTINUATION | UTF8_SURROGATE | UTF8_TOO_LARGE,
+            UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT);
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+
+    __m256i previous_1 = FORMATTING_PREVIOUS(block, previous, 1);
+    __m256i errors = _mm256_and_si256(
+            _mm256_and_si256(
+                    _mm256_shuffle_epi8(first_high, _mm256_and_si256(_mm256_srli_epi16(previous_1, 4), nibble)),
+                    _mm256_shuffle_epi8(first_low, _mm256_and_si256(previous_1, nibble))),
+            _mm256_shuffle_epi8(second_high, high));
+
+    // Third and fourth bytes of a sequence must be continuations, which the last two bytes cannot tell
+    __m256i third = _mm256_subs_epu8(FORMATTING_PREVIOUS(block, previous, 2), _mm256_set1_epi8((char) (0xe0 - 0x80)));
+    __m256i fourth = _mm256_subs_epu8(FORMATTING_PREVIOUS(block, previous, 3), _mm256_set1_epi8((char) (0xf0 - 0x80)));
+    __m256i continuations = _mm256_and_si256(_mm256_or_si256(third, fourth), _mm256_set1_epi8((char) 0x80));
+    // C1 control characters are valid but rejected with the errors, they are 0xc2 followed by 0x80 to 0x9f
+    __m256i controls = _mm256_and_si256(
+            _mm256_cmpeq_epi8(previous_1, _mm256_set1_epi8((char) 0xc2)),
+            _mm256_cmpgt_epi8(_mm256_set1_epi8((char) 0xa0), block));
+    return _mm256_or_si256(_mm256_xor_si256(continuations, errors), controls);
+}
+
+// Sanitizes the block at the index with the table, the previous block was moved as a whole and may end with a cut character
+static size_t sanitize_utf8_block(char *buffer, size_t index, size_t end, size_t size, size_t *position,
+                                  const u_int8_t *previous) {
+    u_int8_t chunk[3 + 32 + 3];
+    size_t back = 0;
+    size_t offset = 0;
+
+    // The start of the cut character is taken back from the kept bytes and checked with the block
+    for (size_t i = 1; i <= 3; ++i) {
+        u_int8_t byte = previous[32 - i];
+        if ((byte & 0xc0) == 0x80) continue;
+        if (byte >= 0xc0 && (byte >= 0xf0 ? 4 : byte >= 0xe0 ? 3 : 2) > i) back = i;
+        break;
+    }
+    // Characters starting in the block may end in the next one
+    size_t length = (end + 3 < size ? end + 3 : size) - index;
+    memcpy(chunk, previous + 32 - back, back);
+    memcpy(chunk + back, buffer + index, length);
+    *position -= back;
+
+    while (offset < back + end - index) {
+        // ASCII characters are kept without branches like in sanitize_table
+        if (chunk[offset] < 0x80) {
+            buffer[*position] = (char) chunk[offset];
+            *position += allowed_symbols[chunk[offset++]];
+            continue;
+        }
+        size_t sequence = sequence_utf8(chunk, offset, back + length);
+        if (sequence == 0) {
+            ++offset;
+            continue;
+        }
+        memcpy(buffer + *position, chunk + offset, sequence);
+        *position += sequence;
+        offset += sequence;
+    }
+    return index + offset - back;
+}
+
+__attribute__((target("avx2")))
+static size_t sanitize_utf8_avx2(char *buffer, size_t size) {
+    // Lead bytes in the last three bytes of a block start a character ending in the next one
+    const __m256i last = _mm256_setr_epi8(
+            -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+            -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+            (char) (0xf0 - 1), (char) (0xe0 - 1), (char) (0xc0 - 1));
+    // Allowed symbols as a bitmap of high nibbles for every low nibble, with fewer constants than the comparisons
+    const __m256i symbols_low = UTF8_TABLE(
+            (char) 0xbc, (char) 0xfc, (char) 0xf8, (char) 0xf8, (char) 0xfc, (char) 0xfc, (char) 0xfc, (char) 0xfc,
+            (char) 0xfc, (char) 0xfc, (char) 0xfd, 0x5c, 0x5c, 0x55, 0x7c, 0x7c);
+    const __m256i symbols_high = UTF8_TABLE(
+            0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, (char) 0x80, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    __m256i previous = _mm256_setzero_si256();
+    __m256i incomplete = _mm256_setzero_si256();
+    u_int8_t kept[32];
+    size_t index = 0;
+    size_t position = 0;
+
+    while (index + 32 <= size) {
+        // Blocks are checked in a loop of their own so that the constants stay in registers
+        while (index + 32 <= size) {
+            __m256i block = _mm256_loadu_si256((__m256i *) (buffer + index));
+            __m256i high = _mm256_and_si256(_mm256_srli_epi16(block, 4), nibble);
+            __m256i allowed = _mm256_and_si256(
+                    _mm256_shuffle_epi8(symbols_low, _mm256_and_si256(block, nibble)),
+                    _mm256_shuffle_epi8(symbols_high, high));
+            __m256i errors = incomplete;
+            bool ascii = _mm256_movemask_epi8(block) == 0;
+            if (!ascii) {
+                errors = errors_utf8(block, previous, high);
+                allowed = _mm256_or_si256(allowed, _mm256_cmpgt_epi8(_mm256_setzero_si256(), block));
+            }
+            // A byte is allowed if its bit is set or if it is not ASCII, which the validation is left to
+            if (!_mm256_testz_si256(errors, errors) ||
+                _mm256_movemask_epi8(_mm256_cmpeq_epi8(allowed, _mm256_setzero_si256())) != 0) {
+                if (!ascii || !_mm256_testz_si256(incomplete, incomplete)) break;
+                // Blocks of ASCII characters are sanitized here, without leaving the loop
+                for (size_t i = index; i < index + 32; ++i) {
+                    buffer[position] = buffer[i];
+                    position += allowed_symbols[(u_int8_t) buffer[i]];
+                }
+            } else {
+                _mm256_storeu_si256((__m256i *) (buffer + position), block);
+                position += 32;
+            }
+            incomplete = _mm256_subs_epu8(block, last);
+            index += 32;
+            previous = block;
+        }
+        if (index + 32 > size) break;
+
+        _mm256_storeu_si256((__m256i *) kept, previous);
+        index = sanitize_utf8_block(buffer, index, index + 32, size, &position, kept);
+        // The table stops at the end of a character, nothing is carried to the next block
+        previous = _mm256_setzero_si256();
+        incomplete = _mm256_setzero_si256();
+    }
+    _mm256_storeu_si256((__m256i *) kept, previous);
+    sanitize_utf8_block(buffer, index, size, size, &position, kept);
+    return position;
+}
+#endif
+
+size_t sanitize_utf8_buffer(char *buffer, size_t size) {
+#ifdef FORMATTING_SIMD
+    if (__builtin_cpu_supports("avx2")) return sanitize_utf8_avx2(buffer, size);
+#endif
+    return sanitize_utf8_table(buffer, 0, size, 0);
+}
+
+// Writes the sequence number in decimal between its marker and a space, as printf does with #%lu
+static size_t format_sequence(char *result, u_int64_t sequence) {
+    char digits[20];
+    size_t count = 0;
+
+    do {
+        digits[count++] = (char) ('0' + sequence % 10);
+        sequence /= 10;
+    } while (sequence != 0);
+    result[0] = MESSAGE_SEQUENCE_MARKER;
+    for (size_t i = 0; i < count; ++i) result[i + 1] = digits[count - 1 - i];
+    result[count + 1] = ' ';
+    return count + 2;
+}
+
+static size_t format_text(char *result, const char *text, size_t size) {
+    memcpy(result, text, size);
+    return size;
+}
+
+#define FORMATTING_TEXT(text) text, sizeof(text) - 1
+
+size_t format_message(char *result, char *message, size_t size, Connection *connection, MessageType type,
+                      u_int64_t sequence) {
+    size_t length = format_sequence(result, sequence);
+
+    if (type != MESSAGE_NOTICE) length += format_text(result + length, connection->prefix, connection->prefix_size);
     switch (type) {
         case MESSAGE_CONNECTED:
-            sprintf(result, "%lx connected!\n", connection->name);
+            length += format_text(result + length, FORMATTING_TEXT(" connected!\n"));
             break;
         case MESSAGE_DISCONNECTED:
-            sprintf(result, "%lx disconnected!\n", connection->name);
+            length += format_text(result + length, FORMATTING_TEXT(" disconnected!\n"));
             break;
         case MESSAGE_SENT:
-            sprintf(result, "%lx: %s", connection->name, message);
+            length += format_text(result + length, FORMATTING_TEXT(": "));
+            length += format_text(result + length, message, size);
             break;
         default:
-            sprintf(result, "%s", message);
+            length += format_text(result + length, message, size);
     }
-    if (message[strlen(result) - 1 != '\n']) result[strlen(result) - 1] = '\n';
+    if (result[length - 1] != '\n') result[length++] = '\n';
+    result[length] = '\0';
+    return length;
+}
+
+size_t format_resume_gap(char *result, u_int64_t sequence, u_int64_t first) {
+    size_t length = format_text(result, FORMATTING_TEXT("Cannot resume after "));
+
+    // The space after each sequence number is overwritten by the text following it
+    length += format_sequence(result + length, sequence) - 1;
+    length += format_text(result + length, FORMATTING_TEXT(", history starts at "));
+    length += format_sequence(result + length, first) - 1;
+    result[length++] = '\n';
+    result[length] = '\0';
+    return length;
 }
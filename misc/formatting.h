@@ -8,6 +8,10 @@
 #include <string.h>
 #include "../connection/connection.h"
 #include "../definitions.h"
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define FORMATTING_SIMD
+#endif
 
 
 /**
@@ -15,12 +19,13 @@
  *
  * This enum represents different types of messages that can be exchanged
  * within the messaging system. It includes types such as MESSAGE_CONNECTED,
- * MESSAGE_DISCONNECTED, and MESSAGE_SENT.
+ * MESSAGE_DISCONNECTED, MESSAGE_SENT and MESSAGE_NOTICE.
  *
  * The enum values are defined as follows:
  *  - MESSAGE_CONNECTED: Indicates a message indicating successful connection.
  *  - MESSAGE_DISCONNECTED: Indicates a message indicating disconnection.
  *  - MESSAGE_SENT: Indicates a message indicating successful transmission.
+ *  - MESSAGE_NOTICE: Indicates a message of the server itself, not related to any connection.
  *
  * Example usage:
  * @code
@@ -31,25 +36,20 @@ typedef enum {
     MESSAGE_CONNECTED,
     MESSAGE_DISCONNECTED,
     MESSAGE_SENT,
+    MESSAGE_NOTICE,
 } MessageType;
 
 
 /**
  * Checks if a character is allowed based on a predefined set of symbols.
  *
- * This function checks whether a given character is allowed based on a predefined set of symbols.
- * It searches for the character in the MESSAGE_ALLOWED_SYMBOLS string and returns true if found,
- * indicating that the character is allowed, and false otherwise.
+ * This function checks whether a given character is one of the MESSAGE_ALLOWED_SYMBOLS
+ * by looking it up in a 256 entry table built at compile time, so a check is a single load.
  *
  * @param c The character to be checked.
  *
  * @return true if the character is allowed, otherwise false.
  *
- * The function performs the following steps:
- * 1. Searches for the given character in the MESSAGE_ALLOWED_SYMBOLS string using strchr function.
- * 2. Returns true if the character is found in the allowed symbols string, indicating it's allowed.
- *    Returns false if the character is not found, indicating it's not allowed.
- *
  * Example usage:
  * @code
  * char character = '*';
@@ -67,33 +67,64 @@ bool is_allowed_char(char c);
  * Sanitizes a buffer by removing disallowed characters.
  *
  * This function sanitizes a buffer by removing any characters that are not allowed
- * based on a predefined set of symbols. It iterates through the buffer and retains
- * only the allowed characters, replacing disallowed characters with null terminators.
+ * based on a predefined set of symbols, moving the allowed ones to the start of the buffer.
+ * Only the specified number of bytes is read, the bytes past the returned size are left as they are.
+ * On x86-64, blocks of 32 bytes with AVX2 when the processor supports it, or 16 bytes with SSE2,
+ * are checked at once and moved as a whole if every character in them is allowed.
  *
  * @param buffer A pointer to the buffer to be sanitized.
- * @param size The size of the buffer in bytes.
+ * @param size The number of bytes in the buffer.
  *
- * @return true if the buffer contains only allowed characters after sanitization, otherwise false.
+ * @return The number of allowed characters kept at the start of the buffer.
  *
  * The function performs the following steps:
- * 1. Iterates through the buffer character by character.
- * 2. Checks if each character is allowed using the is_allowed_char function.
- * 3. Retains allowed characters and replaces disallowed characters with null terminators.
- * 4. Returns true if the buffer contains only allowed characters after sanitization,
- *    indicating successful sanitization. Returns false otherwise.
+ * 1. Chooses the widest vector instructions supported by the processor.
+ * 2. Checks every block of the buffer against the allowed symbols with vector comparisons.
+ * 3. Moves blocks of allowed characters after the characters kept so far,
+ *    and moves the characters of other blocks one by one using the table of allowed symbols.
+ * 4. Handles the bytes left after the last full block with the table.
  *
  * Example usage:
  * @code
  * char buffer[100] = "Hello$World!";
- * size_t buffer_size = strlen(buffer);
- * if (sanitize_buffer(buffer, buffer_size)) {
- *     // Buffer sanitized successfully.
- * } else {
- *     // Error: Buffer contains disallowed characters after sanitization.
- * }
+ * size_t size = sanitize_buffer(buffer, strlen(buffer));
+ * // buffer starts with "HelloWorld!", size is 11
  * @endcode
  */
-bool sanitize_buffer(char *buffer, size_t size);
+size_t sanitize_buffer(char *buffer, size_t size);
+
+
+/**
+ * Sanitizes a buffer of UTF-8 text by removing disallowed characters and invalid sequences.
+ *
+ * This function keeps the allowed symbols of sanitize_buffer and every valid UTF-8 sequence
+ * except the C1 control characters, moving them to the start of the buffer. Overlong forms,
+ * surrogates, code points past U+10FFFF, stray continuation bytes and sequences cut by the end
+ * of the buffer are removed byte by byte. Only the specified number of bytes is read,
+ * the bytes past the returned size are left as they are.
+ * On x86-64 processors supporting AVX2, blocks of 32 bytes are validated at once with the lookup
+ * algorithm by Keiser and Lemire, so a buffer with nothing to remove is not written to at all.
+ *
+ * @param buffer A pointer to the buffer to be sanitized.
+ * @param size The number of bytes in the buffer.
+ *
+ * @return The number of bytes kept at the start of the buffer.
+ *
+ * The function performs the following steps:
+ * 1. Validates every block of the buffer with vector lookups of the last bytes, skipping the lookups
+ *    for blocks of ASCII characters, and checks the block against the allowed symbols.
+ * 2. Returns the size of the buffer if every block is valid and allowed.
+ * 3. Otherwise decodes the characters one by one from the start of the character the first rejected block
+ *    begins in, moving the allowed ones after the characters kept so far.
+ *
+ * Example usage:
+ * @code
+ * char buffer[100] = "Привет\x07, мир!";
+ * size_t size = sanitize_utf8_buffer(buffer, strlen(buffer));
+ * // buffer starts with "Привет, мир!", size is 20
+ * @endcode
+ */
+size_t sanitize_utf8_buffer(char *buffer, size_t size);
 
 
 /**
@@ -101,31 +132,61 @@ bool sanitize_buffer(char *buffer, size_t size);
  *
  * This function formats a message based on the specified message type and connection information.
  * It generates different formats for different message types such as connected, disconnected,
- * message sent, and default message types. The formatted message is stored in the provided result buffer.
+ * message sent, and notice message types. The formatted message is stored in the provided result buffer.
+ * Nothing is allocated and no format string is parsed: the sequence number is written digit by digit,
+ * the name of the connection is copied from the prefix formatted when the connection was populated,
+ * and the message is copied with the specified size.
  *
  * @param result A pointer to the buffer where the formatted message will be stored.
  * @param message A pointer to the message content to be included in the formatted message.
- *                This parameter is used for MESSAGE_SENT type messages.
- * @param connection A pointer to the Connection structure containing connection information.
+ *                This parameter is used for MESSAGE_SENT and MESSAGE_NOTICE type messages.
+ * @param size The size of the message content in bytes.
+ * @param connection A pointer to the Connection structure containing connection information,
+ *                   it may be NULL for MESSAGE_NOTICE type messages.
  * @param type The type of the message to be formatted (MESSAGE_CONNECTED, MESSAGE_DISCONNECTED,
- *             MESSAGE_SENT, or default).
+ *             MESSAGE_SENT, or MESSAGE_NOTICE).
+ * @param sequence The sequence number of the message, written after MESSAGE_SEQUENCE_MARKER.
+ *
+ * @return The length of the formatted message in bytes, excluding the null terminator.
  *
  * The function performs the following steps:
- * 1. Formats the message based on the specified message type and connection information.
- * 2. Stores the formatted message in the provided result buffer.
- * 3. Appends a newline character at the end of the formatted message if it's not already present.
+ * 1. Writes the sequence number of the message after its marker.
+ * 2. Copies the prefix of the connection, then the text of the message type or the message content.
+ * 3. Appends a newline character at the end of the formatted message if it's not already present,
+ *    and a null terminator after it. The result buffer must be MESSAGE_SIZE bytes long
+ *    to fit the formatting, the newline and the null terminator.
  *
  * Example usage:
  * @code
- * char result[256];
+ * char result[MESSAGE_SIZE];
  * char message[] = "Hello, world!";
  * Connection *connection;
- * MessageType type = MESSAGE_SENT;
- * format_message(result, message, connection, type);
- * printf("%s", result); // Output: "<connection_name>: Hello, world!\n"
+ * size_t size = format_message(result, message, strlen(message), connection, MESSAGE_SENT, 42);
+ * write_connection(connection, result, size); // Sends "#42 <connection_name>: Hello, world!\n"
  * @endcode
  */
-void format_message(char *message, char *result, Connection *connection, MessageType type);
+size_t format_message(char *result, char *message, size_t size, Connection *connection, MessageType type,
+                      u_int64_t sequence);
 
 
+/**
+ * Formats the notice sent to a client resuming after a message the history no longer holds, or has not held yet.
+ *
+ * The notice is written like format_message writes messages, with the same sequence number writer.
+ *
+ * @param result A pointer to the buffer where the notice will be stored, MESSAGE_SIZE bytes long.
+ * @param sequence The sequence number the client asked to resume after.
+ * @param first The sequence number of the oldest message of the history, which the client gets next.
+ *
+ * @return The length of the notice in bytes, excluding the null terminator.
+ *
+ * Example usage:
+ * @code
+ * char result[MESSAGE_SIZE];
+ * size_t size = format_resume_gap(result, 41, 100); // "Cannot resume after #41, history starts at #100\n"
+ * write_connection(connection, result, size);
+ * @endcode
+ */
+size_t format_resume_gap(char *result, u_int64_t sequence, u_int64_t first);
+
 #endif //SERVER_FORMATTING_H
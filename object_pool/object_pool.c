@@ -0,0 +1,146 @@
+#include "object_pool.h"
+
+
+static u_int32_t object_pool_count = 0;
+static __thread ObjectCache object_caches[OBJECT_POOL_LIMIT];
+
+
+ObjectPool *init_object_pool(const char *name, size_t size) {
+    u_int32_t index = __atomic_fetch_add(&object_pool_count, 1, __ATOMIC_RELAXED);
+    if (index >= OBJECT_POOL_LIMIT) {
+        printf("Cannot create more than %d object pools\n", OBJECT_POOL_LIMIT);
+        return NULL;
+    }
+
+    ObjectPool *pool = malloc(sizeof(ObjectPool));
+    if (pool == NULL) return NULL;
+    pool->name = name;
+    pool->size = size;
+    pool->index = index;
+    pthread_mutex_init(&pool->lock, NULL);
+    pool->free = NULL;
+    pool->count = 0;
+    pool->acquired = 0;
+    pool->reused = 0;
+    pool->live = 0;
+    pool->high_water = 0;
+    return pool;
+}
+
+#ifdef USE_OBJECT_POOL
+// Moves up to a batch of free objects of the pool into the cache of the calling thread
+static void refill_object(ObjectPool *pool, ObjectCache *cache) {
+    pthread_mutex_lock(&pool->lock);
+    for (u_int32_t i = 0; i < OBJECT_CACHE_BATCH && pool->free != NULL; ++i) {
+        ObjectHeader *header = pool->free;
+        pool->free = header->next;
+        --pool->count;
+        header->next = cache->free;
+        cache->free = header;
+        ++cache->count;
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Moves a batch of the cache of the calling thread back to the pool, freeing what the pool cannot keep
+static void spill_object(ObjectPool *pool, ObjectCache *cache) {
+    ObjectHeader *excess = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    for (u_int32_t i = 0; i < OBJECT_CACHE_BATCH && cache->free != NULL; ++i) {
+        ObjectHeader *header = cache->free;
+        cache->free = header->next;
+        --cache->count;
+        if (pool->count < OBJECT_POOL_DEPTH) {
+            header->next = pool->free;
+            pool->free = header;
+            ++pool->count;
+        } else {
+            header->next = excess;
+            excess = header;
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    while (excess != NULL) {
+        ObjectHeader *header = excess;
+        excess = header->next;
+        free(header);
+    }
+}
+#endif
+
+void *acquire_object(ObjectPool *pool, size_t size) {
+    ObjectHeader *header = NULL;
+
+    if (pool == NULL || size > pool->size) {
+        header = malloc(sizeof(ObjectHeader) + size);
+        if (header == NULL) return NULL;
+        header->pool = NULL;
+        if (pool != NULL) __atomic_add_fetch(&pool->acquired, 1, __ATOMIC_RELAXED);
+        return header + 1;
+    }
+
+#ifdef USE_OBJECT_POOL
+    ObjectCache *cache = &object_caches[pool->index];
+    if (cache->free == NULL) refill_object(pool, cache);
+    if (cache->free != NULL) {
+        header = cache->free;
+        cache->free = header->next;
+        --cache->count;
+        __atomic_add_fetch(&pool->reused, 1, __ATOMIC_RELAXED);
+    }
+#endif
+    if (header == NULL) {
+        header = malloc(sizeof(ObjectHeader) + pool->size);
+        if (header == NULL) return NULL;
+    }
+    header->pool = pool;
+    header->next = NULL;
+
+    __atomic_add_fetch(&pool->acquired, 1, __ATOMIC_RELAXED);
+    u_int64_t live = __atomic_add_fetch(&pool->live, 1, __ATOMIC_RELAXED);
+    u_int64_t high_water = __atomic_load_n(&pool->high_water, __ATOMIC_RELAXED);
+    while (live > high_water && !__atomic_compare_exchange_n(
+            &pool->high_water, &high_water, live, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return header + 1;
+}
+
+void release_object(void *object) {
+    if (object == NULL) return;
+
+    ObjectHeader *header = (ObjectHeader *) object - 1;
+    ObjectPool *pool = header->pool;
+    if (pool == NULL) {
+        free(header);
+        return;
+    }
+    __atomic_sub_fetch(&pool->live, 1, __ATOMIC_RELAXED);
+
+#ifdef USE_OBJECT_POOL
+    ObjectCache *cache = &object_caches[pool->index];
+    header->next = cache->free;
+    cache->free = header;
+    ++cache->count;
+    if (cache->count > OBJECT_CACHE_DEPTH) spill_object(pool, cache);
+#else
+    free(header);
+#endif
+}
+
+void free_object_pool(ObjectPool *pool) {
+    ObjectCache *cache = &object_caches[pool->index];
+
+    while (cache->free != NULL) {
+        ObjectHeader *header = cache->free;
+        cache->free = header->next;
+        free(header);
+    }
+    cache->count = 0;
+    while (pool->free != NULL) {
+        ObjectHeader *header = pool->free;
+        pool->free = header->next;
+        free(header);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
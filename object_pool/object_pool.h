@@ -0,0 +1,168 @@
+#ifndef SERVER_OBJECT_POOL_H
+#define SERVER_OBJECT_POOL_H
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include "../definitions.h"
+
+
+struct ObjectPool;
+
+
+/**
+ * Structure representing the header placed before every object of an object pool.
+ *
+ * The structure fields are defined as follows:
+ *  - pool: A pointer to the ObjectPool the object returns to, or NULL if it is freed once released.
+ *  - next: The next free object while the object is kept in a thread cache or in the pool.
+ */
+typedef struct ObjectHeader {
+    struct ObjectPool *pool;
+    struct ObjectHeader *next;
+} ObjectHeader;
+
+
+/**
+ * Structure representing the free objects of one pool kept by one thread.
+ *
+ * The structure fields are defined as follows:
+ *  - free: The first free object of the cache.
+ *  - count: The number of free objects of the cache.
+ */
+typedef struct {
+    ObjectHeader *free;
+    u_int32_t count;
+} ObjectCache;
+
+
+/**
+ * Structure representing a pool of objects of one type shared by every thread.
+ *
+ * Objects of a connection are allocated by the thread accepting it and often released by another one,
+ * so every thread keeps up to OBJECT_CACHE_DEPTH free objects of every pool for itself and only locks the pool
+ * to move OBJECT_CACHE_BATCH objects at once between its cache and the free objects of the pool.
+ * Acquiring and releasing an object usually takes neither a lock nor a malloc call.
+ *
+ * When built without USE_OBJECT_POOL, every object is allocated and freed with malloc, so memory checkers
+ * such as AddressSanitizer see every use after release. The statistics are kept either way.
+ *
+ * The structure fields are defined as follows:
+ *  - name: The name of the pool as it is printed in statistics.
+ *  - size: The size in bytes of the objects of the pool.
+ *  - index: The index of the cache of the pool in the thread caches.
+ *  - lock: The mutex protecting the free objects of the pool.
+ *  - free: The first free object of the pool.
+ *  - count: The number of free objects of the pool, up to OBJECT_POOL_DEPTH.
+ *  - acquired: The number of objects acquired from the pool, including the ones larger than its objects.
+ *  - reused: The number of acquired objects that were not allocated.
+ *  - live: The number of acquired objects of the size of the pool not yet released.
+ *  - high_water: The largest number of live objects so far.
+ *
+ * Example usage:
+ * @code
+ * ObjectPool *pool = init_object_pool("connections", sizeof(Connection));
+ * Connection *connection = acquire_object(pool, sizeof(Connection));
+ * release_object(connection);
+ * @endcode
+ */
+typedef struct ObjectPool {
+    const char *name;
+    size_t size;
+    u_int32_t index;
+    pthread_mutex_t lock;
+    ObjectHeader *free;
+    u_int32_t count;
+    u_int64_t acquired;
+    u_int64_t reused;
+    u_int64_t live;
+    u_int64_t high_water;
+} ObjectPool;
+
+
+/**
+ * Initializes an empty pool of objects of the specified size.
+ *
+ * At most OBJECT_POOL_LIMIT pools may be initialized in the process, as every thread has a cache for each of them.
+ *
+ * @param name The name of the pool as it is printed in statistics, which must outlive the pool.
+ * @param size The size in bytes of the objects of the pool.
+ *
+ * @return A pointer to the initialized ObjectPool structure, or NULL if memory allocation fails
+ * or OBJECT_POOL_LIMIT pools have already been initialized.
+ *
+ * Example usage:
+ * @code
+ * ObjectPool *pool = init_object_pool("handlers", sizeof(HandlerArgs));
+ * if (pool == NULL) {
+ *     // Error: Failed to allocate the pool.
+ * }
+ * @endcode
+ */
+ObjectPool *init_object_pool(const char *name, size_t size);
+
+
+/**
+ * Acquires an object of at least the specified size.
+ *
+ * The contents of the object are undefined. An object larger than the objects of the pool, or acquired
+ * with a NULL pool, is allocated on its own and freed once released.
+ *
+ * @param pool A pointer to the ObjectPool structure to take the object from, or NULL.
+ * @param size The number of bytes needed.
+ *
+ * @return A pointer to the object, or NULL if memory allocation fails.
+ *
+ * The function performs the following steps:
+ * 1. Takes a free object from the cache of the calling thread.
+ * 2. If the cache is empty, moves up to OBJECT_CACHE_BATCH free objects of the pool into it under the lock.
+ * 3. If the pool is empty as well, allocates a new object.
+ * 4. Counts the object as live and updates the high water mark of the pool.
+ *
+ * Example usage:
+ * @code
+ * char *payload = acquire_object(pool, size + 1);
+ * if (payload == NULL) {
+ *     // Error: Failed to allocate the object.
+ * }
+ * @endcode
+ */
+void *acquire_object(ObjectPool *pool, size_t size);
+
+
+/**
+ * Releases an object acquired with acquire_object, from any thread.
+ *
+ * The object is kept in the cache of the calling thread. Once the cache holds more than OBJECT_CACHE_DEPTH
+ * objects, OBJECT_CACHE_BATCH of them are moved to the pool under the lock, and freed if the pool already
+ * holds OBJECT_POOL_DEPTH objects.
+ *
+ * @param object A pointer to the object to release, or NULL.
+ *
+ * Example usage:
+ * @code
+ * release_object(connection);
+ * @endcode
+ */
+void release_object(void *object);
+
+
+/**
+ * Frees the pool and the free objects it holds, along with the objects kept by the calling thread.
+ *
+ * The pool must not be used by any thread afterwards. Objects kept in the caches of other threads are not freed.
+ *
+ * @param pool A pointer to the ObjectPool structure to free.
+ *
+ * Example usage:
+ * @code
+ * free_object_pool(context->connection_pool);
+ * @endcode
+ */
+void free_object_pool(ObjectPool *pool);
+
+
+#endif //SERVER_OBJECT_POOL_H
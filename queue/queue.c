@@ -1,31 +1,71 @@
 #include "queue.h"
 
 
-void populate_message(QMessage *message, QMessageType type, Connection *connection, char *payload) {
+bool populate_message(
+        QMessage *message,
+        QMessageType type,
+        Connection *connection,
+        char *payload,
+        size_t size,
+        ObjectPool *pool) {
     message->type = type;
     message->connection = connection;
-    if (payload != NULL) memcpy(message->payload, payload, QUEUE_PAYLOAD_SIZE);
+    message->payload = NULL;
+    message->size = 0;
+    if (payload == NULL) return true;
+
+    message->payload = acquire_object(pool, size + 1);
+    if (message->payload == NULL) return false;
+    memcpy(message->payload, payload, size);
+    message->payload[size] = '\0';
+    message->size = size;
+    return true;
+}
+
+
+void free_message(QMessage *message) {
+    release_object(message->payload);
+    message->payload = NULL;
+    message->size = 0;
+}
+
+
+QueueLane lane_message(QMessageType type) {
+    switch (type) {
+        case Q_MESSAGE_RECEIVED:
+            return QUEUE_LANE_CHAT;
+        case Q_MESSAGE_NOT_SPECIFIED:
+            return QUEUE_LANE_BULK;
+        default:
+            return QUEUE_LANE_CONTROL;
+    }
 }
 
 
 void populate_queue(Queue *queue, QueueType type, int32_t mqd) {
     queue->type = type;
     queue->mqd = mqd;
+    queue->ring = NULL;
 }
 
 
+#ifdef USE_MQUEUE
+
+
+// Number of messages queued per lane, mqueue only reports the total
+static u_int64_t lane_depths[QUEUE_LANES] = {0};
+
+
 void unlink_queue() {
     mq_unlink(QUEUE_NAME);
 }
 
 
 bool create_queue() {
-    size_t queue_message_size = QUEUE_PAYLOAD_SIZE + sizeof(QMessageType) + sizeof(Connection) + 1;
-
     struct mq_attr attr = {
             .mq_flags = 0,
             .mq_maxmsg = QUEUE_MAX_MESSAGES,
-            .mq_msgsize = queue_message_size,
+            .mq_msgsize = sizeof(QMessage),
             .mq_curmsgs = 0,
     };
     unlink_queue();
@@ -76,13 +116,12 @@ bool close_queue(Queue *queue) {
 bool send_queue(Queue *queue, QMessage *message) {
     if (queue->type == QUEUE_MODE_READ) return false;
 
-    size_t queue_message_size = QUEUE_PAYLOAD_SIZE + sizeof(QMessageType) + sizeof(Connection) + 1;
-    char buffer[queue_message_size];
-    memcpy(buffer, &message->type, sizeof(QMessageType));
-    memcpy(buffer + sizeof(QMessageType), &message->connection, sizeof(Connection));
-    memcpy(buffer + sizeof(QMessageType) + sizeof(Connection), message->payload, QUEUE_PAYLOAD_SIZE);
-
-    if (mq_send(queue->mqd, buffer, queue_message_size, 0) == -1) {
+    // Producers and the consumer share the address space, the payload is handed off by pointer
+    // Lanes map to message priorities, mqueue always delivers the highest priority first
+    QueueLane lane = lane_message(message->type);
+    __atomic_add_fetch(&lane_depths[lane], 1, __ATOMIC_RELAXED);
+    if (mq_send(queue->mqd, (char *) message, sizeof(QMessage), QUEUE_LANES - 1 - lane) == -1) {
+        __atomic_sub_fetch(&lane_depths[lane], 1, __ATOMIC_RELAXED);
         perror("mq_send");
         return false;
     }
@@ -90,20 +129,289 @@ bool send_queue(Queue *queue, QMessage *message) {
 }
 
 
+size_t send_queue_batch(Queue *queue, QMessage *messages, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        if (!send_queue(queue, &messages[i])) return i;
+    }
+    return count;
+}
+
+
 bool read_queue(Queue *queue, QMessage *message) {
     if (queue->type == QUEUE_MODE_WRITE) return false;
 
-    size_t queue_message_size = QUEUE_PAYLOAD_SIZE + sizeof(QMessageType) + sizeof(Connection);
-    char buffer[queue_message_size];
-
-    if (mq_receive(queue->mqd, buffer, queue_message_size + 1, NULL) == -1) {
+    if (mq_receive(queue->mqd, (char *) message, sizeof(QMessage), NULL) == -1) {
         perror("mq_receive");
         return false;
     }
+    __atomic_sub_fetch(&lane_depths[lane_message(message->type)], 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+
+size_t read_queue_batch(Queue *queue, QMessage *messages, size_t max) {
+    if (max == 0 || !read_queue(queue, &messages[0])) return 0;
+
+    // A deadline in the past makes mq_timedreceive return immediately once the queue is empty
+    struct timespec deadline = {0};
+    size_t count = 1;
+
+    while (count < max && mq_timedreceive(queue->mqd, (char *) &messages[count], sizeof(QMessage), NULL, &deadline) != -1) {
+        __atomic_sub_fetch(&lane_depths[lane_message(messages[count].type)], 1, __ATOMIC_RELAXED);
+        ++count;
+    }
+    return count;
+}
+
+
+size_t depth_queue(Queue *queue, QueueLane lane) {
+    return __atomic_load_n(&lane_depths[lane], __ATOMIC_RELAXED);
+}
 
-    memcpy(&message->type, buffer, sizeof(QMessageType));
-    memcpy(&message->connection, buffer + sizeof(QMessageType), sizeof(Connection));
-    memcpy(message->payload, buffer + sizeof(QMessageType) + sizeof(Connection), QUEUE_PAYLOAD_SIZE);
 
+#else
+
+
+// All the queue handles of the process share the same ring
+static QueueRing *queue_ring = NULL;
+
+
+static void wait_queue_ring(u_int32_t *address, u_int32_t expected) {
+    syscall(SYS_futex, address, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0);
+}
+
+static void wake_queue_ring(u_int32_t *address) {
+    syscall(SYS_futex, address, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+
+void unlink_queue() {
+    if (queue_ring == NULL) return;
+    for (u_int32_t i = 0; i < QUEUE_LANES; ++i) free(queue_ring->lanes[i].cells);
+    free(queue_ring);
+    queue_ring = NULL;
+}
+
+
+bool create_queue() {
+    unlink_queue();
+
+    QueueRing *ring = aligned_alloc(QUEUE_CACHE_LINE_SIZE, sizeof(QueueRing));
+    if (ring == NULL) return false;
+
+    for (u_int32_t i = 0; i < QUEUE_LANES; ++i) {
+        QueueLaneRing *lane = &ring->lanes[i];
+        lane->cells = malloc(QUEUE_RING_SIZE * sizeof(QueueCell));
+        if (lane->cells == NULL) {
+            for (u_int32_t j = 0; j < i; ++j) free(ring->lanes[j].cells);
+            free(ring);
+            return false;
+        }
+
+        for (u_int64_t j = 0; j < QUEUE_RING_SIZE; ++j) lane->cells[j].sequence = j;
+        lane->mask = QUEUE_RING_SIZE - 1;
+        lane->enqueue_position = 0;
+        lane->dequeue_position = 0;
+    }
+    ring->waiting = 0;
+
+    queue_ring = ring;
     return true;
 }
+
+
+Queue *open_queue(QueueType type) {
+    if (queue_ring == NULL) return NULL;
+
+    Queue *queue = malloc(sizeof(Queue));
+    if (queue == NULL) return NULL;
+
+    populate_queue(queue, type, -1);
+    queue->ring = queue_ring;
+    return queue;
+}
+
+
+bool close_queue(Queue *queue) {
+    free(queue);
+    queue = NULL;
+
+    return true;
+}
+
+
+bool send_queue(Queue *queue, QMessage *message) {
+    if (queue->type == QUEUE_MODE_READ) return false;
+
+    QueueRing *ring = queue->ring;
+    QueueLaneRing *lane = &ring->lanes[lane_message(message->type)];
+    QueueCell *cell;
+    u_int64_t position = __atomic_load_n(&lane->enqueue_position, __ATOMIC_RELAXED);
+
+    while (true) {
+        cell = &lane->cells[position & lane->mask];
+        u_int64_t sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+        int64_t difference = (int64_t) (sequence - position);
+
+        if (difference == 0) {
+            if (__atomic_compare_exchange_n(&lane->enqueue_position, &position, position + 1,
+                                            true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+        } else if (difference < 0) {
+            // Lane is full, let the consumer catch up
+            sched_yield();
+            position = __atomic_load_n(&lane->enqueue_position, __ATOMIC_RELAXED);
+        } else {
+            position = __atomic_load_n(&lane->enqueue_position, __ATOMIC_RELAXED);
+        }
+    }
+
+    cell->message = *message;
+    __atomic_store_n(&cell->sequence, position + 1, __ATOMIC_RELEASE);
+
+    // Only pay for a wakeup if the consumer went to sleep
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->waiting, __ATOMIC_RELAXED) && __atomic_exchange_n(&ring->waiting, 0, __ATOMIC_SEQ_CST)) {
+        wake_queue_ring(&ring->waiting);
+    }
+    return true;
+}
+
+
+size_t send_queue_batch(Queue *queue, QMessage *messages, size_t count) {
+    if (queue->type == QUEUE_MODE_READ || count == 0) return 0;
+
+    QueueRing *ring = queue->ring;
+    QueueLaneRing *lane = &ring->lanes[lane_message(messages[0].type)];
+    size_t sent = 0;
+
+    while (sent < count) {
+        u_int64_t position = __atomic_load_n(&lane->enqueue_position, __ATOMIC_RELAXED);
+        size_t claimed = count - sent;
+        if (claimed > lane->mask + 1) claimed = lane->mask + 1;
+
+        // The consumer frees slots in order, so the whole run is free once its last slot is
+        while (true) {
+            u_int64_t last = position + claimed - 1;
+            u_int64_t sequence = __atomic_load_n(&lane->cells[last & lane->mask].sequence, __ATOMIC_ACQUIRE);
+            int64_t difference = (int64_t) (sequence - last);
+
+            if (difference == 0) {
+                if (__atomic_compare_exchange_n(&lane->enqueue_position, &position, position + claimed,
+                                                true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+            } else if (difference < 0) {
+                // Lane cannot take the whole run, claim less or let the consumer catch up
+                if (claimed > 1) claimed /= 2;
+                else sched_yield();
+                position = __atomic_load_n(&lane->enqueue_position, __ATOMIC_RELAXED);
+            } else {
+                position = __atomic_load_n(&lane->enqueue_position, __ATOMIC_RELAXED);
+            }
+        }
+
+        for (size_t i = 0; i < claimed; ++i) {
+            QueueCell *cell = &lane->cells[(position + i) & lane->mask];
+            cell->message = messages[sent + i];
+            __atomic_store_n(&cell->sequence, position + i + 1, __ATOMIC_RELEASE);
+        }
+        sent += claimed;
+    }
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->waiting, __ATOMIC_RELAXED) && __atomic_exchange_n(&ring->waiting, 0, __ATOMIC_SEQ_CST)) {
+        wake_queue_ring(&ring->waiting);
+    }
+    return count;
+}
+
+
+static bool try_read_lane(QueueLaneRing *lane, QMessage *message) {
+    u_int64_t position = lane->dequeue_position;
+    QueueCell *cell = &lane->cells[position & lane->mask];
+
+    if (__atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE) != position + 1) return false;
+
+    *message = cell->message;
+    __atomic_store_n(&cell->sequence, position + lane->mask + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&lane->dequeue_position, position + 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+
+// Reads a lower lane only if the control lane had nothing claimed once the message was published,
+// so a connection event is never overtaken by a message its reactor sent after it
+static bool try_read_after_control(QueueLaneRing *lanes, QueueLane index, QMessage *message) {
+    QueueLaneRing *lane = &lanes[index];
+    u_int64_t position = lane->dequeue_position;
+    QueueLaneRing *control = &lanes[QUEUE_LANE_CONTROL];
+
+    if (__atomic_load_n(&lane->cells[position & lane->mask].sequence, __ATOMIC_ACQUIRE) != position + 1) return false;
+    if (__atomic_load_n(&control->enqueue_position, __ATOMIC_RELAXED) != control->dequeue_position) return false;
+    return try_read_lane(lane, message);
+}
+
+static bool try_read_queue(Queue *queue, QMessage *message) {
+    QueueLaneRing *lanes = queue->ring->lanes;
+
+    if (try_read_lane(&lanes[QUEUE_LANE_CONTROL], message)) return true;
+    for (u_int32_t i = QUEUE_LANE_CONTROL + 1; i < QUEUE_LANES; ++i) {
+        if (try_read_after_control(lanes, i, message)) return true;
+    }
+    return false;
+}
+
+
+bool read_queue(Queue *queue, QMessage *message) {
+    if (queue->type == QUEUE_MODE_WRITE) return false;
+
+    QueueRing *ring = queue->ring;
+    while (!try_read_queue(queue, message)) {
+        __atomic_store_n(&ring->waiting, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (try_read_queue(queue, message)) {
+            __atomic_store_n(&ring->waiting, 0, __ATOMIC_RELAXED);
+            return true;
+        }
+        wait_queue_ring(&ring->waiting, 1);
+    }
+    return true;
+}
+
+
+size_t read_queue_batch(Queue *queue, QMessage *messages, size_t max) {
+    if (max == 0 || !read_queue(queue, &messages[0])) return 0;
+
+    QueueLaneRing *lanes = queue->ring->lanes;
+    size_t weights[QUEUE_LANES] = {
+            [QUEUE_LANE_CONTROL] = max,
+            [QUEUE_LANE_CHAT] = QUEUE_LANE_POLICY == QUEUE_POLICY_WEIGHTED ? QUEUE_CHAT_WEIGHT : max,
+            [QUEUE_LANE_BULK] = QUEUE_LANE_POLICY == QUEUE_POLICY_WEIGHTED ? QUEUE_BULK_WEIGHT : max,
+    };
+    size_t count = 1;
+    bool drained = false;
+
+    // Control events always go first, the other lanes take turns according to their weights
+    while (count < max && !drained) {
+        drained = true;
+        while (count < max && try_read_lane(&lanes[QUEUE_LANE_CONTROL], &messages[count])) ++count;
+
+        for (u_int32_t i = QUEUE_LANE_CONTROL + 1; i < QUEUE_LANES; ++i) {
+            for (size_t taken = 0; taken < weights[i] && count < max; ++taken) {
+                if (!try_read_after_control(lanes, i, &messages[count])) break;
+                ++count;
+                drained = false;
+            }
+        }
+    }
+    return count;
+}
+
+
+size_t depth_queue(Queue *queue, QueueLane lane) {
+    QueueLaneRing *ring = &queue->ring->lanes[lane];
+    u_int64_t enqueued = __atomic_load_n(&ring->enqueue_position, __ATOMIC_RELAXED);
+    u_int64_t dequeued = __atomic_load_n(&ring->dequeue_position, __ATOMIC_RELAXED);
+    return enqueued > dequeued ? enqueued - dequeued : 0;
+}
+
+
+#endif
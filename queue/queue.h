@@ -6,8 +6,14 @@
 #include <mqueue.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <stdalign.h>
 #include <memory.h>
+#include <sched.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
 #include "../connection/connection.h"
+#include "../object_pool/object_pool.h"
 #include "../definitions.h"
 
 
@@ -27,6 +33,7 @@
  *  - Q_MESSAGE_STRIKE: Indicates a strike action, such as a warning or penalty.
  *  - Q_MESSAGE_BAN: Indicates a ban action, prohibiting further access or communication.
  *  - Q_MESSAGE_STOP_LISTENING: Indicates the stop of listening for connections.
+ *  - Q_MESSAGE_WRITABLE: Indicates that a connection with bytes waiting to be sent has become writable.
  *
  * Example usage:
  * @code
@@ -41,10 +48,54 @@ typedef enum {
     Q_MESSAGE_RECEIVED,
     Q_MESSAGE_STRIKE,
     Q_MESSAGE_BAN,
-    Q_MESSAGE_STOP_LISTENING
+    Q_MESSAGE_STOP_LISTENING,
+    Q_MESSAGE_WRITABLE
 } QMessageType;
 
 
+/**
+ * Enumeration representing the priority lanes of the message queue.
+ *
+ * Every message type travels through one lane, and the reader drains the lanes by priority, so connection
+ * events never wait behind a flood of chat messages. A lower lane is only read while the control lane holds
+ * nothing, so a message is never read before an event its producer sent earlier, such as the first line
+ * of a client before its open event.
+ *
+ * The following lanes are defined, from the highest priority:
+ *  - QUEUE_LANE_CONTROL: Listener and connection events.
+ *  - QUEUE_LANE_CHAT: Received chat messages.
+ *  - QUEUE_LANE_BULK: Messages with no latency requirements.
+ *  - QUEUE_LANES: The number of lanes.
+ *
+ * Example usage:
+ * @code
+ * QueueLane lane = lane_message(Q_MESSAGE_OPEN_CONNECTION); // QUEUE_LANE_CONTROL
+ * @endcode
+ */
+typedef enum {
+    QUEUE_LANE_CONTROL,
+    QUEUE_LANE_CHAT,
+    QUEUE_LANE_BULK,
+    QUEUE_LANES
+} QueueLane;
+
+
+/**
+ * Enumeration representing the fairness policy between the chat and bulk lanes, set with QUEUE_LANE_POLICY.
+ *
+ * The control lane is always drained first. The following policies are defined:
+ *  - QUEUE_POLICY_STRICT: The chat lane is drained before the bulk lane is read.
+ *  - QUEUE_POLICY_WEIGHTED: Up to QUEUE_CHAT_WEIGHT chat messages and QUEUE_BULK_WEIGHT bulk messages are read in turns,
+ *    so bulk messages are not starved during chat floods.
+ *
+ * This policy applies to the in-process ring backend, the POSIX message queue backend is always strict.
+ */
+typedef enum {
+    QUEUE_POLICY_STRICT,
+    QUEUE_POLICY_WEIGHTED
+} QueuePolicy;
+
+
 /**
  * Enumeration representing the mode of operation for a message queue.
  *
@@ -75,36 +126,102 @@ typedef enum {
  * This structure represents a message exchanged between different components within the system.
  * It contains information about the message type, the associated connection (if applicable),
  * and a payload containing the message data.
+ * The payload is taken from the message pool and handed off by pointer,
+ * so passing a message through the queue only copies this small header.
+ * The consumer owns the payload once the message is read and releases it with free_message.
  *
  * The structure fields are defined as follows:
  *  - type: The type of the message, indicating the action or event represented by the message.
  *  - connection: A pointer to the Connection structure associated with the message, if applicable.
- *  - payload: An array containing the message data or payload.
+ *  - payload: A pointer to the null-terminated message data, or NULL if the message carries none.
+ *  - size: The size of the message data in bytes, excluding the null terminator.
  *
  * Example usage:
  * @code
  * QMessage message;
- * message.type = Q_MESSAGE_RECEIVED;
- * message.connection = client_connection;
- * strncpy(message.payload, data, QUEUE_PAYLOAD_SIZE);
+ * populate_message(&message, Q_MESSAGE_RECEIVED, client_connection, data, size);
+ * send_queue(queue, &message);
  * @endcode
  */
 typedef struct {
     QMessageType type;
     Connection *connection;
-    char payload[QUEUE_PAYLOAD_SIZE];
+    char *payload;
+    size_t size;
 } QMessage;
 
 
+/**
+ * Structure representing a slot of the in-process message ring.
+ *
+ * The sequence number tells producers and the consumer whose turn it is to use the slot:
+ * it equals the enqueue position when the slot is free, and the position plus one once a message is stored.
+ *
+ * The structure fields are defined as follows:
+ *  - sequence: The sequence number of the slot.
+ *  - message: The stored message.
+ */
+typedef struct {
+    u_int64_t sequence;
+    QMessage message;
+} QueueCell;
+
+
+/**
+ * Structure representing a bounded lock-free multi-producer single-consumer ring of one priority lane.
+ *
+ * Producers claim slots with a compare-and-swap on the enqueue position, the single consumer reads slots
+ * in order without any atomic read-modify-write. The positions are kept on separate cache lines
+ * so producers and the consumer do not contend on them.
+ *
+ * The structure fields are defined as follows:
+ *  - cells: An array of QUEUE_RING_SIZE slots.
+ *  - mask: The mask mapping a position to a slot index.
+ *  - enqueue_position: The position of the next slot to be claimed by a producer.
+ *  - dequeue_position: The position of the next slot to be read by the consumer.
+ */
+typedef struct {
+    QueueCell *cells;
+    u_int64_t mask;
+    alignas(QUEUE_CACHE_LINE_SIZE) u_int64_t enqueue_position;
+    alignas(QUEUE_CACHE_LINE_SIZE) u_int64_t dequeue_position;
+} QueueLaneRing;
+
+
+/**
+ * Structure representing the in-process message queue backend shared by every queue handle.
+ *
+ * It holds one lock-free ring per priority lane. The consumer only sleeps on a futex when all the lanes
+ * are empty, and producers only issue the wakeup system call when the consumer is actually sleeping.
+ *
+ * The structure fields are defined as follows:
+ *  - lanes: The rings of the priority lanes, indexed by QueueLane.
+ *  - waiting: The futex word, set to 1 while the consumer sleeps.
+ *
+ * Example usage:
+ * @code
+ * create_queue();
+ * Queue *queue = open_queue(QUEUE_MODE_WRITE);
+ * // queue->ring points to the rings shared by the process
+ * @endcode
+ */
+typedef struct {
+    QueueLaneRing lanes[QUEUE_LANES];
+    alignas(QUEUE_CACHE_LINE_SIZE) u_int32_t waiting;
+} QueueRing;
+
+
 /**
  * Structure representing a message queue.
  *
  * This structure represents a message queue used for communication between components within the system.
- * It contains information about the queue type and the message queue descriptor (mqd) associated with it.
+ * It contains information about the queue type and the backend the queue is bound to: the POSIX message queue
+ * descriptor (mqd) when built with USE_MQUEUE, otherwise the in-process message ring.
  *
  * The structure fields are defined as follows:
  *  - type: The type of the message queue, specifying whether it is intended for reading, writing, or both.
  *  - mqd: The message queue descriptor obtained from mq_open, used for interacting with the message queue.
+ *  - ring: A pointer to the in-process message ring, NULL with the POSIX message queue backend.
  *
  * Example usage:
  * @code
@@ -116,6 +233,7 @@ typedef struct {
 typedef struct {
     QueueType type;
     int32_t mqd;
+    QueueRing *ring;
 } Queue;
 
 
@@ -124,28 +242,72 @@ typedef struct {
  *
  * This function populates a QMessage structure with the specified message type, connection,
  * and payload data. It assigns the provided values to the respective fields of the QMessage structure.
+ * The payload is copied into an object of the message pool, so copying scales with the actual message size
+ * and a steady flow of messages does not call malloc. A payload longer than the objects of the pool is allocated
+ * on its own.
  *
  * @param message A pointer to the QMessage structure to be populated.
  * @param type The type of the message.
  * @param connection A pointer to the Connection structure associated with the message.
  * @param payload A pointer to the payload data to be copied into the message structure.
- *                If NULL, the payload field of the message structure remains unchanged.
+ *                If NULL, the message carries no payload.
+ * @param size The size of the payload data in bytes.
+ * @param pool A pointer to the ObjectPool structure the payload is taken from, or NULL to allocate it.
+ *
+ * @return true if the message is populated, false if the payload cannot be allocated.
  *
  * The function performs the following steps:
  * 1. Assigns the specified message type to the 'type' field of the QMessage structure.
  * 2. Assigns the provided connection pointer to the 'connection' field of the QMessage structure.
- * 3. If a non-NULL payload pointer is provided, copies the payload data into the 'payload' field
- *    of the QMessage structure using memcpy.
+ * 3. If a non-NULL payload pointer is provided, acquires size + 1 bytes from the pool, copies the payload data
+ *    and a null terminator into them and stores the allocation and the size in the QMessage structure.
  *
  * Example usage:
  * @code
  * QMessage message;
  * Connection *connection = create_connection();
- * char payload[QUEUE_PAYLOAD_SIZE] = "Hello, world!";
- * populate_message(&message, Q_MESSAGE_RECEIVED, connection, payload);
+ * char payload[] = "Hello, world!";
+ * populate_message(&message, Q_MESSAGE_RECEIVED, connection, payload, strlen(payload), context->message_pool);
+ * @endcode
+ */
+bool populate_message(
+        QMessage *message,
+        QMessageType type,
+        Connection *connection,
+        char *payload,
+        size_t size,
+        ObjectPool *pool);
+
+
+/**
+ * Releases the payload of a message once it has been handled.
+ *
+ * @param message A pointer to the QMessage structure whose payload is to be freed.
+ *
+ * Example usage:
+ * @code
+ * read_queue(queue, &message);
+ * // Handle the message
+ * free_message(&message);
+ * @endcode
+ */
+void free_message(QMessage *message);
+
+
+/**
+ * Returns the priority lane a message type travels through.
+ *
+ * @param type The type of the message.
+ *
+ * @return QUEUE_LANE_CHAT for received chat messages, QUEUE_LANE_BULK for unspecified messages,
+ *         QUEUE_LANE_CONTROL for listener and connection events.
+ *
+ * Example usage:
+ * @code
+ * QueueLane lane = lane_message(message.type);
  * @endcode
  */
-void populate_message(QMessage *message, QMessageType type, Connection *connection, char *payload);
+QueueLane lane_message(QMessageType type);
 
 
 /**
@@ -180,6 +342,7 @@ void populate_queue(Queue *queue, QueueType type, int32_t mqd);
  * If the queue deletion operation is successful, the function completes without returning any value.
  * If an error occurs during queue deletion, it may print an error message, but it does not return any
  * explicit indication of success or failure.
+ * With the in-process ring backend, the function frees the shared message ring instead.
  *
  * The function performs the following steps:
  * 1. Calls mq_unlink function to unlink (delete) the message queue with the specified name from the system.
@@ -202,12 +365,13 @@ void unlink_queue();
  * and permissions. If a message queue with the same name already exists, it is unlinked before
  * creating a new one. The function returns true upon successful creation of the message queue
  * and false otherwise, along with an error message if applicable.
+ * With the in-process ring backend, the function allocates the message ring shared by every queue handle
+ * of the process, with QUEUE_RING_SIZE slots.
  *
  * @return true if the message queue is successfully created, otherwise false.
  *
  * The function performs the following steps:
- * 1. Calculates the message size based on the payload size, message type, connection structure size,
- *    and an additional byte for null terminator.
+ * 1. Uses the size of the QMessage structure as the message size, as payloads are handed off by pointer.
  * 2. Sets up the message queue attributes including flags, maximum number of messages, message size,
  *    and current number of messages.
  * 3. Unlinks any existing message queue with the same name to ensure a fresh creation.
@@ -235,6 +399,7 @@ bool create_queue();
  * Upon successful opening of the queue, it initializes a Queue structure to represent the opened queue
  * and returns a pointer to the Queue structure. If opening the queue fails, it returns NULL along with
  * an error message.
+ * With the in-process ring backend, the handle is bound to the ring allocated by create_queue.
  *
  * @param type The type of queue to be opened (read, write, or read-write).
  *
@@ -267,6 +432,7 @@ Queue *open_queue(QueueType type);
  * This function closes the specified message queue and frees the memory associated with the Queue structure.
  * It also sets the queue pointer to NULL to prevent accidental access to the closed queue.
  * If the queue is successfully closed, the function returns true; otherwise, it returns false.
+ * With the in-process ring backend, only the handle is freed, the shared ring stays available.
  *
  * @param queue A pointer to the Queue structure representing the message queue to be closed.
  *
@@ -294,11 +460,14 @@ bool close_queue(Queue *queue);
 /**
  * Sends a message through a message queue.
  *
- * This function sends a message through the specified message queue. It constructs a buffer containing
- * the message type, connection information, and payload, and sends this buffer through the queue.
+ * This function sends a message through the specified message queue. Only the QMessage structure is
+ * sent, the ownership of its payload passes to the reader of the message.
  * If the queue type is set to read-only, indicating that it cannot be used for sending messages,
  * the function returns false. If the message is successfully sent, the function returns true; otherwise,
  * it returns false along with an error message.
+ * With the in-process ring backend, the message is copied into a slot of the lane of its type claimed
+ * without locks, the consumer is only woken up if it sleeps, and the producer yields while the lane is full.
+ * With the POSIX message queue backend, the lane of the message is mapped to its priority.
  *
  * @param queue A pointer to the Queue structure representing the message queue.
  * @param message A pointer to the QMessage structure containing the message to be sent.
@@ -307,10 +476,9 @@ bool close_queue(Queue *queue);
  *
  * The function performs the following steps:
  * 1. Checks if the queue type is set to read-only. If so, returns false as read-only queues cannot send messages.
- * 2. Constructs a buffer containing the message type, connection information, and payload.
- * 3. Sends the constructed buffer through the message queue using mq_send function.
- * 4. Checks if the message sending operation was successful. If not, prints an error message and returns false.
- * 5. Returns true to indicate that the message was successfully sent.
+ * 2. Sends the QMessage structure through the message queue using mq_send function.
+ * 3. Checks if the message sending operation was successful. If not, prints an error message and returns false.
+ * 4. Returns true to indicate that the message was successfully sent.
  *
  * Example usage:
  * @code
@@ -326,10 +494,38 @@ bool close_queue(Queue *queue);
 bool send_queue(Queue *queue, QMessage *message);
 
 
+/**
+ * Sends several messages of the same lane to the message queue at once.
+ *
+ * With the in-process ring backend, consecutive slots are claimed for all the messages with a single atomic
+ * operation whenever the lane has room for them, and the consumer is woken up at most once for the whole batch,
+ * so a reactor forwarding many lines of a client pays for one handoff. The messages keep their order.
+ * With the POSIX message queue backend, the messages are sent one by one.
+ *
+ * @param queue A pointer to the Queue structure representing the message queue.
+ * @param messages An array of QMessage structures, all of a type mapped to the same lane.
+ * @param count The number of messages in the array.
+ *
+ * @return The number of messages sent from the start of the array, count unless the queue fails.
+ *
+ * Example usage:
+ * @code
+ * QMessage messages[QUEUE_BATCH_SIZE];
+ * // Populate count received messages...
+ * size_t sent = send_queue_batch(queue, messages, count);
+ * for (size_t i = sent; i < count; ++i) free_message(&messages[i]);
+ * @endcode
+ */
+size_t send_queue_batch(Queue *queue, QMessage *messages, size_t count);
+
+
 /**
  * Reads a message from the message queue.
  *
  * This function reads a message from the specified message queue and populates the provided QMessage structure with the message content.
+ * Messages are read from the highest priority lane holding any. With the in-process ring backend, a control event
+ * claimed but not yet published keeps the lower lanes from being read until it is.
+ * With the in-process ring backend, the consumer only sleeps on the futex of the ring when all the lanes are empty.
  *
  * @param queue A pointer to the Queue structure representing the message queue.
  * @param message A pointer to the QMessage structure where the read message will be stored.
@@ -337,12 +533,9 @@ bool send_queue(Queue *queue, QMessage *message);
  *
  * The function performs the following steps:
  * 1. Checks if the queue type is QUEUE_MODE_WRITE, indicating that reading is not allowed. If so, returns false.
- * 2. Calculates the size of the message to be received based on the payload size, message type size, and connection size.
- * 3. Declares a buffer to store the received message content.
- * 4. Attempts to receive a message from the message queue using mq_receive.
- * 5. If the receive operation fails, prints an error message and returns false.
- * 6. Extracts the message type, connection information, and payload from the received buffer and populates the provided QMessage structure.
- * 7. Returns true to indicate successful message read and population.
+ * 2. Attempts to receive a message from the message queue into the provided QMessage structure using mq_receive.
+ * 3. If the receive operation fails, prints an error message and returns false.
+ * 4. Returns true to indicate successful message read and population.
  *
  * Example usage:
  * @code
@@ -350,6 +543,7 @@ bool send_queue(Queue *queue, QMessage *message);
  * QMessage message;
  * if (read_queue(queue, &message)) {
  *     // Process the received message
+ *     free_message(&message);
  * } else {
  *     // Handle the read failure
  * }
@@ -359,4 +553,56 @@ bool send_queue(Queue *queue, QMessage *message);
 bool read_queue(Queue *queue, QMessage *message);
 
 
+/**
+ * Reads every available message from the message queue, up to a limit.
+ *
+ * This function waits for at least one message like read_queue does, then keeps reading
+ * the messages that are already queued without waiting, so a burst of messages is drained
+ * with a single wakeup. The control lane is drained first, the chat and bulk lanes are read
+ * according to QUEUE_LANE_POLICY.
+ *
+ * @param queue A pointer to the Queue structure representing the message queue.
+ * @param messages An array where the read messages will be stored.
+ * @param max The capacity of the messages array.
+ *
+ * @return The number of read messages, 0 if reading fails.
+ *
+ * The function performs the following steps:
+ * 1. Reads the first message with the read_queue function, waiting if the queue is empty.
+ *    If reading fails, returns 0.
+ * 2. Reads further messages without waiting until the queue is empty or max messages are read.
+ *    With the in-process ring backend, the control lane is drained before every turn of the chat and bulk lanes.
+ *    With the POSIX message queue backend, mq_timedreceive is called with an expired deadline.
+ * 3. Returns the number of read messages.
+ *
+ * Example usage:
+ * @code
+ * QMessage messages[QUEUE_BATCH_SIZE];
+ * size_t count;
+ * while ((count = read_queue_batch(queue, messages, QUEUE_BATCH_SIZE)) > 0) {
+ *     // Process count messages
+ * }
+ * @endcode
+ */
+size_t read_queue_batch(Queue *queue, QMessage *messages, size_t max);
+
+
+/**
+ * Returns the number of messages waiting in a lane of the message queue.
+ *
+ * The value is a snapshot and may be slightly off while producers are writing.
+ *
+ * @param queue A pointer to the Queue structure representing the message queue.
+ * @param lane The lane to be inspected.
+ *
+ * @return The number of queued messages in the lane.
+ *
+ * Example usage:
+ * @code
+ * printf("Queued chat messages: %zu\n", depth_queue(queue, QUEUE_LANE_CHAT));
+ * @endcode
+ */
+size_t depth_queue(Queue *queue, QueueLane lane);
+
+
 #endif //SERVER_QUEUE_H
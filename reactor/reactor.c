@@ -0,0 +1,385 @@
+#include "reactor.h"
+
+
+Reactor *init_reactor(Connection *server_connection, ServerContext *context, Queue *queue, Shard *shard) {
+    Reactor *reactor = malloc(sizeof(Reactor));
+    if (reactor == NULL) return NULL;
+
+    reactor->fd = epoll_create1(EPOLL_CLOEXEC);
+    if (reactor->fd == -1) {
+        perror("epoll_create1");
+        free(reactor);
+        return NULL;
+    }
+    reactor->server_connection = server_connection;
+    reactor->context = context;
+    reactor->queue = queue;
+    reactor->shard = shard;
+    reactor->ring = NULL;
+    reactor->joining = NULL;
+    reactor->joining_last = NULL;
+    reactor->timing = false;
+    shard->pool = init_shared_pool();
+    if (shard->pool == NULL) {
+        close(reactor->fd);
+        free(reactor);
+        return NULL;
+    }
+
+#ifdef USE_IO_URING
+    reactor->ring = init_ring(REACTOR_RING_ENTRIES);
+    if (reactor->ring != NULL && !provide_buffers_ring(reactor->ring, REACTOR_RING_BUFFERS, MESSAGE_BUFFER_SIZE - 1)) {
+        free_ring(reactor->ring);
+        reactor->ring = NULL;
+    }
+    if (reactor->ring != NULL) {
+        __atomic_store_n(&shard->adopting, true, __ATOMIC_RELEASE);
+        return reactor;
+    }
+    printf("io_uring is not available, falling back to epoll\n");
+#endif
+
+    struct epoll_event event = {.events = EPOLLIN | EPOLLET, .data.u64 = REACTOR_INBOX_DATA};
+    if (epoll_ctl(reactor->fd, EPOLL_CTL_ADD, shard->notify, &event) == -1
+        || (server_connection != NULL && !add_reactor(reactor, server_connection, NULL))) {
+        perror("epoll_ctl");
+        free_reactor(reactor);
+        return NULL;
+    }
+    __atomic_store_n(&shard->adopting, true, __ATOMIC_RELEASE);
+    return reactor;
+}
+
+bool add_reactor(Reactor *reactor, Connection *connection, void *data) {
+    struct epoll_event event = {
+            .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+            .data.ptr = data
+    };
+    if (epoll_ctl(reactor->fd, EPOLL_CTL_ADD, connection->fd, &event) == -1) {
+        perror("epoll_ctl");
+        return false;
+    }
+    return true;
+}
+
+bool remove_reactor(Reactor *reactor, Connection *connection) {
+    return epoll_ctl(reactor->fd, EPOLL_CTL_DEL, connection->fd, NULL) == 0;
+}
+
+static u_int64_t time_reactor() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (u_int64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+void wait_join_reactor(Reactor *reactor, HandlerArgs *handler_args) {
+    handler_args->joined = time_reactor();
+    handler_args->previous = reactor->joining_last;
+    handler_args->next = NULL;
+    if (reactor->joining_last != NULL) reactor->joining_last->next = handler_args;
+    else reactor->joining = handler_args;
+    reactor->joining_last = handler_args;
+}
+
+void leave_join_reactor(Reactor *reactor, HandlerArgs *handler_args) {
+    if (handler_args->previous == NULL && reactor->joining != handler_args) return;
+
+    if (handler_args->previous != NULL) handler_args->previous->next = handler_args->next;
+    else reactor->joining = handler_args->next;
+    if (handler_args->next != NULL) handler_args->next->previous = handler_args->previous;
+    else reactor->joining_last = handler_args->previous;
+    handler_args->previous = NULL;
+    handler_args->next = NULL;
+}
+
+int32_t expire_join_reactor(Reactor *reactor) {
+    u_int64_t now = time_reactor();
+
+    while (reactor->joining != NULL) {
+        HandlerArgs *handler_args = reactor->joining;
+        if (handler_args->joined + RESUME_WAIT > now) return (int32_t) (handler_args->joined + RESUME_WAIT - now);
+        leave_join_reactor(reactor, handler_args);
+        join_connection_handler(handler_args, reactor->queue);
+    }
+    return -1;
+}
+
+// Sets up the arguments of an accepted connection and lets it wait for its first line
+static void adopt_reactor(Reactor *reactor, HandlerArgs *handler_args, Connection *client_connection) {
+    // The reactor writes the recent messages before the main thread takes the connection over,
+    // so the outbound settings apply from the first write
+    client_connection->outbound.limit = reactor->context->outbound_limit;
+    client_connection->outbound.policy = reactor->context->outbound_policy;
+    client_connection->outbound.pool = reactor->context->pool;
+    handler_args->client_connection = client_connection;
+    handler_args->context = reactor->context;
+    handler_args->shard = reactor->shard;
+    handler_args->framer = (Framer) {.buffer = NULL, .size = 0, .discarding = false};
+    handler_args->closing = false;
+
+    __atomic_add_fetch(&reactor->shard->connections, 1, __ATOMIC_RELAXED);
+    wait_join_reactor(reactor, handler_args);
+}
+
+// Registers a client connection in the reactor, which reads from it from now on
+static void attach_reactor(Reactor *reactor, Connection *client_connection) {
+    HandlerArgs *handler_args = acquire_object(reactor->context->handler_pool, sizeof(HandlerArgs));
+    if (handler_args == NULL || (reactor->ring == NULL && !add_reactor(reactor, client_connection, handler_args))) {
+        close_connection(client_connection);
+        release_object(client_connection);
+        release_object(handler_args);
+        return;
+    }
+    if (reactor->ring != NULL) {
+        u_int64_t user_data = (u_int64_t) (uintptr_t) handler_args;
+        int32_t fd = client_connection->fd;
+        while (!prepare_recv_ring(reactor->ring, fd, user_data)) submit_ring(reactor->ring, 0);
+        while (!prepare_poll_ring(reactor->ring, fd, POLLOUT, user_data | REACTOR_WRITABLE_DATA)) {
+            submit_ring(reactor->ring, 0);
+        }
+    }
+    adopt_reactor(reactor, handler_args, client_connection);
+}
+
+// Counts the connections of a shard along with the ones waiting in its inbox
+static u_int32_t load_reactor(Shard *shard) {
+    return __atomic_load_n(&shard->connections, __ATOMIC_RELAXED)
+           + __atomic_load_n(&shard->inbox_count, __ATOMIC_RELAXED);
+}
+
+// Returns the least loaded shard if it has LISTENER_HANDOFF_MARGIN connections fewer than the shard of the reactor
+static Shard *balance_reactor(Reactor *reactor) {
+    ServerContext *context = reactor->context;
+    Shard *target = reactor->shard;
+    u_int32_t own = load_reactor(target);
+    u_int32_t least = own;
+
+    if (own < LISTENER_HANDOFF_MARGIN) return target;
+    for (u_int32_t i = 0; i < context->shard_count; ++i) {
+        Shard *shard = &context->shards[i];
+        if (shard == reactor->shard || !__atomic_load_n(&shard->adopting, __ATOMIC_ACQUIRE)) continue;
+        u_int32_t load = load_reactor(shard);
+        if (load < least) {
+            least = load;
+            target = shard;
+        }
+    }
+    return least + LISTENER_HANDOFF_MARGIN <= own ? target : reactor->shard;
+}
+
+// Puts a client connection in the inbox of another shard and wakes its reactor
+static bool hand_reactor(Shard *shard, Connection *client_connection) {
+    pthread_mutex_lock(&shard->lock);
+    if (shard->inbox_count == shard->inbox_capacity) {
+        u_int32_t capacity = shard->inbox_capacity > 0 ? shard->inbox_capacity * 2 : LISTENER_INBOX_SIZE;
+        Connection **inbox = realloc(shard->inbox, capacity * sizeof(Connection *));
+        if (inbox == NULL) {
+            pthread_mutex_unlock(&shard->lock);
+            return false;
+        }
+        shard->inbox = inbox;
+        shard->inbox_capacity = capacity;
+    }
+    shard->inbox[shard->inbox_count] = client_connection;
+    __atomic_store_n(&shard->inbox_count, shard->inbox_count + 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&shard->lock);
+
+    u_int64_t value = 1;
+    if (write(shard->notify, &value, sizeof(value)) < 0) perror("write");
+    return true;
+}
+
+// Keeps an accepted connection in the reactor, or hands it to a shard with fewer connections
+static void place_reactor(Reactor *reactor, Connection *client_connection) {
+    __atomic_add_fetch(&reactor->shard->accepted, 1, __ATOMIC_RELAXED);
+
+    Shard *target = balance_reactor(reactor);
+    if (target != reactor->shard && hand_reactor(target, client_connection)) {
+        __atomic_add_fetch(&reactor->shard->handed, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    attach_reactor(reactor, client_connection);
+}
+
+void receive_inbox_reactor(Reactor *reactor) {
+    Shard *shard = reactor->shard;
+    u_int64_t value;
+
+    // The counter is reset before the inbox is taken, a connection handed meanwhile wakes the reactor again
+    if (read(shard->notify, &value, sizeof(value)) < 0 && errno != EAGAIN) perror("read");
+
+    pthread_mutex_lock(&shard->lock);
+    Connection **inbox = shard->inbox;
+    u_int32_t count = shard->inbox_count;
+    shard->inbox = NULL;
+    shard->inbox_capacity = 0;
+    __atomic_store_n(&shard->inbox_count, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&shard->lock);
+
+    for (u_int32_t i = 0; i < count; ++i) attach_reactor(reactor, inbox[i]);
+    free(inbox);
+}
+
+void accept_reactor(Reactor *reactor) {
+    while (true) {
+        Connection *client_connection = acquire_object(reactor->context->connection_pool, sizeof(Connection));
+        if (client_connection == NULL) return;
+        if (!accept_connection(reactor->server_connection, client_connection)) {
+            release_object(client_connection);
+            return;
+        }
+        place_reactor(reactor, client_connection);
+    }
+}
+
+void accept_ring_reactor(Reactor *reactor, int32_t result, u_int32_t flags) {
+    Ring *ring = reactor->ring;
+
+    if (!(flags & IORING_CQE_F_MORE)) {
+        while (!prepare_accept_ring(ring, reactor->server_connection->fd, 0)) submit_ring(ring, 0);
+    }
+    if (result < 0) return;
+
+    Connection *client_connection = acquire_object(reactor->context->connection_pool, sizeof(Connection));
+    if (client_connection == NULL || !populate_peer_connection(client_connection, result)) {
+        close(result);
+        release_object(client_connection);
+        return;
+    }
+    place_reactor(reactor, client_connection);
+}
+
+void receive_ring_reactor(Reactor *reactor, HandlerArgs *handler_args, int32_t result, u_int32_t flags) {
+    Ring *ring = reactor->ring;
+
+    if (result > 0) {
+        u_int16_t id = flags >> IORING_CQE_BUFFER_SHIFT;
+        receive_connection_handler(handler_args, reactor->queue, get_buffer_ring(ring, id), result);
+        recycle_buffer_ring(ring, id);
+        if (handler_args->joined == 0) leave_join_reactor(reactor, handler_args);
+    }
+    if (flags & IORING_CQE_F_MORE) return;
+
+    // Multishot receive has terminated, rearm it unless the connection is gone
+    if (result > 0 || result == -ENOBUFS) {
+        u_int64_t user_data = (u_int64_t) (uintptr_t) handler_args;
+        while (!prepare_recv_ring(ring, handler_args->client_connection->fd, user_data)) submit_ring(ring, 0);
+        return;
+    }
+    // The writability poll still refers to the arguments, the connection is released once it completes
+    handler_args->closing = true;
+    leave_join_reactor(reactor, handler_args);
+    u_int64_t target = (u_int64_t) (uintptr_t) handler_args | REACTOR_WRITABLE_DATA;
+    while (!prepare_poll_remove_ring(ring, target, REACTOR_REMOVE_DATA)) submit_ring(ring, 0);
+}
+
+void writable_ring_reactor(Reactor *reactor, HandlerArgs *handler_args, int32_t result, u_int32_t flags) {
+    Ring *ring = reactor->ring;
+
+    if (result > 0 && (result & POLLOUT) && !handler_args->closing) {
+        writable_connection_handler(handler_args, reactor->queue);
+    }
+    if (flags & IORING_CQE_F_MORE) return;
+
+    if (!handler_args->closing) {
+        u_int64_t user_data = (u_int64_t) (uintptr_t) handler_args | REACTOR_WRITABLE_DATA;
+        while (!prepare_poll_ring(ring, handler_args->client_connection->fd, POLLOUT, user_data)) submit_ring(ring, 0);
+        return;
+    }
+    __atomic_sub_fetch(&reactor->shard->connections, 1, __ATOMIC_RELAXED);
+    close_connection_handler(handler_args, reactor->queue);
+}
+
+// Takes the connections handed to the shard, rearming the multishot poll of the notification if it terminated
+static void inbox_ring_reactor(Reactor *reactor, u_int32_t flags) {
+    receive_inbox_reactor(reactor);
+    if (flags & IORING_CQE_F_MORE) return;
+    while (!prepare_poll_ring(reactor->ring, reactor->shard->notify, POLLIN, REACTOR_INBOX_DATA)) {
+        submit_ring(reactor->ring, 0);
+    }
+}
+
+bool run_ring_reactor(Reactor *reactor) {
+    Ring *ring = reactor->ring;
+    struct io_uring_cqe *cqe;
+
+    if (reactor->server_connection != NULL) prepare_accept_ring(ring, reactor->server_connection->fd, 0);
+    prepare_poll_ring(ring, reactor->shard->notify, POLLIN, REACTOR_INBOX_DATA);
+
+    while (true) {
+        int32_t wait = expire_join_reactor(reactor);
+        if (wait >= 0 && !reactor->timing) {
+            reactor->timeout.tv_sec = wait / 1000;
+            reactor->timeout.tv_nsec = (wait % 1000) * 1000000;
+            reactor->timing = prepare_timeout_ring(ring, &reactor->timeout, REACTOR_TIMEOUT_DATA);
+        }
+        if (submit_ring(ring, 1) < 0) {
+            perror("io_uring_enter");
+            return false;
+        }
+
+        while ((cqe = peek_ring(ring)) != NULL) {
+            u_int64_t user_data = cqe->user_data;
+            int32_t result = cqe->res;
+            u_int32_t flags = cqe->flags;
+            advance_ring(ring);
+            __atomic_add_fetch(&reactor->shard->events, 1, __ATOMIC_RELAXED);
+
+            if (user_data == REACTOR_TIMEOUT_DATA) reactor->timing = false;
+            else if (user_data == REACTOR_REMOVE_DATA) continue;
+            else if (user_data == REACTOR_INBOX_DATA) inbox_ring_reactor(reactor, flags);
+            else if (user_data == 0) accept_ring_reactor(reactor, result, flags);
+            else if (user_data & REACTOR_WRITABLE_DATA) {
+                HandlerArgs *handler_args = (HandlerArgs *) (uintptr_t) (user_data & ~(u_int64_t) REACTOR_WRITABLE_DATA);
+                writable_ring_reactor(reactor, handler_args, result, flags);
+            } else receive_ring_reactor(reactor, (HandlerArgs *) (uintptr_t) user_data, result, flags);
+        }
+    }
+}
+
+bool run_reactor(Reactor *reactor) {
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+
+    if (reactor->ring != NULL) return run_ring_reactor(reactor);
+
+    while (true) {
+        int32_t count = epoll_wait(reactor->fd, events, REACTOR_MAX_EVENTS, expire_join_reactor(reactor));
+        if (count == -1) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            return false;
+        }
+
+        __atomic_add_fetch(&reactor->shard->events, count, __ATOMIC_RELAXED);
+        for (int32_t i = 0; i < count; ++i) {
+            if (events[i].data.u64 == REACTOR_INBOX_DATA) {
+                receive_inbox_reactor(reactor);
+                continue;
+            }
+            HandlerArgs *handler_args = events[i].data.ptr;
+            if (handler_args == NULL) {
+                accept_reactor(reactor);
+                continue;
+            }
+            if (events[i].events & EPOLLOUT) writable_connection_handler(handler_args, reactor->queue);
+            if (!(events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP))) continue;
+            if (handle_connection(handler_args, reactor->queue)) {
+                if (handler_args->joined == 0) leave_join_reactor(reactor, handler_args);
+                continue;
+            }
+
+            remove_reactor(reactor, handler_args->client_connection);
+            leave_join_reactor(reactor, handler_args);
+            __atomic_sub_fetch(&reactor->shard->connections, 1, __ATOMIC_RELAXED);
+            close_connection_handler(handler_args, reactor->queue);
+        }
+    }
+}
+
+void free_reactor(Reactor *reactor) {
+    __atomic_store_n(&reactor->shard->adopting, false, __ATOMIC_RELEASE);
+    if (reactor->ring != NULL) free_ring(reactor->ring);
+    free_shared_pool(reactor->shard->pool);
+    close(reactor->fd);
+    free(reactor);
+}
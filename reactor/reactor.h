@@ -0,0 +1,350 @@
+#ifndef SERVER_REACTOR_H
+#define SERVER_REACTOR_H
+
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include "../connection/connection.h"
+#include "../handler/handler.h"
+#include "../queue/queue.h"
+#include "../uring/uring.h"
+#include "../server/context.h"
+#include "../definitions.h"
+
+
+// Completion data of the timeout of an io_uring reactor, 0 is the accept and other values are handler arguments
+#define REACTOR_TIMEOUT_DATA 1
+// Completion data of the removal of a writability poll, which is ignored
+#define REACTOR_REMOVE_DATA 2
+// Event and completion data of the notification of connections handed to the shard
+#define REACTOR_INBOX_DATA 3
+// Flag set in the completion data of the writability poll of a client connection, handler arguments are aligned
+#define REACTOR_WRITABLE_DATA 4
+
+
+/**
+ * Structure representing an event loop multiplexing many connections on a single thread.
+ *
+ * This structure represents an edge-triggered epoll event loop. It owns the listening socket,
+ * accepts incoming connections and reads from every registered client connection, so an idle
+ * client only costs its registration instead of a dedicated thread.
+ * When built with USE_IO_URING and supported by the kernel, the reactor drives an io_uring instance instead,
+ * using a multishot accept and multishot receives into provided buffers.
+ *
+ * The structure fields are defined as follows:
+ *  - fd: The epoll file descriptor.
+ *  - server_connection: A pointer to the listening Connection, or NULL if the reactor does not accept.
+ *  - context: A pointer to the server context passed to the connection handlers.
+ *  - queue: A pointer to the Queue used to communicate with the main server thread.
+ *  - shard: A pointer to the statistics of the listener shard the reactor belongs to.
+ *  - ring: A pointer to the io_uring instance, or NULL if the reactor uses epoll.
+ *  - joining: The oldest joined client connection still waiting to be sent the recent messages.
+ *  - joining_last: The newest joined client connection still waiting to be sent the recent messages.
+ *  - timeout: The time to wait of the pending timeout of the io_uring instance.
+ *  - timing: Whether a timeout of the io_uring instance is pending.
+ *
+ * Example usage:
+ * @code
+ * Reactor *reactor = init_reactor(server_connection, context, queue, &context->shards[0]);
+ * run_reactor(reactor);
+ * free_reactor(reactor);
+ * @endcode
+ */
+typedef struct {
+    int32_t fd;
+    Connection *server_connection;
+    ServerContext *context;
+    Queue *queue;
+    Shard *shard;
+    Ring *ring;
+    HandlerArgs *joining;
+    HandlerArgs *joining_last;
+    struct __kernel_timespec timeout;
+    bool timing;
+} Reactor;
+
+
+/**
+ * Initializes a reactor and registers the listening connection in it.
+ *
+ * This function creates an epoll instance and, if a server connection is provided, registers it
+ * for edge-triggered readiness notifications, so that incoming connections are accepted by the reactor.
+ * The server connection is expected to be bound, listening and non-blocking.
+ * When built with USE_IO_URING, the function sets up an io_uring instance with provided receive buffers first,
+ * and falls back to epoll if the kernel lacks io_uring or provided buffer rings.
+ *
+ * @param server_connection A pointer to the listening Connection, or NULL.
+ * @param context A pointer to the server context passed to the connection handlers.
+ * @param queue A pointer to the Queue used to communicate with the main server thread.
+ * @param shard A pointer to the statistics of the listener shard the reactor belongs to.
+ *
+ * @return A pointer to the initialized Reactor structure if successful, otherwise NULL.
+ *
+ * The function performs the following steps:
+ * 1. Allocates memory for the Reactor structure.
+ * 2. Creates an epoll instance. If unsuccessful, prints an error message and returns NULL.
+ *    Creates the pool of receive buffers of the shard.
+ * 3. Sets up an io_uring instance if enabled and returns the reactor if it is available.
+ * 4. Registers the notification descriptor of the shard and the server connection in the epoll instance.
+ * 5. Marks the shard as taking the connections handed by other shards and returns a pointer
+ *    to the initialized Reactor structure.
+ *
+ * Example usage:
+ * @code
+ * Reactor *reactor = init_reactor(server_connection, context, queue, shard);
+ * if (reactor == NULL) {
+ *     // Handle initialization failure
+ * }
+ * @endcode
+ */
+Reactor *init_reactor(Connection *server_connection, ServerContext *context, Queue *queue, Shard *shard);
+
+
+/**
+ * Registers a non-blocking connection in the reactor.
+ *
+ * This function registers the connection for edge-triggered read and peer hang-up notifications.
+ * The provided data pointer is handed back with every event of the connection, NULL is reserved
+ * for the listening connection.
+ *
+ * @param reactor A pointer to the Reactor structure.
+ * @param connection A pointer to the Connection structure to be registered.
+ * @param data A pointer returned with the events of the connection.
+ *
+ * @return true if the connection is successfully registered, otherwise false.
+ *
+ * Example usage:
+ * @code
+ * if (!add_reactor(reactor, client_connection, handler_args)) {
+ *     close_connection(client_connection);
+ * }
+ * @endcode
+ */
+bool add_reactor(Reactor *reactor, Connection *connection, void *data);
+
+
+/**
+ * Unregisters a connection from the reactor.
+ *
+ * @param reactor A pointer to the Reactor structure.
+ * @param connection A pointer to the Connection structure to be unregistered.
+ *
+ * @return true if the connection is successfully unregistered, otherwise false.
+ *
+ * Example usage:
+ * @code
+ * remove_reactor(reactor, client_connection);
+ * @endcode
+ */
+bool remove_reactor(Reactor *reactor, Connection *connection);
+
+
+/**
+ * Adds a freshly accepted client connection to the connections waiting to be sent the recent messages.
+ *
+ * @param reactor A pointer to the Reactor structure.
+ * @param handler_args A pointer to the HandlerArgs structure of the client connection.
+ *
+ * Example usage:
+ * @code
+ * wait_join_reactor(reactor, handler_args);
+ * @endcode
+ */
+void wait_join_reactor(Reactor *reactor, HandlerArgs *handler_args);
+
+
+/**
+ * Removes a client connection from the connections waiting to be sent the recent messages.
+ *
+ * Does nothing if the connection is not waiting, it is called after every event of a connection
+ * that is no longer waiting and before the connection is released.
+ *
+ * @param reactor A pointer to the Reactor structure.
+ * @param handler_args A pointer to the HandlerArgs structure of the client connection.
+ */
+void leave_join_reactor(Reactor *reactor, HandlerArgs *handler_args);
+
+
+/**
+ * Sends the recent messages to the client connections that have waited RESUME_WAIT milliseconds.
+ *
+ * Nothing waits on the clients: the history of each of them is written through its outbound queue,
+ * bounded by the outbound limit and policy set when it was accepted, so a burst of joiners that do not read
+ * costs the reactor a write each and what their sockets do not take is sent as they become writable.
+ *
+ * @param reactor A pointer to the Reactor structure.
+ *
+ * @return The number of milliseconds until the next connection is done waiting, -1 if none is waiting.
+ *
+ * The function performs the following steps:
+ * 1. Takes the oldest waiting connection, connections are kept in the order they joined.
+ * 2. If it has waited RESUME_WAIT milliseconds, removes it, sends it the recent messages and announces it
+ *    using the join_connection_handler function, then continues with the next one.
+ * 3. Otherwise returns the time left until it is done waiting.
+ *
+ * Example usage:
+ * @code
+ * int32_t count = epoll_wait(reactor->fd, events, REACTOR_MAX_EVENTS, expire_join_reactor(reactor));
+ * @endcode
+ */
+int32_t expire_join_reactor(Reactor *reactor);
+
+
+/**
+ * Accepts every pending connection on the listening connection of the reactor.
+ *
+ * As readiness of the listening socket is reported in edge-triggered mode, this function
+ * accepts connections until the backlog is drained.
+ *
+ * @param reactor A pointer to the Reactor structure.
+ *
+ * The function performs the following steps:
+ * 1. Accepts a pending connection. If there is none left, returns.
+ * 2. If another shard has LISTENER_HANDOFF_MARGIN connections fewer than the shard of the reactor,
+ *    hands the connection to the least loaded one and continues with the next one.
+ * 3. Allocates the handler arguments and registers the client connection in the reactor.
+ *    If unsuccessful, closes the client connection and continues with the next one.
+ * 4. Lets the new connection wait for the recent messages using the wait_join_reactor function.
+ *
+ * Example usage:
+ * @code
+ * accept_reactor(reactor);
+ * @endcode
+ */
+void accept_reactor(Reactor *reactor);
+
+
+/**
+ * Takes the client connections other shards have handed to the shard of the reactor.
+ *
+ * Called when the notification descriptor of the shard is readable, the connections are registered
+ * in the reactor like the ones it accepts itself.
+ *
+ * @param reactor A pointer to the Reactor structure.
+ *
+ * The function performs the following steps:
+ * 1. Resets the notification counter, so a connection handed afterwards notifies the reactor again.
+ * 2. Takes the whole inbox of the shard under its lock.
+ * 3. Registers every connection of the inbox and lets it wait for the recent messages.
+ *
+ * Example usage:
+ * @code
+ * if (events[i].data.u64 == REACTOR_INBOX_DATA) receive_inbox_reactor(reactor);
+ * @endcode
+ */
+void receive_inbox_reactor(Reactor *reactor);
+
+
+/**
+ * Handles a completion of the multishot accept of an io_uring reactor.
+ *
+ * @param reactor A pointer to the Reactor structure.
+ * @param result The accepted socket file descriptor, or a negative error code.
+ * @param flags The completion flags.
+ *
+ * The function performs the following steps:
+ * 1. Rearms the multishot accept if the kernel terminated it.
+ * 2. Populates the client connection from the accepted socket, and hands it to the least loaded shard
+ *    if it has LISTENER_HANDOFF_MARGIN connections fewer than the shard of the reactor.
+ * 3. Otherwise allocates the handler arguments and starts a multishot receive and a multishot writability poll
+ *    on the client connection.
+ * 4. Lets the new connection wait for the recent messages using the wait_join_reactor function.
+ */
+void accept_ring_reactor(Reactor *reactor, int32_t result, u_int32_t flags);
+
+
+/**
+ * Handles a completion of the multishot receive of a client connection of an io_uring reactor.
+ *
+ * @param reactor A pointer to the Reactor structure.
+ * @param handler_args A pointer to the HandlerArgs structure of the client connection.
+ * @param result The number of received bytes, 0 if the peer closed the connection, or a negative error code.
+ * @param flags The completion flags, carrying the id of the provided buffer holding the data.
+ *
+ * The function performs the following steps:
+ * 1. Passes the received data to the receive_connection_handler function and recycles the provided buffer.
+ * 2. If the multishot receive terminated because the provided buffers ran out, rearms it.
+ * 3. If the peer closed the connection or an error occurred, marks the connection as closing
+ *    and cancels its writability poll, the connection is released once the poll completes.
+ */
+void receive_ring_reactor(Reactor *reactor, HandlerArgs *handler_args, int32_t result, u_int32_t flags);
+
+
+/**
+ * Handles a completion of the multishot writability poll of a client connection of an io_uring reactor.
+ *
+ * @param reactor A pointer to the Reactor structure.
+ * @param handler_args A pointer to the HandlerArgs structure of the client connection.
+ * @param result The mask of the reported poll events, or a negative error code.
+ * @param flags The completion flags.
+ *
+ * The function performs the following steps:
+ * 1. Passes a writability event to the writable_connection_handler function.
+ * 2. If the poll terminated while the connection is alive, rearms it.
+ * 3. If the poll terminated after the peer closed the connection, releases the connection
+ *    using the close_connection_handler function.
+ */
+void writable_ring_reactor(Reactor *reactor, HandlerArgs *handler_args, int32_t result, u_int32_t flags);
+
+
+/**
+ * Runs the io_uring event loop of the reactor.
+ *
+ * This function arms the multishot accept, then submits pending requests and waits for completions
+ * with a single io_uring_enter call per iteration, dispatching every completion to
+ * the accept_ring_reactor, receive_ring_reactor or writable_ring_reactor function. While connections wait for the recent messages,
+ * a timeout is kept pending to wake the loop when the oldest one is done waiting.
+ *
+ * @param reactor A pointer to the Reactor structure.
+ *
+ * @return false if submitting to the ring fails, the function does not return otherwise.
+ */
+bool run_ring_reactor(Reactor *reactor);
+
+
+/**
+ * Runs the event loop of the reactor.
+ *
+ * This function waits for readiness events and dispatches them: events of the listening connection
+ * accept new clients, readability events of client connections are passed to the handle_connection function
+ * and writability events to the writable_connection_handler function.
+ * Connections closed by their peers are unregistered and released using the close_connection_handler function.
+ * Waiting for events times out when the oldest connection waiting for the recent messages is done waiting.
+ * Reactors driving an io_uring instance run the run_ring_reactor function instead.
+ *
+ * @param reactor A pointer to the Reactor structure.
+ *
+ * @return false if waiting for events fails, the function does not return otherwise.
+ *
+ * Example usage:
+ * @code
+ * if (!run_reactor(reactor)) {
+ *     // Event loop failed
+ * }
+ * @endcode
+ */
+bool run_reactor(Reactor *reactor);
+
+
+/**
+ * Frees the memory allocated for the reactor and the pool of receive buffers of its shard,
+ * and closes its epoll and io_uring instances.
+ *
+ * The registered connections are not closed by this function.
+ *
+ * @param reactor A pointer to the Reactor structure to be freed.
+ *
+ * Example usage:
+ * @code
+ * free_reactor(reactor);
+ * @endcode
+ */
+void free_reactor(Reactor *reactor);
+
+
+#endif //SERVER_REACTOR_H
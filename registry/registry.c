@@ -0,0 +1,102 @@
+#include "registry.h"
+
+
+static bool grow_slots_registry(Registry *registry, int32_t fd) {
+    size_t capacity = registry->slot_capacity;
+    while (capacity <= (size_t) fd) capacity *= 2;
+    if (capacity == registry->slot_capacity) return true;
+
+    u_int32_t *slots = realloc(registry->slots, capacity * sizeof(u_int32_t));
+    if (slots == NULL) return false;
+    for (size_t i = registry->slot_capacity; i < capacity; ++i) slots[i] = REGISTRY_NO_SLOT;
+    registry->slots = slots;
+    registry->slot_capacity = capacity;
+    return true;
+}
+
+static bool grow_connections_registry(Registry *registry) {
+    if (registry->count < registry->capacity) return true;
+
+    Connection **connections = realloc(registry->connections, registry->capacity * 2 * sizeof(Connection *));
+    if (connections == NULL) return false;
+    registry->connections = connections;
+    registry->capacity *= 2;
+    return true;
+}
+
+Registry *init_registry(size_t capacity) {
+    if (capacity == 0) capacity = 1;
+
+    Registry *registry = malloc(sizeof(Registry));
+    if (registry == NULL) return NULL;
+
+    registry->connections = malloc(capacity * sizeof(Connection *));
+    registry->slots = malloc(capacity * sizeof(u_int32_t));
+    registry->names = init_name_table(capacity);
+    if (registry->connections == NULL || registry->slots == NULL || registry->names == NULL) {
+        free(registry->connections);
+        free(registry->slots);
+        if (registry->names != NULL) free_name_table(registry->names);
+        free(registry);
+        return NULL;
+    }
+    for (size_t i = 0; i < capacity; ++i) registry->slots[i] = REGISTRY_NO_SLOT;
+    registry->count = 0;
+    registry->capacity = capacity;
+    registry->slot_capacity = capacity;
+
+    return registry;
+}
+
+bool add_registry(Registry *registry, Connection *connection) {
+    if (connection->fd < 0 || find_registry(registry, connection->fd) != NULL) return false;
+    if (find_name_registry(registry, connection->name) != NULL) return false;
+    if (!grow_slots_registry(registry, connection->fd) || !grow_connections_registry(registry)) return false;
+    if (!set_name_table(registry->names, connection->name, connection)) return false;
+
+    registry->slots[connection->fd] = registry->count;
+    registry->connections[registry->count++] = connection;
+    return true;
+}
+
+bool remove_registry(Registry *registry, Connection *connection) {
+    u_int32_t slot = slot_registry(registry, connection);
+    if (slot == REGISTRY_NO_SLOT) return false;
+
+    Connection *last = registry->connections[--registry->count];
+    registry->connections[slot] = last;
+    registry->slots[last->fd] = slot;
+    registry->slots[connection->fd] = REGISTRY_NO_SLOT;
+
+    clear_name_table(registry->names, connection->name);
+    return true;
+}
+
+u_int32_t slot_registry(Registry *registry, Connection *connection) {
+    if (connection->fd < 0 || (size_t) connection->fd >= registry->slot_capacity) return REGISTRY_NO_SLOT;
+
+    // The descriptor may already belong to a newer connection
+    u_int32_t slot = registry->slots[connection->fd];
+    if (slot == REGISTRY_NO_SLOT || registry->connections[slot] != connection) return REGISTRY_NO_SLOT;
+    return slot;
+}
+
+Connection *find_registry(Registry *registry, int32_t fd) {
+    if (fd < 0 || (size_t) fd >= registry->slot_capacity) return NULL;
+
+    u_int32_t slot = registry->slots[fd];
+    return slot == REGISTRY_NO_SLOT ? NULL : registry->connections[slot];
+}
+
+Connection *find_name_registry(Registry *registry, u_int64_t name) {
+    void *connection;
+    get_name_table(registry->names, name, &connection);
+    return connection;
+}
+
+void free_registry(Registry *registry) {
+    free_name_table(registry->names);
+    free(registry->slots);
+    free(registry->connections);
+    free(registry);
+}
@@ -0,0 +1,194 @@
+#ifndef SERVER_REGISTRY_H
+#define SERVER_REGISTRY_H
+
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../connection/connection.h"
+#include "../hash_table/int_table.h"
+#include "../definitions.h"
+
+
+// Marks a file descriptor without a live connection in the slot index of a registry
+#define REGISTRY_NO_SLOT UINT32_MAX
+
+
+/**
+ * Structure representing the registry of live client connections.
+ *
+ * Live connections are kept packed at the start of a contiguous array, so a broadcast
+ * touches only live entries in memory order, whatever the number of connections served before.
+ * A connection is removed by moving the last one into its slot.
+ *
+ * The structure fields are defined as follows:
+ *  - connections: The array of pointers to the live connections, the first count entries are used.
+ *  - count: The number of live connections.
+ *  - capacity: The number of entries allocated in the connections array.
+ *  - slots: The index from file descriptors to slots of the connections array,
+ *    REGISTRY_NO_SLOT for descriptors without a live connection.
+ *  - slot_capacity: The number of file descriptors covered by the slots index.
+ *  - names: The table from connection names to connections.
+ *
+ * Example usage:
+ * @code
+ * Registry *registry = init_registry(SOCKET_MAX_CONNECTIONS);
+ * for (size_t i = 0; i < registry->count; ++i) {
+ *     Connection *connection = registry->connections[i];
+ * }
+ * @endcode
+ */
+typedef struct {
+    Connection **connections;
+    size_t count;
+    size_t capacity;
+    u_int32_t *slots;
+    size_t slot_capacity;
+    NameTable *names;
+} Registry;
+
+
+/**
+ * Initializes a registry of connections with the specified initial capacity.
+ *
+ * @param capacity The number of connections the registry holds before growing.
+ *
+ * @return A pointer to the initialized registry, or NULL if memory allocation fails.
+ *
+ * The function performs the following steps:
+ * 1. Allocates memory for the Registry structure.
+ * 2. Allocates the connections array and the slot index for the specified capacity.
+ * 3. Initializes the table of connection names.
+ * 4. Returns a pointer to the initialized registry if successful, or NULL if memory allocation fails.
+ *
+ * Example usage:
+ * @code
+ * Registry *registry = init_registry(SOCKET_MAX_CONNECTIONS);
+ * if (registry == NULL) {
+ *     // Error: Failed to initialize the registry.
+ * }
+ * @endcode
+ */
+Registry *init_registry(size_t capacity);
+
+
+/**
+ * Adds a connection to the registry.
+ *
+ * The connection is appended after the live connections and indexed by its file descriptor and name.
+ * The connection must stay allocated until it is removed from the registry.
+ *
+ * @param registry A pointer to the Registry structure.
+ * @param connection A pointer to the Connection structure to be added.
+ *
+ * @return true if the connection is added, false if a live connection already uses its file descriptor
+ * or its name, or if the registry cannot grow.
+ *
+ * The function performs the following steps:
+ * 1. Grows the connections array and the slot index if they are full.
+ * 2. Stores the connection in the first free slot and records the slot for its file descriptor.
+ * 3. Indexes the connection by its name.
+ *
+ * Example usage:
+ * @code
+ * Registry *registry;
+ * Connection *connection;
+ * if (!add_registry(registry, connection)) {
+ *     // Error: Failed to register the connection.
+ * }
+ * @endcode
+ */
+bool add_registry(Registry *registry, Connection *connection);
+
+
+/**
+ * Removes a connection from the registry.
+ *
+ * The last live connection is moved into the slot of the removed one,
+ * so the order of the connections array changes.
+ *
+ * @param registry A pointer to the Registry structure.
+ * @param connection A pointer to the Connection structure to be removed.
+ *
+ * @return true if the connection is removed, false if it is not registered.
+ *
+ * Example usage:
+ * @code
+ * Registry *registry;
+ * Connection *connection;
+ * remove_registry(registry, connection);
+ * @endcode
+ */
+bool remove_registry(Registry *registry, Connection *connection);
+
+
+/**
+ * Returns the slot of a connection in the connections array of the registry.
+ *
+ * @param registry A pointer to the Registry structure.
+ * @param connection A pointer to the Connection structure.
+ *
+ * @return The index of the connection in the connections array,
+ * or REGISTRY_NO_SLOT if the connection is not registered.
+ *
+ * Example usage:
+ * @code
+ * Registry *registry;
+ * Connection *connection;
+ * u_int32_t slot = slot_registry(registry, connection);
+ * @endcode
+ */
+u_int32_t slot_registry(Registry *registry, Connection *connection);
+
+
+/**
+ * Finds the live connection with the specified file descriptor.
+ *
+ * @param registry A pointer to the Registry structure.
+ * @param fd The file descriptor of the connection.
+ *
+ * @return A pointer to the connection, or NULL if no live connection uses the file descriptor.
+ *
+ * Example usage:
+ * @code
+ * Registry *registry;
+ * Connection *connection = find_registry(registry, fd);
+ * @endcode
+ */
+Connection *find_registry(Registry *registry, int32_t fd);
+
+
+/**
+ * Finds the live connection with the specified name.
+ *
+ * @param registry A pointer to the Registry structure.
+ * @param name The name of the connection.
+ *
+ * @return A pointer to the connection, or NULL if no live connection has the name.
+ *
+ * Example usage:
+ * @code
+ * Registry *registry;
+ * Connection *connection = find_name_registry(registry, 0xedd339ed1620);
+ * @endcode
+ */
+Connection *find_name_registry(Registry *registry, u_int64_t name);
+
+
+/**
+ * Frees the memory allocated for the registry.
+ *
+ * The registered connections themselves are not freed.
+ *
+ * @param registry A pointer to the Registry structure to be freed.
+ *
+ * Example usage:
+ * @code
+ * Registry *registry;
+ * free_registry(registry);
+ * @endcode
+ */
+void free_registry(Registry *registry);
+
+
+#endif //SERVER_REGISTRY_H
@@ -7,24 +7,148 @@ ServerContext *initialize_server_context() {
         return NULL;
     }
 
-    KVTable *connections = init_table(SOCKET_MAX_CONNECTIONS);
+    Registry *connections = init_registry(SOCKET_MAX_CONNECTIONS);
     if (connections == NULL) {
-        printf("Cannot allocate table connections\n");
+        printf("Cannot allocate connection registry\n");
         return NULL;
     }
-    RecentMessages *recent_messages = init_recent_messages(RECENT_MESSAGES_SIZE);
+    size_t history_size = RECENT_MESSAGES_SIZE;
+    char *history_setting = getenv(RECENT_MESSAGES_SIZE_VARIABLE);
+    if (history_setting != NULL) {
+        history_size = strtoul(history_setting, NULL, 10);
+        if (history_size == 0 || history_size > RECENT_MESSAGES_MAX_SIZE) {
+            printf("Invalid %s, expected 1 to %d messages\n", RECENT_MESSAGES_SIZE_VARIABLE, RECENT_MESSAGES_MAX_SIZE);
+            return NULL;
+        }
+    }
+    size_t line_limit = MESSAGE_LINE_LIMIT;
+    char *line_setting = getenv(MESSAGE_LINE_LIMIT_VARIABLE);
+    if (line_setting != NULL) {
+        line_limit = strtoul(line_setting, NULL, 10);
+        if (line_limit == 0 || line_limit > MESSAGE_LINE_LIMIT) {
+            printf("Invalid %s, expected 1 to %d bytes\n", MESSAGE_LINE_LIMIT_VARIABLE, MESSAGE_LINE_LIMIT);
+            return NULL;
+        }
+    }
+    size_t outbound_limit = OUTBOUND_LIMIT;
+    char *limit_setting = getenv(OUTBOUND_LIMIT_VARIABLE);
+    if (limit_setting != NULL) {
+        outbound_limit = strtoul(limit_setting, NULL, 10);
+        if (outbound_limit < MESSAGE_SIZE) {
+            printf("Invalid %s, expected at least %d bytes\n", OUTBOUND_LIMIT_VARIABLE, MESSAGE_SIZE);
+            return NULL;
+        }
+    }
+    OutboundPolicy outbound_policy = OUTBOUND_POLICY;
+    char *policy_setting = getenv(OUTBOUND_POLICY_VARIABLE);
+    if (policy_setting != NULL) {
+        if (strcmp(policy_setting, "oldest") == 0) outbound_policy = OUTBOUND_DROP_OLDEST;
+        else if (strcmp(policy_setting, "newest") == 0) outbound_policy = OUTBOUND_DROP_NEWEST;
+        else if (strcmp(policy_setting, "disconnect") == 0) outbound_policy = OUTBOUND_DISCONNECT;
+        else {
+            printf("Invalid %s, expected oldest, newest or disconnect\n", OUTBOUND_POLICY_VARIABLE);
+            return NULL;
+        }
+    }
+    int64_t shard_count = LISTENER_SHARDS;
+    char *shard_setting = getenv(LISTENER_SHARDS_VARIABLE);
+    if (shard_setting != NULL) {
+        char *end;
+        shard_count = strtol(shard_setting, &end, 10);
+        if (end == shard_setting || shard_count < 0 || shard_count > LISTENER_SHARDS_MAX) {
+            printf("Invalid %s, expected 0 to %d shards\n", LISTENER_SHARDS_VARIABLE, LISTENER_SHARDS_MAX);
+            return NULL;
+        }
+    }
+    int64_t fanout_count = FANOUT_SHARDS;
+    char *fanout_setting = getenv(FANOUT_SHARDS_VARIABLE);
+    if (fanout_setting != NULL) {
+        char *end;
+        fanout_count = strtol(fanout_setting, &end, 10);
+        if (end == fanout_setting || fanout_count < 0 || fanout_count > FANOUT_SHARDS_MAX) {
+            printf("Invalid %s, expected 0 to %d shards\n", FANOUT_SHARDS_VARIABLE, FANOUT_SHARDS_MAX);
+            return NULL;
+        }
+    }
+    RecentMessages *recent_messages = init_recent_messages(history_size);
     if (recent_messages == NULL) {
         printf("Cannot allocate message buffer\n");
         return NULL;
     }
+    Journal *journal = NULL;
+    char *journal_directory = getenv(JOURNAL_DIRECTORY_VARIABLE);
+    if (journal_directory == NULL) journal_directory = JOURNAL_DIRECTORY;
+    if (journal_directory[0] != '\0') {
+        journal = init_journal(journal_directory);
+        if (journal == NULL) {
+            printf("Cannot open journal in %s\n", journal_directory);
+            return NULL;
+        }
+        printf("Restored %lu messages from journal\n", restore_journal(journal, recent_messages));
+    }
 
     ServerContext *context = (ServerContext *) malloc(sizeof(ServerContext));
     if (context == NULL) {
         printf("Cannot allocate server context\n");
+        if (journal != NULL) free_journal(journal);
+        free_recent_messages(recent_messages);
+        free_registry(connections);
+        return NULL;
     }
 
     context->connections = connections;
     context->recent_messages = recent_messages;
+    context->journal = journal;
+    if (fanout_count == 0) fanout_count = sysconf(_SC_NPROCESSORS_ONLN);
+    context->fanout = init_fanout(fanout_count > 0 ? fanout_count : 1);
+    if (context->fanout == NULL) {
+        printf("Cannot start fan-out shards\n");
+        return NULL;
+    }
+    context->rings = calloc(context->fanout->count, sizeof(Ring *));
+    if (context->rings == NULL) {
+        printf("Cannot allocate fan-out rings\n");
+        return NULL;
+    }
+#ifdef USE_IO_URING
+    for (u_int32_t i = 0; i < context->fanout->count; ++i) context->rings[i] = init_ring(SERVER_RING_ENTRIES);
+#endif
+
+    if (shard_count == 0) shard_count = sysconf(_SC_NPROCESSORS_ONLN);
+    context->shard_count = shard_count > 0 ? shard_count : 1;
+    context->shards = calloc(context->shard_count, sizeof(Shard));
+    if (context->shards == NULL) {
+        printf("Cannot allocate listener shards\n");
+        return NULL;
+    }
+    for (u_int32_t i = 0; i < context->shard_count; ++i) {
+        Shard *shard = &context->shards[i];
+        shard->index = i;
+        shard->notify = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (shard->notify < 0) {
+            printf("Cannot create shard notification\n");
+            return NULL;
+        }
+        pthread_mutex_init(&shard->lock, NULL);
+    }
+    context->listening = 0;
+    context->pool = init_shared_pool();
+    if (context->pool == NULL) {
+        printf("Cannot allocate broadcast buffer pool\n");
+        return NULL;
+    }
+    context->connection_pool = init_object_pool("connections", sizeof(Connection));
+    context->handler_pool = NULL;
+    context->message_pool = init_object_pool("messages", OBJECT_MESSAGE_SIZE);
+    if (context->connection_pool == NULL || context->message_pool == NULL) {
+        printf("Cannot allocate object pools\n");
+        return NULL;
+    }
+    context->line_limit = line_limit;
+    context->outbound_limit = outbound_limit;
+    context->outbound_policy = outbound_policy;
+    context->dropped = 0;
+    context->evictions = 0;
 
     return context;
 }
@@ -32,6 +156,28 @@ ServerContext *initialize_server_context() {
 
 void free_server_context(ServerContext *context) {
     free_recent_messages(context->recent_messages);
-    free_table(context->connections);
+    if (context->journal != NULL) free_journal(context->journal);
+    free_registry(context->connections);
+    for (u_int32_t i = 0; i < context->fanout->count; ++i) {
+        if (context->rings[i] != NULL) free_ring(context->rings[i]);
+    }
+    free(context->rings);
+    free_fanout(context->fanout);
+    for (u_int32_t i = 0; i < context->shard_count; ++i) {
+        Shard *shard = &context->shards[i];
+        // Connections handed to a shard whose reactor has stopped are never announced
+        for (u_int32_t j = 0; j < shard->inbox_count; ++j) {
+            close_connection(shard->inbox[j]);
+            release_object(shard->inbox[j]);
+        }
+        free(shard->inbox);
+        pthread_mutex_destroy(&shard->lock);
+        close(shard->notify);
+    }
+    free(context->shards);
+    free_shared_pool(context->pool);
+    free_object_pool(context->connection_pool);
+    if (context->handler_pool != NULL) free_object_pool(context->handler_pool);
+    free_object_pool(context->message_pool);
     free(context);
 }
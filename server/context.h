@@ -2,10 +2,64 @@
 #define SERVER_CONTEXT_H
 
 
+#include <pthread.h>
+#include <sys/eventfd.h>
 #include "../definitions.h"
 #include "../queue/queue.h"
-#include "../hash_table/table.h"
+#include "../registry/registry.h"
 #include "../circular_buffer/recent_messages.h"
+#include "../journal/journal.h"
+#include "../uring/uring.h"
+#include "../fanout/fanout.h"
+
+
+/**
+ * Structure representing the statistics of a listener shard.
+ *
+ * Every listener shard owns its listening socket, reactor and set of client connections.
+ * The kernel spreads new connections across the listening sockets, and a shard accepting a connection
+ * while another one has LISTENER_HANDOFF_MARGIN fewer connections hands it over to the least loaded one
+ * through the inbox of that shard, waking its reactor with the notification descriptor.
+ * The counters are updated by the shard and can be read from any thread.
+ *
+ * The structure fields are defined as follows:
+ *  - index: The index of the shard.
+ *  - connections: The number of client connections currently handled by the shard.
+ *  - accepted: The number of client connections accepted by the shard so far, including the ones handed over.
+ *  - handed: The number of client connections accepted by the shard and handed to another shard so far.
+ *  - events: The number of readiness events and completions handled by the reactor of the shard so far.
+ *  - received: The number of bytes received from the client connections of the shard so far.
+ *  - receive_bytes: The number of bytes of the receive buffers attached to the client connections of the shard.
+ *  - pool: A pointer to the SharedPool the receive buffers of the shard are taken from,
+ *    only used by the thread of the shard.
+ *  - notify: The eventfd descriptor the reactor of the shard is woken with when connections are handed to it.
+ *  - lock: The mutex protecting the inbox.
+ *  - inbox: The array of client connections handed to the shard and not yet taken by its reactor.
+ *  - inbox_count: The number of connections in the inbox.
+ *  - inbox_capacity: The number of entries allocated in the inbox.
+ *  - adopting: Whether the reactor of the shard is running and takes the connections handed to it.
+ *
+ * Example usage:
+ * @code
+ * u_int32_t connections = __atomic_load_n(&context->shards[0].connections, __ATOMIC_RELAXED);
+ * @endcode
+ */
+typedef struct {
+    u_int32_t index;
+    u_int32_t connections;
+    u_int64_t accepted;
+    u_int64_t events;
+    u_int64_t received;
+    u_int64_t receive_bytes;
+    u_int64_t handed;
+    SharedPool *pool;
+    int32_t notify;
+    pthread_mutex_t lock;
+    Connection **inbox;
+    u_int32_t inbox_count;
+    u_int32_t inbox_capacity;
+    bool adopting;
+} Shard;
 
 
 /**
@@ -15,37 +69,81 @@
  * and recent messages handled by the server.
  *
  * The structure fields are defined as follows:
- *  - connections: A pointer to the KVTable structure representing the key-value table of connections.
+ *  - connections: A pointer to the Registry structure holding the live client connections.
  *  - recent_messages: A pointer to the RecentMessages structure representing the buffer of recent messages.
+ *  - journal: A pointer to the Journal structure persisting the recent messages, or NULL if it is disabled.
+ *  - fanout: A pointer to the Fanout structure delivering broadcasts to the client connections in parallel.
+ *  - rings: An array of pointers to the io_uring instances used to batch broadcast sends, one per fan-out shard,
+ *    with NULL entries for shards sending with plain sockets.
+ *  - shards: An array of Shard structures, one per listener shard.
+ *  - shard_count: The number of listener shards.
+ *  - listening: The number of listener shards currently accepting connections.
+ *  - pool: A pointer to the SharedPool holding the buffers of broadcast messages.
+ *  - connection_pool: A pointer to the ObjectPool the client connections are taken from.
+ *  - handler_pool: A pointer to the ObjectPool the handler arguments of the reactors are taken from,
+ *    initialized by the server along with the reactors.
+ *  - message_pool: A pointer to the ObjectPool the payloads of received messages are taken from.
+ *  - line_limit: The number of bytes of a received line kept as a message.
+ *  - outbound_limit: The number of bytes a client connection may have waiting to be sent.
+ *  - outbound_policy: The policy applied to a client connection exceeding the outbound limit.
+ *  - dropped: The number of messages dropped for closed client connections exceeding the outbound limit.
+ *  - evictions: The number of client connections disconnected for exceeding the outbound limit.
  *
  * Example usage:
  * @code
  * ServerContext server_ctx;
- * server_ctx.connections = init_table(CONNECTIONS_TABLE_SIZE);
+ * server_ctx.connections = init_registry(SOCKET_MAX_CONNECTIONS);
  * server_ctx.recent_messages = init_recent_messages(RECENT_MESSAGES_SIZE);
  * @endcode
  */
 typedef struct {
-    KVTable *connections;
+    Registry *connections;
     RecentMessages *recent_messages;
+    Journal *journal;
+    Fanout *fanout;
+    Ring **rings;
+    Shard *shards;
+    u_int32_t shard_count;
+    u_int32_t listening;
+    SharedPool *pool;
+    ObjectPool *connection_pool;
+    ObjectPool *handler_pool;
+    ObjectPool *message_pool;
+    size_t line_limit;
+    size_t outbound_limit;
+    OutboundPolicy outbound_policy;
+    u_int64_t dropped;
+    u_int64_t evictions;
 } ServerContext;
 
 
 /**
  * Initializes the server context.
  *
- * This function creates and initializes the server context, including the key-value table of connections
+ * This function creates and initializes the server context, including the registry of connections
  * and the buffer of recent messages. It also creates a message queue for communication.
  *
  * @return A pointer to the initialized ServerContext structure if successful, otherwise NULL.
  *
  * The function performs the following steps:
  * 1. Attempts to create a message queue for communication. If unsuccessful, prints an error message and returns NULL.
- * 2. Initializes a key-value table for connections with a specified maximum capacity. If allocation fails, prints an error message and returns NULL.
- * 3. Initializes a buffer for recent messages with a specified size. If allocation fails, prints an error message and returns NULL.
- * 4. Allocates memory for the ServerContext structure. If allocation fails, prints an error message and returns NULL.
- * 5. Populates the ServerContext structure with the initialized connections table and recent messages buffer.
- * 6. Returns a pointer to the initialized ServerContext structure.
+ * 2. Initializes a registry of connections with a specified initial capacity, the registry grows as needed. If allocation fails, prints an error message and returns NULL.
+ * 3. Initializes a buffer for recent messages holding RECENT_MESSAGES_SIZE messages, or the number set in the
+ *    RECENT_MESSAGES_SIZE_VARIABLE environment variable. If the setting is invalid or allocation fails,
+ *    prints an error message and returns NULL.
+ * 4. Opens the journal in the directory set in the JOURNAL_DIRECTORY_VARIABLE environment variable, or in
+ *    JOURNAL_DIRECTORY, unless it is empty as it is by default, and fills the buffer of recent messages
+ *    with its newest messages.
+ *    If the journal cannot be opened, prints an error message and returns NULL.
+ * 5. Allocates memory for the ServerContext structure. If allocation fails, prints an error message and returns NULL.
+ * 6. Populates the ServerContext structure with the initialized connections registry and recent messages buffer.
+ * 7. Starts FANOUT_SHARDS fan-out shards, or the number set in the FANOUT_SHARDS_VARIABLE environment variable,
+ *    one per online CPU if it is 0, and sets up an io_uring instance per shard for broadcasts if built
+ *    with USE_IO_URING and supported by the kernel.
+ *    Allocates the statistics of LISTENER_SHARDS listener shards, or the number set in the LISTENER_SHARDS_VARIABLE
+ *    environment variable, one shard per online CPU if it is 0.
+ *    Initializes the pools of broadcast buffers, client connections and message payloads.
+ * 8. Returns a pointer to the initialized ServerContext structure.
  *
  * Example usage:
  * @code
@@ -64,14 +162,17 @@ ServerContext *initialize_server_context();
  * Frees the memory allocated for the server context.
  *
  * This function deallocates the memory associated with the server context, including
- * the key-value table of connections and the buffer of recent messages.
+ * the registry of connections and the buffer of recent messages.
  *
  * @param context A pointer to the ServerContext structure to be freed.
  *
  * The function performs the following steps:
- * 1. Frees the memory allocated for the buffer of recent messages using the free_recent_messages function.
- * 2. Frees the memory allocated for the key-value table of connections using the free_table function.
- * 3. Frees the memory allocated for the ServerContext structure itself.
+ * 1. Frees the memory allocated for the buffer of recent messages using the free_recent_messages function
+ *    and writes the pending messages of the journal to disk before closing it.
+ * 2. Frees the memory allocated for the registry of connections using the free_registry function.
+ * 3. Stops the fan-out shards, frees the io_uring instances that were set up, the listener shard statistics
+ *    and the pools.
+ * 4. Frees the memory allocated for the ServerContext structure itself.
  *
  * Example usage:
  * @code
@@ -1,101 +1,358 @@
 #include "server.h"
 
 
-void server_broadcast_message(char *buffer, QMessage *q_message, ServerContext *context, bool send_to_author) {
-    for (size_t i = 0; i < context->connections->size; ++i) {
-        Connection *client_connection = context->connections->storage[i].value;
-        if (client_connection == NULL) continue;
-        if (client_connection == q_message->connection && !send_to_author) continue;
+void server_send_connections(
+        Ring *ring,
+        Connection **connections,
+        size_t count,
+        SharedBuffer *buffer,
+        size_t offset,
+        size_t size) {
+    if (count == 0) return;
+    if (ring != NULL) {
+        send_batch_ring(ring, connections, count, buffer, offset, size);
+        return;
+    }
+    for (size_t i = 0; i < count; ++i) write_shared_connection(connections[i], buffer, offset, size);
+}
+
+void server_deliver_shard(void *argument, u_int32_t index, u_int32_t count) {
+    BroadcastDelivery *delivery = argument;
+    BroadcastBatch *batch = delivery->batch;
+    Registry *registry = delivery->context->connections;
+    Ring *ring = delivery->context->rings[index];
+    u_int32_t last = (u_int64_t) registry->count * (index + 1) / count;
+    u_int32_t start = (u_int64_t) registry->count * index / count;
+
+    // Connections between two authors get the whole batch, authors only the runs between their own messages
+    for (size_t i = 0; start < last; ++i) {
+        u_int32_t slot = i < delivery->author_count && delivery->authors[i] < last ? delivery->authors[i] : last;
+        if (slot < start) continue;
+        server_send_connections(ring, registry->connections + start, slot - start, batch->buffer, 0, batch->size);
+        if (slot == last) break;
+
+        Connection *author = registry->connections[slot];
+        size_t offset = 0;
+        for (size_t j = 0; j < batch->count; ++j) {
+            if (batch->authors[j] != slot) continue;
+            if (batch->offsets[j] > offset) write_shared_connection(author, batch->buffer, offset, batch->offsets[j] - offset);
+            offset = batch->offsets[j + 1];
+        }
+        if (batch->size > offset) write_shared_connection(author, batch->buffer, offset, batch->size - offset);
+        start = slot + 1;
+    }
+}
+
+int server_compare_slots(const void *first, const void *second) {
+    u_int32_t a = *(const u_int32_t *) first;
+    u_int32_t b = *(const u_int32_t *) second;
+    return (a > b) - (a < b);
+}
+
+void server_deliver_batch(BroadcastBatch *batch, ServerContext *context) {
+    BroadcastDelivery delivery = {.context = context, .batch = batch, .author_count = 0};
+
+    for (size_t i = 0; i < batch->count; ++i) {
+        if (batch->authors[i] != REGISTRY_NO_SLOT) delivery.authors[delivery.author_count++] = batch->authors[i];
+    }
+    qsort(delivery.authors, delivery.author_count, sizeof(u_int32_t), server_compare_slots);
+    size_t distinct = 0;
+    for (size_t i = 0; i < delivery.author_count; ++i) {
+        if (distinct == 0 || delivery.authors[i] != delivery.authors[distinct - 1]) {
+            delivery.authors[distinct++] = delivery.authors[i];
+        }
+    }
+    delivery.author_count = distinct;
+
+    // Every shard but the first wakes a thread, so small broadcasts are delivered by fewer shards
+    run_fanout(context->fanout, context->connections->count / FANOUT_MIN_CONNECTIONS, server_deliver_shard, &delivery);
+}
+
+void server_broadcast_message(SharedBuffer *buffer, size_t size, QMessage *q_message, ServerContext *context, bool send_to_author) {
+    BroadcastBatch batch = {.buffer = buffer, .size = size, .count = 1, .offsets = {0, size}};
+
+    batch.authors[0] = send_to_author ? REGISTRY_NO_SLOT : slot_registry(context->connections, q_message->connection);
+    server_deliver_batch(&batch, context);
+}
+
+void server_broadcast_batch(BroadcastBatch *batch, ServerContext *context) {
+    if (batch->buffer == NULL) return;
+    server_deliver_batch(batch, context);
+
+    release_shared_buffer(batch->buffer);
+    batch->buffer = NULL;
+    batch->count = 0;
+    batch->size = 0;
+}
+
+void server_release_connection(Connection *connection) {
+    close_connection(connection);
+    empty_connection(connection);
+    release_object(connection);
+}
+
+// Returns whether the message was the last one of a closed connection, which can then be announced as gone
+bool server_settle_received_message(QMessage *q_message) {
+    Connection *connection = q_message->connection;
+
+    free_message(q_message);
+    return __atomic_sub_fetch(&connection->queued, 1, __ATOMIC_ACQ_REL) == 0 && connection->closed;
+}
+
+void server_print_queue(Queue *queue) {
+    printf("Queue depth: control %zu, chat %zu, bulk %zu\n",
+           depth_queue(queue, QUEUE_LANE_CONTROL),
+           depth_queue(queue, QUEUE_LANE_CHAT),
+           depth_queue(queue, QUEUE_LANE_BULK));
+}
+
+void server_print_shards(ServerContext *context) {
+    printf("Connections per shard:");
+    for (u_int32_t i = 0; i < context->shard_count; ++i) {
+        printf(" %u", __atomic_load_n(&context->shards[i].connections, __ATOMIC_RELAXED));
+    }
+    printf("\n");
+}
+
+void server_print_load(ServerContext *context) {
+    printf("Shard load:");
+    for (u_int32_t i = 0; i < context->shard_count; ++i) {
+        Shard *shard = &context->shards[i];
+        printf(" #%u %u connections, %lu accepted, %lu handed over, %lu events, %lu bytes received%s",
+               shard->index,
+               __atomic_load_n(&shard->connections, __ATOMIC_RELAXED),
+               __atomic_load_n(&shard->accepted, __ATOMIC_RELAXED),
+               __atomic_load_n(&shard->handed, __ATOMIC_RELAXED),
+               __atomic_load_n(&shard->events, __ATOMIC_RELAXED),
+               __atomic_load_n(&shard->received, __ATOMIC_RELAXED),
+               i + 1 < context->shard_count ? ";" : "\n");
+    }
+}
+
+void server_print_fanout(ServerContext *context) {
+    Fanout *fanout = context->fanout;
+
+    printf("Fan-out:");
+    for (u_int32_t i = 0; i < fanout->count; ++i) {
+        FanoutShard *shard = &fanout->shards[i];
+        u_int64_t runs = __atomic_load_n(&shard->runs, __ATOMIC_RELAXED);
+        printf(" #%u %lu runs, %lu us average, %lu us slowest%s",
+               shard->index,
+               runs,
+               runs > 0 ? __atomic_load_n(&shard->busy, __ATOMIC_RELAXED) / runs / 1000 : 0,
+               __atomic_load_n(&shard->slowest, __ATOMIC_RELAXED) / 1000,
+               i + 1 < fanout->count ? ";" : "\n");
+    }
+}
+
+void server_print_outbound(ServerContext *context) {
+    Registry *registry = context->connections;
+    Connection *largest = NULL;
+    size_t buffered = 0;
+    size_t buffering = 0;
+    u_int64_t dropped = context->dropped;
+
+    for (u_int32_t i = 0; i < registry->count; ++i) {
+        Outbound *outbound = &registry->connections[i]->outbound;
+        dropped += outbound->dropped;
+        if (outbound->size == 0) continue;
+        buffered += outbound->size;
+        ++buffering;
+        if (largest == NULL || outbound->size > largest->outbound.size) largest = registry->connections[i];
+    }
+    printf("Outbound: %zu bytes buffered by %zu clients", buffered, buffering);
+    if (largest != NULL) printf(" (largest %zu by %lx)", largest->outbound.size, largest->name);
+    printf(", %lu messages dropped, %lu slow consumers evicted\n", dropped, context->evictions);
+}
+
+void server_print_memory(ServerContext *context) {
+    Registry *registry = context->connections;
+    size_t receiving = 0;
+    size_t sending = 0;
+
+    for (u_int32_t i = 0; i < context->shard_count; ++i) {
+        receiving += __atomic_load_n(&context->shards[i].receive_bytes, __ATOMIC_RELAXED);
+    }
+    for (u_int32_t i = 0; i < registry->count; ++i) {
+        SharedBuffer *slices = registry->connections[i]->outbound.slices;
+        if (slices != NULL) sending += slices->capacity;
+    }
+    // Every connection holds its state and its handler arguments, buffers are only attached while data is in flight
+    printf("Memory: %zu bytes per idle connection, %zu bytes of receive buffers, %zu bytes of send queues\n",
+           sizeof(Connection) + sizeof(HandlerArgs), receiving, sending);
+}
+
+void server_print_pools(ServerContext *context) {
+    ObjectPool *pools[] = {context->connection_pool, context->handler_pool, context->message_pool};
+
+    printf("Pools:");
+    for (size_t i = 0; i < sizeof(pools) / sizeof(pools[0]); ++i) {
+        u_int64_t acquired = __atomic_load_n(&pools[i]->acquired, __ATOMIC_RELAXED);
+        u_int64_t reused = __atomic_load_n(&pools[i]->reused, __ATOMIC_RELAXED);
+        printf(" %s %lu%% reused, %lu live, %lu high water%s",
+               pools[i]->name,
+               acquired > 0 ? reused * 100 / acquired : 0,
+               __atomic_load_n(&pools[i]->live, __ATOMIC_RELAXED),
+               __atomic_load_n(&pools[i]->high_water, __ATOMIC_RELAXED),
+               i + 1 < sizeof(pools) / sizeof(pools[0]) ? ";" : "\n");
+    }
+}
 
-        send_connection(client_connection, buffer, strlen(buffer));
+void server_record_message(ServerContext *context, char *data, size_t size) {
+    add_recent_messages(context->recent_messages, data, size);
+    if (context->journal != NULL && !append_journal(context->journal, data, size)) {
+        printf("Cannot append message to journal\n");
     }
 }
 
 void server_handle_start_listening(QMessage *q_message, ServerContext *context) {
-    char buffer[MESSAGE_SIZE] = {0};
+    char buffer[MESSAGE_SIZE];
+    char notice[] = "Started listening\n";
 
-    sprintf(buffer, "Started listening\n");
-    add_recent_messages(context->recent_messages, buffer);
+    // Every shard reports its start, only the first one is kept in the history
+    if (context->listening++ > 0) return;
+    size_t size = format_message(
+            buffer,
+            notice,
+            sizeof(notice) - 1,
+            NULL,
+            MESSAGE_NOTICE,
+            next_recent_messages(context->recent_messages));
+    server_record_message(context, buffer, size);
     printf("%s", buffer);
 }
 
 void server_handle_stop_listening(QMessage *qMessage, ServerContext *context) {
-    printf("Stopped listening\n");
+    if (context->listening > 0) --context->listening;
+    printf("Stopped listening (%u of %u shards left)\n", context->listening, context->shard_count);
 }
 
 void server_handle_open_connection(QMessage *q_message, ServerContext *context) {
-    char buffer[MESSAGE_SIZE] = {0};
-
-    set_table(
-            context->connections,
-            &q_message->connection->fd,
-            sizeof(q_message->connection->fd),
-            q_message->connection);
-    format_message(
-            buffer,
-            q_message->payload,
+    // Messages added since the client was sent the recent messages reach it before the next broadcast
+    send_range_recent_messages(
             q_message->connection,
-            MESSAGE_CONNECTED);
-    add_recent_messages(
             context->recent_messages,
-            buffer);
+            q_message->connection->replayed);
+    // A reconnecting client may get the name of its previous connection before it is unregistered
+    while (find_name_registry(context->connections, q_message->connection->name) != NULL) {
+        rename_connection(q_message->connection);
+    }
+    if (!add_registry(context->connections, q_message->connection)) {
+        // The reactor sees the connection shut down and reports its close, which releases it without a notice
+        printf("Cannot register connection with %lx\n", q_message->connection->name);
+        shutdown(q_message->connection->fd, SHUT_RDWR);
+        return;
+    }
+    q_message->connection->registered = true;
+    SharedBuffer *buffer = acquire_shared_buffer(context->pool, MESSAGE_SIZE);
+    if (buffer == NULL) {
+        printf("Cannot allocate broadcast buffer\n");
+        return;
+    }
+    size_t size = format_message(
+            buffer->data,
+            q_message->payload,
+            q_message->size,
+            q_message->connection,
+            MESSAGE_CONNECTED,
+            next_recent_messages(context->recent_messages));
+    server_record_message(
+            context,
+            buffer->data,
+            size);
     server_broadcast_message(
             buffer,
+            size,
             q_message,
             context,
             false);
-    printf("%s", buffer);
+    printf("%s", buffer->data);
+    release_shared_buffer(buffer);
+    server_print_shards(context);
+}
+
+// Broadcasts that a closed connection is gone and releases it, once its last messages have been broadcast
+void server_announce_close(Connection *connection, ServerContext *context) {
+    // A connection that could not be registered has never been announced either
+    if (!connection->registered) {
+        server_release_connection(connection);
+        return;
+    }
+    SharedBuffer *buffer = acquire_shared_buffer(context->pool, MESSAGE_SIZE);
+    if (buffer != NULL) {
+        size_t size = format_message(
+                buffer->data,
+                NULL,
+                0,
+                connection,
+                MESSAGE_DISCONNECTED,
+                next_recent_messages(context->recent_messages));
+        server_record_message(
+                context,
+                buffer->data,
+                size);
+        // The connection has left the registry, there is no author to skip
+        server_broadcast_message(
+                buffer,
+                size,
+                NULL,
+                context,
+                true);
+        printf("%s", buffer->data);
+        release_shared_buffer(buffer);
+    } else {
+        printf("Cannot allocate broadcast buffer\n");
+    }
+    context->dropped += connection->outbound.dropped;
+    if (connection->outbound.evicted) {
+        ++context->evictions;
+        printf("Evicted slow consumer %lx\n", connection->name);
+    }
+    server_release_connection(connection);
 }
 
 void server_handle_close_connection(QMessage *q_message, ServerContext *context) {
-    char buffer[MESSAGE_SIZE] = {0};
-
-    sprintf(buffer, "Closed connection with %lx\n", q_message->connection->name);
-    clear_table(
-            context->connections,
-            &q_message->connection->fd,
-            sizeof(q_message->connection->fd));
-    format_message(
-            buffer,
-            q_message->payload,
-            q_message->connection,
-            MESSAGE_DISCONNECTED);
-    add_recent_messages(
-            context->recent_messages,
-            buffer);
-    server_broadcast_message(
-            buffer,
-            q_message,
-            context,
-            false);
-    empty_connection(q_message->connection);
-    free(q_message->connection);
-    printf("%s", buffer);
+    remove_registry(context->connections, q_message->connection);
+    // Received messages still queued are broadcast before the connection is announced as gone
+    q_message->connection->closed = true;
+    if (__atomic_load_n(&q_message->connection->queued, __ATOMIC_ACQUIRE) == 0) {
+        server_announce_close(q_message->connection, context);
+    }
+    server_print_shards(context);
 }
 
-void server_handle_received_message(QMessage *q_message, ServerContext *context) {
-    char buffer[MESSAGE_SIZE] = {0};
-    format_message(
+void server_handle_writable(QMessage *q_message, ServerContext *context) {
+    flush_connection(q_message->connection);
+}
+
+void server_batch_received_message(QMessage *q_message, BroadcastBatch *batch, ServerContext *context) {
+    char *buffer = batch->buffer->data + batch->size;
+
+    size_t size = format_message(
             buffer,
             q_message->payload,
+            q_message->size,
             q_message->connection,
-            MESSAGE_SENT);
-    add_recent_messages(
-            context->recent_messages,
-            q_message->payload);
-    server_broadcast_message(
-            buffer,
-            q_message,
+            MESSAGE_SENT,
+            next_recent_messages(context->recent_messages));
+    server_record_message(
             context,
-            false);
+            buffer,
+            size);
+    batch->authors[batch->count] = slot_registry(context->connections, q_message->connection);
+    batch->offsets[batch->count] = batch->size;
+    batch->size += size;
+    batch->offsets[++batch->count] = batch->size;
     printf("QMessage received (%lu) from %lx\n",
-           strlen(q_message->payload),
+           q_message->size,
            q_message->connection->name);
 }
 
 void server_handle_queue(QMessage *q_message, ServerContext *context) {
     switch (q_message->type) {
         case Q_MESSAGE_NOT_SPECIFIED:
+        case Q_MESSAGE_RECEIVED:
+            // Received messages are broadcast in batches by server_handle_queue_batch
             break;
         case Q_MESSAGE_START_LISTENING:
             server_handle_start_listening(q_message, context);
@@ -106,8 +363,8 @@ void server_handle_queue(QMessage *q_message, ServerContext *context) {
         case Q_MESSAGE_CLOSE_CONNECTION:
             server_handle_close_connection(q_message, context);
             break;
-        case Q_MESSAGE_RECEIVED:
-            server_handle_received_message(q_message, context);
+        case Q_MESSAGE_WRITABLE:
+            server_handle_writable(q_message, context);
             break;
         case Q_MESSAGE_STRIKE:
         case Q_MESSAGE_BAN:
@@ -117,6 +374,45 @@ void server_handle_queue(QMessage *q_message, ServerContext *context) {
     }
 }
 
+size_t server_measure_batch(QMessage *q_messages, size_t count) {
+    size_t capacity = 0;
+
+    for (size_t i = 0; i < count && q_messages[i].type == Q_MESSAGE_RECEIVED; ++i) {
+        capacity += q_messages[i].size + MESSAGE_FORMATTING_SIZE;
+    }
+    return capacity;
+}
+
+void server_handle_queue_batch(QMessage *q_messages, size_t count, ServerContext *context) {
+    BroadcastBatch batch = {.buffer = NULL, .count = 0, .size = 0};
+
+    for (size_t i = 0; i < count; ++i) {
+        if (q_messages[i].type == Q_MESSAGE_RECEIVED) {
+            Connection *connection = q_messages[i].connection;
+            // The lines of a connection that could not be registered are dropped along with it
+            if (connection->registered) {
+                // The buffer is sized for the chat messages up to the next event, which are broadcast together
+                if (batch.buffer == NULL) {
+                    batch.buffer = acquire_shared_buffer(context->pool, server_measure_batch(q_messages + i, count - i));
+                }
+                if (batch.buffer != NULL) server_batch_received_message(&q_messages[i], &batch, context);
+                else printf("Cannot allocate broadcast buffer\n");
+            }
+            if (server_settle_received_message(&q_messages[i])) {
+                // The last messages of a closed connection reach clients before it is announced as gone
+                server_broadcast_batch(&batch, context);
+                server_announce_close(connection, context);
+            }
+            continue;
+        }
+        // Chat messages batched so far must reach clients before the event changes the connections
+        server_broadcast_batch(&batch, context);
+        server_handle_queue(&q_messages[i], context);
+        free_message(&q_messages[i]);
+    }
+    server_broadcast_batch(&batch, context);
+}
+
 void server_serve() {
     ServerContext *context = initialize_server_context();
     if (context == NULL) {
@@ -126,21 +422,57 @@ void server_serve() {
     Queue *queue = open_queue(QUEUE_MODE_READ);
     if (queue == NULL) {
         printf("Cannot open mqueue\n");
+        free_server_context(context);
         return;
     }
-    QMessage q_message = {0};
+    context->handler_pool = init_object_pool("handlers", sizeof(HandlerArgs));
+    if (context->handler_pool == NULL) {
+        printf("Cannot allocate handler pool\n");
+        free_server_context(context);
+        close_queue(queue);
+        return;
+    }
+    QMessage q_messages[QUEUE_BATCH_SIZE];
+    size_t count;
+    time_t stats_time = time(NULL);
+    u_int32_t started = 0;
 
-    pthread_t thread_id;
-    ListenerArgs *listener_args = malloc(sizeof(ListenerArgs));
-    if (listener_args == NULL) {
-        printf("Cannot allocate listener\n");
+    // A listener thread owns its arguments, the ones of a thread that cannot be started are freed here
+    for (u_int32_t i = 0; i < context->shard_count; ++i) {
+        pthread_t thread_id;
+        ListenerArgs *listener_args = malloc(sizeof(ListenerArgs));
+        if (listener_args == NULL) {
+            printf("Cannot allocate listener\n");
+            continue;
+        }
+        listener_args->context = context;
+        listener_args->shard = &context->shards[i];
+        if (pthread_create(&thread_id, NULL, listen_connections, (void *) listener_args) != 0) {
+            printf("Cannot start listener\n");
+            free(listener_args);
+            continue;
+        }
+        ++started;
+    }
+    // The context is shared with the listener threads once one is started, it is only freed if none is
+    if (started == 0) {
+        free_server_context(context);
+        close_queue(queue);
         return;
     }
-    listener_args->context = context;
-    pthread_create(&thread_id, NULL, listen_connections, (void *) listener_args);
 
-    while (read_queue(queue, &q_message)) {
-        server_handle_queue(&q_message, context);
+    while ((count = read_queue_batch(queue, q_messages, QUEUE_BATCH_SIZE)) > 0) {
+        server_handle_queue_batch(q_messages, count, context);
+        // Messages of the whole batch are committed to the journal at once, the disk is written in the background
+        if (context->journal != NULL) commit_journal(context->journal);
+        if (time(NULL) - stats_time < SERVER_STATS_INTERVAL) continue;
+        server_print_queue(queue);
+        server_print_load(context);
+        server_print_fanout(context);
+        server_print_outbound(context);
+        server_print_memory(context);
+        server_print_pools(context);
+        stats_time = time(NULL);
     }
     printf("Main Loop left\n");
     free_server_context(context);
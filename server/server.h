@@ -13,23 +13,113 @@
 #include "context.h"
 
 
+/**
+ * Structure representing chat messages broadcast together.
+ *
+ * This structure collects the formatted chat messages read from the queue in one batch
+ * into a single contiguous buffer, so every client receives all of them with one send.
+ * The buffer is shared by the clients that cannot take it right away and kept until the last one has sent it.
+ *
+ * The structure fields are defined as follows:
+ *  - buffer: A pointer to the SharedBuffer holding the formatted messages one after another,
+ *    NULL until the first message is added.
+ *  - size: The number of bytes used in the buffer.
+ *  - count: The number of messages in the buffer.
+ *  - offsets: The offset of every message in the buffer, offsets[count] equals size.
+ *  - authors: The registry slot of the connection every message was received from, or REGISTRY_NO_SLOT
+ *    if it is no longer registered. Slots are taken when a message is added, as the connection can be
+ *    released before the batch is broadcast, and stay valid as the registry only changes between batches.
+ *
+ * Example usage:
+ * @code
+ * BroadcastBatch batch = {.buffer = acquire_shared_buffer(context->pool, capacity), .count = 0, .size = 0};
+ * server_batch_received_message(&q_message, &batch, context);
+ * server_broadcast_batch(&batch, context);
+ * @endcode
+ */
+typedef struct {
+    SharedBuffer *buffer;
+    size_t size;
+    size_t count;
+    size_t offsets[QUEUE_BATCH_SIZE + 1];
+    u_int32_t authors[QUEUE_BATCH_SIZE];
+} BroadcastBatch;
+
+
+/**
+ * Structure representing a broadcast batch handed to the fan-out shards.
+ *
+ * The live connections are split into as many contiguous ranges of registry slots as there are shards
+ * taking part, and every shard delivers the batch to the connections of its own range in parallel.
+ * A connection always belongs to a single shard during a delivery and deliveries do not overlap,
+ * so every client gets the messages in order.
+ *
+ * The structure fields are defined as follows:
+ *  - context: A pointer to the ServerContext structure holding the registry and the rings of the shards.
+ *  - batch: A pointer to the BroadcastBatch structure to be delivered.
+ *  - authors: The distinct registry slots of the authors of the messages in increasing order.
+ *  - author_count: The number of slots in authors.
+ *
+ * Example usage:
+ * @code
+ * BroadcastDelivery delivery = {.context = context, .batch = &batch, .author_count = 0};
+ * run_fanout(context->fanout, context->fanout->count, server_deliver_shard, &delivery);
+ * @endcode
+ */
+typedef struct {
+    ServerContext *context;
+    BroadcastBatch *batch;
+    u_int32_t authors[QUEUE_BATCH_SIZE];
+    size_t author_count;
+} BroadcastDelivery;
+
+
+/**
+ * Handles a batch of messages read from the queue in one pass.
+ *
+ * This function handles the messages in order. Consecutive received chat messages are formatted
+ * into a BroadcastBatch and broadcast together, other messages are handled with the server_handle_queue function
+ * after the chat messages preceding them in the batch have been broadcast.
+ * A chat message is never read before the open event of its connection, but control events are read ahead
+ * of chat messages sent before them, so a connection closed by its peer is removed from the table
+ * right away, but it is only announced as disconnected and released once its chat messages still in the queue
+ * have been broadcast, so its last lines always come before its close notice.
+ *
+ * @param q_messages An array of messages read from the queue.
+ * @param count The number of messages in the array.
+ * @param context A pointer to the server context.
+ *
+ * Example usage:
+ * @code
+ * size_t count = read_queue_batch(queue, q_messages, QUEUE_BATCH_SIZE);
+ * server_handle_queue_batch(q_messages, count, context);
+ * @endcode
+ */
+void server_handle_queue_batch(QMessage *q_messages, size_t count, ServerContext *context);
+
+
 /**
  * Starts serving requests on the server.
  *
  * This function initializes the server context, opens a message queue for reading,
- * and starts a listener thread to accept incoming connections. It then enters a loop
- * to continuously read messages from the message queue and handle them using the
- * server_handle_queue function. Finally, it cleans up resources and exits.
+ * and starts a listener thread per listener shard to accept incoming connections. It then enters a loop
+ * to continuously read batches of messages from the message queue and handle them using the
+ * server_handle_queue_batch function. Finally, it cleans up resources and exits.
  *
  * The function performs the following steps:
  * 1. Initializes the server context using the initialize_server_context function.
  *    If initialization fails, prints an error message and returns.
  * 2. Opens a message queue for reading using the open_queue function.
  *    If opening the queue fails, prints an error message and returns.
- * 3. Creates a listener thread to accept incoming connections using the listen_connections function.
+ *    Initializes the pool of handler arguments used by the reactors.
+ * 3. Creates a listener thread per listener shard to accept incoming connections using the listen_connections function.
  *    If thread creation fails or memory allocation fails, prints an error message and returns.
- * 4. Enters a loop to continuously read messages from the message queue using the read_queue function.
- *    For each message read, it is handled using the server_handle_queue function.
+ * 4. Enters a loop to continuously read batches of messages from the message queue using the read_queue_batch
+ *    function. Every batch is handled in one pass using the server_handle_queue_batch function,
+ *    then the messages it added to the journal are written to disk at once.
+ *    Every SERVER_STATS_INTERVAL seconds of activity, prints the depth of the queue lanes, the load of every
+ *    listener shard, the delivery time of every fan-out shard, the waiting outbound bytes, the memory held by the connections and the statistics
+ *    of the object pools.
  * 5. Prints a message indicating that the main loop has exited.
  * 6. Frees the memory associated with the server context using the free_server_context function.
  * 7. Closes the message queue.
@@ -0,0 +1,72 @@
+#include "shared_buffer.h"
+
+
+SharedPool *init_shared_pool() {
+    SharedPool *pool = calloc(1, sizeof(SharedPool));
+    if (pool == NULL) return NULL;
+    pthread_mutex_init(&pool->lock, NULL);
+    return pool;
+}
+
+SharedBuffer *acquire_shared_buffer(SharedPool *pool, size_t capacity) {
+    u_int8_t size_class = 0;
+    while (size_class < SHARED_BUFFER_CLASSES && ((size_t) SHARED_BUFFER_MIN_SIZE << size_class) < capacity) {
+        ++size_class;
+    }
+    if (pool == NULL || size_class == SHARED_BUFFER_CLASSES) size_class = SHARED_BUFFER_UNPOOLED;
+
+    SharedBuffer *buffer = NULL;
+    if (size_class != SHARED_BUFFER_UNPOOLED) {
+        pthread_mutex_lock(&pool->lock);
+        buffer = pool->free[size_class];
+        if (buffer != NULL) {
+            pool->free[size_class] = buffer->next;
+            --pool->count[size_class];
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+    if (buffer == NULL) {
+        if (size_class != SHARED_BUFFER_UNPOOLED) capacity = (size_t) SHARED_BUFFER_MIN_SIZE << size_class;
+        buffer = malloc(sizeof(SharedBuffer) + capacity);
+        if (buffer == NULL) return NULL;
+        buffer->pool = size_class != SHARED_BUFFER_UNPOOLED ? pool : NULL;
+        buffer->size_class = size_class;
+        buffer->capacity = capacity;
+    }
+    buffer->next = NULL;
+    buffer->references = 1;
+    return buffer;
+}
+
+void retain_shared_buffer(SharedBuffer *buffer) {
+    __atomic_add_fetch(&buffer->references, 1, __ATOMIC_RELAXED);
+}
+
+void release_shared_buffer(SharedBuffer *buffer) {
+    if (__atomic_sub_fetch(&buffer->references, 1, __ATOMIC_ACQ_REL) > 0) return;
+
+    SharedPool *pool = buffer->pool;
+    if (pool != NULL) {
+        pthread_mutex_lock(&pool->lock);
+        if (pool->count[buffer->size_class] < SHARED_POOL_DEPTH) {
+            buffer->next = pool->free[buffer->size_class];
+            pool->free[buffer->size_class] = buffer;
+            ++pool->count[buffer->size_class];
+            buffer = NULL;
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+    free(buffer);
+}
+
+void free_shared_pool(SharedPool *pool) {
+    for (u_int8_t i = 0; i < SHARED_BUFFER_CLASSES; ++i) {
+        while (pool->free[i] != NULL) {
+            SharedBuffer *buffer = pool->free[i];
+            pool->free[i] = buffer->next;
+            free(buffer);
+        }
+    }
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
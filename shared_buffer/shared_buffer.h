@@ -0,0 +1,151 @@
+#ifndef SERVER_SHARED_BUFFER_H
+#define SERVER_SHARED_BUFFER_H
+
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include "../definitions.h"
+
+
+// Size class of buffers too large to be kept in a pool, they are freed once released
+#define SHARED_BUFFER_UNPOOLED UINT8_MAX
+
+
+struct SharedPool;
+
+
+/**
+ * Structure representing an immutable, reference-counted buffer of formatted messages.
+ *
+ * A broadcast message is formatted once into a shared buffer, and every connection that cannot send it
+ * right away keeps a reference to it in its outbound queue instead of a copy, so broadcasting a message
+ * costs a single buffer whatever the number of clients. The buffer goes back to its pool once the last
+ * reference is released. References are atomic, as the fan-out shards of a broadcast queue and drop
+ * references to the same buffer in parallel, and the reactors share the snapshot of the recent messages.
+ *
+ * The structure fields are defined as follows:
+ *  - pool: A pointer to the SharedPool the buffer returns to, or NULL if it is freed once released.
+ *  - next: The next free buffer of the same size class while the buffer is kept in the pool.
+ *  - references: The number of holders of the buffer.
+ *  - size_class: The index of the size class of the buffer in the pool, or SHARED_BUFFER_UNPOOLED.
+ *  - capacity: The number of bytes of data.
+ *  - data: The formatted messages, which must not change while the buffer is shared.
+ *
+ * Example usage:
+ * @code
+ * SharedBuffer *buffer = acquire_shared_buffer(pool, MESSAGE_SIZE);
+ * size_t size = format_message(buffer->data, payload, payload_size, connection, MESSAGE_SENT, sequence);
+ * write_shared_connection(connection, buffer, 0, size);
+ * release_shared_buffer(buffer);
+ * @endcode
+ */
+typedef struct SharedBuffer {
+    struct SharedPool *pool;
+    struct SharedBuffer *next;
+    u_int32_t references;
+    u_int8_t size_class;
+    size_t capacity;
+    char data[];
+} SharedBuffer;
+
+
+/**
+ * Structure representing a pool of released shared buffers.
+ *
+ * Buffers are sized in classes doubling from SHARED_BUFFER_MIN_SIZE bytes, and up to SHARED_POOL_DEPTH
+ * released buffers of every class are kept to be reused, so a steady flow of broadcasts does not allocate.
+ * Buffers may be acquired and released from any thread: the released buffers are kept under a lock,
+ * only taken when a buffer is acquired or its last reference is released.
+ *
+ * The structure fields are defined as follows:
+ *  - lock: The mutex protecting the released buffers.
+ *  - free: The first released buffer of every size class.
+ *  - count: The number of released buffers kept for every size class.
+ */
+typedef struct SharedPool {
+    pthread_mutex_t lock;
+    SharedBuffer *free[SHARED_BUFFER_CLASSES];
+    u_int32_t count[SHARED_BUFFER_CLASSES];
+} SharedPool;
+
+
+/**
+ * Initializes an empty pool of shared buffers.
+ *
+ * @return A pointer to the initialized SharedPool structure, or NULL if memory allocation fails.
+ *
+ * Example usage:
+ * @code
+ * SharedPool *pool = init_shared_pool();
+ * if (pool == NULL) {
+ *     // Error: Failed to allocate the pool.
+ * }
+ * @endcode
+ */
+SharedPool *init_shared_pool();
+
+
+/**
+ * Takes a shared buffer able to hold the specified number of bytes.
+ *
+ * The buffer is held once by the caller, who fills it before sharing it and releases it when done.
+ *
+ * @param pool A pointer to the SharedPool structure to take the buffer from, or NULL to allocate it on its own.
+ * @param capacity The number of bytes the buffer must hold.
+ *
+ * @return A pointer to the shared buffer, or NULL if memory allocation fails.
+ *
+ * The function performs the following steps:
+ * 1. Finds the smallest size class holding the capacity.
+ * 2. Reuses a released buffer of the class if the pool keeps one.
+ * 3. Otherwise allocates a buffer of the size of the class, or of the exact capacity if it exceeds every class
+ *    or no pool is given.
+ *
+ * Example usage:
+ * @code
+ * SharedBuffer *buffer = acquire_shared_buffer(pool, MESSAGE_SIZE);
+ * @endcode
+ */
+SharedBuffer *acquire_shared_buffer(SharedPool *pool, size_t capacity);
+
+
+/**
+ * Adds a holder to a shared buffer.
+ *
+ * @param buffer A pointer to the SharedBuffer structure.
+ */
+void retain_shared_buffer(SharedBuffer *buffer);
+
+
+/**
+ * Removes a holder from a shared buffer.
+ *
+ * Once the last holder is removed, the buffer is kept in its pool if the pool of its size class is not full,
+ * otherwise it is freed.
+ *
+ * @param buffer A pointer to the SharedBuffer structure.
+ *
+ * Example usage:
+ * @code
+ * retain_shared_buffer(buffer);
+ * // Send the buffer later
+ * release_shared_buffer(buffer);
+ * @endcode
+ */
+void release_shared_buffer(SharedBuffer *buffer);
+
+
+/**
+ * Frees the pool and the released buffers it keeps.
+ *
+ * The pool must not be freed while buffers taken from it are still held.
+ *
+ * @param pool A pointer to the SharedPool structure to be freed.
+ */
+void free_shared_pool(SharedPool *pool);
+
+
+#endif //SERVER_SHARED_BUFFER_H
@@ -0,0 +1,301 @@
+#include "uring.h"
+
+
+static int32_t setup_ring(u_int32_t entries, struct io_uring_params *params) {
+    return (int32_t) syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int32_t enter_ring(int32_t fd, u_int32_t to_submit, u_int32_t min_complete, u_int32_t flags) {
+    return (int32_t) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int32_t register_ring(int32_t fd, u_int32_t opcode, void *arg, u_int32_t count) {
+    return (int32_t) syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+
+Ring *init_ring(u_int32_t entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    Ring *ring = calloc(1, sizeof(Ring));
+    if (ring == NULL) return NULL;
+
+    ring->fd = setup_ring(entries, &params);
+    if (ring->fd < 0) {
+        free(ring);
+        return NULL;
+    }
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(u_int32_t);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size) ring->sq_ring_size = ring->cq_ring_size;
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        close(ring->fd);
+        free(ring);
+        return NULL;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            ring->cq_ring = NULL;
+            free_ring(ring);
+            return NULL;
+        }
+    }
+
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        free_ring(ring);
+        return NULL;
+    }
+
+    char *sq = ring->sq_ring;
+    char *cq = ring->cq_ring;
+    ring->sq_head = (u_int32_t *) (sq + params.sq_off.head);
+    ring->sq_tail = (u_int32_t *) (sq + params.sq_off.tail);
+    ring->sq_mask = *(u_int32_t *) (sq + params.sq_off.ring_mask);
+    ring->sq_array = (u_int32_t *) (sq + params.sq_off.array);
+    ring->sq_entries = params.sq_entries;
+    ring->cq_head = (u_int32_t *) (cq + params.cq_off.head);
+    ring->cq_tail = (u_int32_t *) (cq + params.cq_off.tail);
+    ring->cq_mask = *(u_int32_t *) (cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+    ring->pending = 0;
+
+    return ring;
+}
+
+struct io_uring_sqe *get_sqe_ring(Ring *ring) {
+    u_int32_t head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    u_int32_t tail = *ring->sq_tail + ring->pending;
+
+    if (tail - head >= ring->sq_entries) return NULL;
+
+    u_int32_t index = tail & ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    ++ring->pending;
+    return sqe;
+}
+
+int32_t submit_ring(Ring *ring, u_int32_t wait) {
+    u_int32_t submitted = ring->pending;
+    u_int32_t flags = wait > 0 ? IORING_ENTER_GETEVENTS : 0;
+    int32_t result;
+
+    __atomic_store_n(ring->sq_tail, *ring->sq_tail + ring->pending, __ATOMIC_RELEASE);
+    ring->pending = 0;
+
+    do {
+        result = enter_ring(ring->fd, submitted, wait, flags);
+    } while (result < 0 && errno == EINTR);
+    return result;
+}
+
+struct io_uring_cqe *peek_ring(Ring *ring) {
+    u_int32_t head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) return NULL;
+    return &ring->cqes[head & ring->cq_mask];
+}
+
+void advance_ring(Ring *ring) {
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+bool provide_buffers_ring(Ring *ring, u_int32_t count, size_t size) {
+    size_t ring_size = count * sizeof(struct io_uring_buf);
+
+    ring->buffers = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->buffers == MAP_FAILED) {
+        ring->buffers = NULL;
+        return false;
+    }
+    ring->buffer_storage = malloc(count * size);
+    if (ring->buffer_storage == NULL) {
+        munmap(ring->buffers, ring_size);
+        ring->buffers = NULL;
+        return false;
+    }
+
+    struct io_uring_buf_reg registration = {
+            .ring_addr = (u_int64_t) (uintptr_t) ring->buffers,
+            .ring_entries = count,
+            .bgid = RING_BUFFER_GROUP
+    };
+    if (register_ring(ring->fd, IORING_REGISTER_PBUF_RING, &registration, 1) != 0) {
+        munmap(ring->buffers, ring_size);
+        free(ring->buffer_storage);
+        ring->buffers = NULL;
+        ring->buffer_storage = NULL;
+        return false;
+    }
+
+    ring->buffer_count = count;
+    ring->buffer_size = size;
+    ring->buffer_tail = 0;
+    for (u_int32_t i = 0; i < count; ++i) recycle_buffer_ring(ring, i);
+    return true;
+}
+
+char *get_buffer_ring(Ring *ring, u_int16_t id) {
+    return ring->buffer_storage + (size_t) id * ring->buffer_size;
+}
+
+void recycle_buffer_ring(Ring *ring, u_int16_t id) {
+    struct io_uring_buf *buffer = &ring->buffers->bufs[ring->buffer_tail & (ring->buffer_count - 1)];
+    buffer->addr = (u_int64_t) (uintptr_t) get_buffer_ring(ring, id);
+    buffer->len = ring->buffer_size;
+    buffer->bid = id;
+    ++ring->buffer_tail;
+    __atomic_store_n(&ring->buffers->tail, ring->buffer_tail, __ATOMIC_RELEASE);
+}
+
+bool prepare_accept_ring(Ring *ring, int32_t fd, u_int64_t user_data) {
+    struct io_uring_sqe *sqe = get_sqe_ring(ring);
+    if (sqe == NULL) return false;
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK;
+    sqe->user_data = user_data;
+    return true;
+}
+
+bool prepare_recv_ring(Ring *ring, int32_t fd, u_int64_t user_data) {
+    struct io_uring_sqe *sqe = get_sqe_ring(ring);
+    if (sqe == NULL) return false;
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = RING_BUFFER_GROUP;
+    sqe->user_data = user_data;
+    return true;
+}
+
+bool prepare_poll_ring(Ring *ring, int32_t fd, u_int32_t events, u_int64_t user_data) {
+    struct io_uring_sqe *sqe = get_sqe_ring(ring);
+    if (sqe == NULL) return false;
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->poll32_events = events;
+    sqe->user_data = user_data;
+    return true;
+}
+
+bool prepare_poll_remove_ring(Ring *ring, u_int64_t target, u_int64_t user_data) {
+    struct io_uring_sqe *sqe = get_sqe_ring(ring);
+    if (sqe == NULL) return false;
+
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = target;
+    sqe->user_data = user_data;
+    return true;
+}
+
+bool prepare_timeout_ring(Ring *ring, struct __kernel_timespec *timeout, u_int64_t user_data) {
+    struct io_uring_sqe *sqe = get_sqe_ring(ring);
+    if (sqe == NULL) return false;
+
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (u_int64_t) (uintptr_t) timeout;
+    sqe->len = 1;
+    sqe->off = 0;
+    sqe->user_data = user_data;
+    return true;
+}
+
+bool prepare_send_ring(Ring *ring, int32_t fd, void *buffer, size_t size, u_int64_t user_data) {
+    struct io_uring_sqe *sqe = get_sqe_ring(ring);
+    if (sqe == NULL) return false;
+
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = fd;
+    sqe->addr = (u_int64_t) (uintptr_t) buffer;
+    sqe->len = size;
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_DONTWAIT;
+    sqe->user_data = user_data;
+    return true;
+}
+
+// Connections with bytes already waiting must not get the buffer ahead of them
+static bool queued_ring(Connection *connection) {
+    return connection->outbound.size > 0 || connection->outbound.evicted;
+}
+
+void send_batch_ring(Ring *ring, Connection **connections, size_t count, SharedBuffer *buffer, size_t offset, size_t size) {
+    char *data = buffer->data + offset;
+    size_t index = 0;
+
+    for (size_t i = 0; i < count; ++i) {
+        if (queued_ring(connections[i])) write_shared_connection(connections[i], buffer, offset, size);
+    }
+    while (index < count) {
+        size_t first = index;
+        u_int32_t expected = 0;
+        for (; index < count; ++index) {
+            if (queued_ring(connections[index])) continue;
+            if (!prepare_send_ring(ring, connections[index]->fd, data, size, index)) break;
+            ++expected;
+        }
+
+        if (submit_ring(ring, expected) < 0) {
+            // Ring is unusable, deliver the rest of the batch with plain writes
+            for (size_t i = first; i < count; ++i) {
+                if (!queued_ring(connections[i])) write_shared_connection(connections[i], buffer, offset, size);
+            }
+            return;
+        }
+
+        // The buffer must stay untouched until every send of the batch completes
+        struct io_uring_cqe *cqe;
+        while (expected > 0) {
+            if ((cqe = peek_ring(ring)) == NULL) {
+                submit_ring(ring, 1);
+                continue;
+            }
+            Connection *connection = connections[cqe->user_data];
+            int32_t result = cqe->res;
+            advance_ring(ring);
+            --expected;
+
+            if (result == -EAGAIN) result = 0;
+            if (result >= 0 && (size_t) result < size) {
+                write_shared_connection(connection, buffer, offset + result, size - result);
+            }
+        }
+    }
+}
+
+void free_ring(Ring *ring) {
+    if (ring->buffers != NULL) {
+        struct io_uring_buf_reg registration = {.bgid = RING_BUFFER_GROUP};
+        register_ring(ring->fd, IORING_UNREGISTER_PBUF_RING, &registration, 1);
+        munmap(ring->buffers, ring->buffer_count * sizeof(struct io_uring_buf));
+        free(ring->buffer_storage);
+    }
+    if (ring->sqes != NULL) munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring != NULL && ring->cq_ring != ring->sq_ring) munmap(ring->cq_ring, ring->cq_ring_size);
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+    free(ring);
+}
@@ -0,0 +1,338 @@
+#ifndef SERVER_URING_H
+#define SERVER_URING_H
+
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "../connection/connection.h"
+#include "../definitions.h"
+
+
+// Buffer group id of the buffers provided to multishot receives
+#define RING_BUFFER_GROUP 0
+
+
+/**
+ * Structure representing an io_uring instance.
+ *
+ * This structure wraps the submission and completion rings shared with the kernel, as well as
+ * an optional ring of provided buffers the kernel picks from when completing receives.
+ * The rings are driven with raw system calls, so no additional library is required.
+ *
+ * The structure fields are defined as follows:
+ *  - fd: The io_uring file descriptor.
+ *  - sq_ring, cq_ring, sqes: The memory mapped submission ring, completion ring and submission entries.
+ *  - sq_ring_size, cq_ring_size, sqes_size: The sizes of the mappings.
+ *  - sq_head, sq_tail, sq_array, sq_mask, sq_entries: The submission ring bookkeeping.
+ *  - cq_head, cq_tail, cq_mask, cqes: The completion ring bookkeeping.
+ *  - pending: The number of prepared submission entries not yet published to the kernel.
+ *  - buffers, buffer_storage: The provided buffer ring and the memory backing its buffers.
+ *  - buffer_count, buffer_size, buffer_tail: The provided buffer ring bookkeeping.
+ *
+ * Example usage:
+ * @code
+ * Ring *ring = init_ring(256);
+ * if (ring == NULL) {
+ *     // io_uring is not available, use plain sockets
+ * }
+ * @endcode
+ */
+typedef struct {
+    int32_t fd;
+    void *sq_ring;
+    void *cq_ring;
+    struct io_uring_sqe *sqes;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    size_t sqes_size;
+
+    u_int32_t *sq_head;
+    u_int32_t *sq_tail;
+    u_int32_t *sq_array;
+    u_int32_t sq_mask;
+    u_int32_t sq_entries;
+
+    u_int32_t *cq_head;
+    u_int32_t *cq_tail;
+    u_int32_t cq_mask;
+    struct io_uring_cqe *cqes;
+
+    u_int32_t pending;
+
+    struct io_uring_buf_ring *buffers;
+    char *buffer_storage;
+    u_int32_t buffer_count;
+    size_t buffer_size;
+    u_int16_t buffer_tail;
+} Ring;
+
+
+/**
+ * Initializes an io_uring instance.
+ *
+ * This function sets up an io_uring instance with the specified number of submission entries and maps
+ * its rings into the process. It returns NULL if the kernel does not support io_uring or forbids it,
+ * so callers can fall back to plain socket calls.
+ *
+ * @param entries The number of submission entries, rounded up to a power of two by the kernel.
+ *
+ * @return A pointer to the initialized Ring structure if successful, otherwise NULL.
+ *
+ * The function performs the following steps:
+ * 1. Calls io_uring_setup to create the instance. If unsuccessful, returns NULL.
+ * 2. Maps the submission ring, the completion ring (unless the kernel shares a single mapping)
+ *    and the submission entries.
+ * 3. Resolves the ring bookkeeping pointers from the offsets reported by the kernel.
+ *
+ * Example usage:
+ * @code
+ * Ring *ring = init_ring(REACTOR_RING_ENTRIES);
+ * @endcode
+ */
+Ring *init_ring(u_int32_t entries);
+
+
+/**
+ * Returns the next free submission entry of the ring.
+ *
+ * The entry is zeroed and counted as pending until submit_ring publishes it to the kernel.
+ *
+ * @param ring A pointer to the Ring structure.
+ *
+ * @return A pointer to the submission entry, or NULL if the submission ring is full.
+ *
+ * Example usage:
+ * @code
+ * struct io_uring_sqe *sqe = get_sqe_ring(ring);
+ * if (sqe == NULL) submit_ring(ring, 0);
+ * @endcode
+ */
+struct io_uring_sqe *get_sqe_ring(Ring *ring);
+
+
+/**
+ * Publishes pending submission entries and optionally waits for completions.
+ *
+ * All the prepared entries are submitted with a single io_uring_enter call.
+ *
+ * @param ring A pointer to the Ring structure.
+ * @param wait The minimal number of completions to wait for, 0 to return immediately.
+ *
+ * @return The number of submitted entries, or a negative value if io_uring_enter fails.
+ *
+ * Example usage:
+ * @code
+ * prepare_send_ring(ring, fd, buffer, size, 0);
+ * submit_ring(ring, 1);
+ * @endcode
+ */
+int32_t submit_ring(Ring *ring, u_int32_t wait);
+
+
+/**
+ * Returns the oldest unconsumed completion entry of the ring.
+ *
+ * @param ring A pointer to the Ring structure.
+ *
+ * @return A pointer to the completion entry, or NULL if there are no completions.
+ *
+ * Example usage:
+ * @code
+ * struct io_uring_cqe *cqe;
+ * while ((cqe = peek_ring(ring)) != NULL) {
+ *     // Process cqe->res and cqe->user_data
+ *     advance_ring(ring);
+ * }
+ * @endcode
+ */
+struct io_uring_cqe *peek_ring(Ring *ring);
+
+
+/**
+ * Marks the completion entry returned by peek_ring as consumed.
+ *
+ * @param ring A pointer to the Ring structure.
+ */
+void advance_ring(Ring *ring);
+
+
+/**
+ * Registers a ring of provided buffers for multishot receives.
+ *
+ * The kernel picks a buffer from this ring for every completed receive and reports its id in the
+ * completion flags, so receive buffers are only consumed by connections that actually got data.
+ * Provided buffer rings were introduced together with multishot accept, so a successful
+ * registration also means multishot accept is available.
+ *
+ * @param ring A pointer to the Ring structure.
+ * @param count The number of buffers, must be a power of two.
+ * @param size The size of every buffer in bytes.
+ *
+ * @return true if the buffers are successfully registered, otherwise false.
+ *
+ * Example usage:
+ * @code
+ * if (!provide_buffers_ring(ring, REACTOR_RING_BUFFERS, MESSAGE_BUFFER_SIZE - 1)) {
+ *     // Kernel is too old for provided buffer rings
+ * }
+ * @endcode
+ */
+bool provide_buffers_ring(Ring *ring, u_int32_t count, size_t size);
+
+
+/**
+ * Returns the memory of a provided buffer.
+ *
+ * @param ring A pointer to the Ring structure.
+ * @param id The id of the buffer reported in the completion flags.
+ *
+ * @return A pointer to the buffer.
+ */
+char *get_buffer_ring(Ring *ring, u_int16_t id);
+
+
+/**
+ * Hands a provided buffer back to the kernel once its content has been consumed.
+ *
+ * @param ring A pointer to the Ring structure.
+ * @param id The id of the buffer to be recycled.
+ */
+void recycle_buffer_ring(Ring *ring, u_int16_t id);
+
+
+/**
+ * Prepares a multishot accept on the listening socket.
+ *
+ * A single submission produces a completion for every accepted connection, accepted sockets are non-blocking.
+ *
+ * @param ring A pointer to the Ring structure.
+ * @param fd The listening socket file descriptor.
+ * @param user_data The value reported in every completion of the request.
+ *
+ * @return true if the request is prepared, false if the submission ring is full.
+ */
+bool prepare_accept_ring(Ring *ring, int32_t fd, u_int64_t user_data);
+
+
+/**
+ * Prepares a multishot receive into the provided buffers.
+ *
+ * A single submission produces a completion for every received chunk until the peer closes the connection,
+ * an error occurs or the provided buffers run out.
+ *
+ * @param ring A pointer to the Ring structure.
+ * @param fd The connection socket file descriptor.
+ * @param user_data The value reported in every completion of the request.
+ *
+ * @return true if the request is prepared, false if the submission ring is full.
+ */
+bool prepare_recv_ring(Ring *ring, int32_t fd, u_int64_t user_data);
+
+
+/**
+ * Prepares a multishot poll of the specified events on a file descriptor.
+ *
+ * A single submission produces a completion carrying the reported events every time the file descriptor
+ * becomes ready, until the poll is removed or an error occurs.
+ *
+ * @param ring A pointer to the Ring structure.
+ * @param fd The polled file descriptor.
+ * @param events The mask of the polled events, such as POLLOUT.
+ * @param user_data The value reported in every completion of the request.
+ *
+ * @return true if the request is prepared, false if the submission ring is full.
+ */
+bool prepare_poll_ring(Ring *ring, int32_t fd, u_int32_t events, u_int64_t user_data);
+
+
+/**
+ * Prepares the removal of a pending poll.
+ *
+ * The removed poll completes with -ECANCELED, the removal itself completes with 0,
+ * or -ENOENT if the poll has already terminated.
+ *
+ * @param ring A pointer to the Ring structure.
+ * @param target The user data of the poll to remove.
+ * @param user_data The value reported in the completion of the removal.
+ *
+ * @return true if the request is prepared, false if the submission ring is full.
+ */
+bool prepare_poll_remove_ring(Ring *ring, u_int64_t target, u_int64_t user_data);
+
+
+/**
+ * Prepares a timeout completing once the specified time has passed.
+ *
+ * The completion of the timeout reports -ETIME.
+ *
+ * @param ring A pointer to the Ring structure.
+ * @param timeout A pointer to the relative time to wait, it must stay valid until the request completes.
+ * @param user_data The value reported in the completion of the request.
+ *
+ * @return true if the request is prepared, false if the submission ring is full.
+ */
+bool prepare_timeout_ring(Ring *ring, struct __kernel_timespec *timeout, u_int64_t user_data);
+
+
+/**
+ * Prepares a send of the buffer over the connection socket.
+ *
+ * @param ring A pointer to the Ring structure.
+ * @param fd The connection socket file descriptor.
+ * @param buffer A pointer to the data to be sent, it must stay valid until the request completes.
+ * @param size The size of the data in bytes.
+ * @param user_data The value reported in the completion of the request.
+ *
+ * @return true if the request is prepared, false if the submission ring is full.
+ */
+bool prepare_send_ring(Ring *ring, int32_t fd, void *buffer, size_t size, u_int64_t user_data);
+
+
+/**
+ * Sends the same buffer to many connections with batched submissions.
+ *
+ * This function prepares one send per connection and submits as many of them as the submission ring holds
+ * with a single io_uring_enter call, instead of issuing one send system call per connection.
+ * The sends never wait for a slow client: connections with bytes already waiting get the buffer queued with
+ * the write_shared_connection function, and so do the bytes of sends completing partially or with EAGAIN,
+ * which keep a reference to the shared buffer instead of a copy.
+ *
+ * @param ring A pointer to the Ring structure.
+ * @param connections An array of pointers to the recipient connections.
+ * @param count The number of recipient connections.
+ * @param buffer A pointer to the SharedBuffer holding the data to be sent.
+ * @param offset The offset of the data in the buffer.
+ * @param size The size of the data in bytes.
+ *
+ * The function performs the following steps:
+ * 1. Queues the buffer for connections with bytes waiting with the write_shared_connection function.
+ * 2. Prepares send requests for the other connections until the submission ring is full or all of them are covered.
+ * 3. Submits the requests, waits for all of them to complete and queues the bytes left of partial sends.
+ * 4. Repeats with the remaining connections.
+ *
+ * Example usage:
+ * @code
+ * send_batch_ring(ring, recipients, recipient_count, buffer, 0, size);
+ * @endcode
+ */
+void send_batch_ring(Ring *ring, Connection **connections, size_t count, SharedBuffer *buffer, size_t offset, size_t size);
+
+
+/**
+ * Frees the io_uring instance, its mappings and its provided buffers.
+ *
+ * @param ring A pointer to the Ring structure to be freed.
+ */
+void free_ring(Ring *ring);
+
+
+#endif //SERVER_URING_H